@@ -0,0 +1,553 @@
+-- Benchmarks for the binding layer and common pipelines.
+--
+-- Usage: lua bench/run.lua [output.json]
+--
+-- Results are written as JSON, to stdout if no path is given. Timings use
+-- os.clock, i.e. process CPU time, so ImageMagick's worker threads are included;
+-- run with MAGICK_THREAD_LIMIT=1 for numbers comparable across machines with
+-- different core counts. Wands are never destroyed by the binding, so the
+-- iteration counts below are kept small enough not to exhaust memory.
+
+local magick = require('luamagick')
+
+local scale = tonumber(os.getenv('BENCH_SCALE')) or 1
+local tmpdir = os.getenv('TMPDIR') or '/tmp'
+
+local function check(ok, err)
+  if not ok then
+    error(tostring(err), 2)
+  end
+  return ok
+end
+
+local function measure(n, fn)
+  n = math.max(1, math.floor(n * scale))
+  collectgarbage()
+  local start = os.clock()
+  for i = 1, n do
+    fn(i)
+  end
+  local seconds = os.clock() - start
+  return {
+    iterations = n,
+    seconds = seconds,
+    ns_per_op = seconds / n * 1e9,
+  }
+end
+
+local function throughput(n, bytes, fn)
+  local r = measure(n, fn)
+  r.bytes = bytes
+  r.mb_per_second = r.seconds > 0 and bytes * r.iterations / r.seconds / 1e6 or 0
+  return r
+end
+
+local function slurp(path)
+  local f = assert(io.open(path, 'rb'))
+  local data = f:read('*a')
+  f:close()
+  return data
+end
+
+local function peak_rss_kb()
+  local f = io.open('/proc/self/status', 'r')
+  if not f then
+    return nil
+  end
+  local status = f:read('*a')
+  f:close()
+  return tonumber(status:match('VmHWM:%s*(%d+)'))
+end
+
+local function input(spec, w, h)
+  local wand = magick.new_magick_wand()
+  if w then
+    check(wand:set_size(w, h))
+  end
+  check(wand:read_image(spec))
+  return wand
+end
+
+local inputs = {
+  gradient = input('gradient:red-blue', 1024, 768),
+  logo = input('magick:logo'),
+  radial = input('radial-gradient:white-black', 1024, 768),
+}
+
+local results = {}
+
+results.call_overhead = {
+  drawing = (function()
+    local draw = magick.new_drawing_wand()
+    return measure(1e6, function()
+      draw:get_font_size()
+    end)
+  end)(),
+  magick = measure(1e6, function()
+    inputs.logo:get_image_width()
+  end),
+  pixel = (function()
+    local pixel = magick.new_pixel_wand()
+    return measure(1e6, function()
+      pixel:get_red()
+    end)
+  end)(),
+}
+
+results.wand_churn = {
+  drawing = measure(1e4, magick.new_drawing_wand),
+  magick = measure(1e4, magick.new_magick_wand),
+  pixel = measure(1e4, magick.new_pixel_wand),
+}
+
+results.codecs = {}
+for _, format in ipairs({ 'GIF', 'JPEG', 'PNG', 'TGA' }) do
+  local r = {}
+  for name, src in pairs(inputs) do
+    local path = ('%s/luamagick-bench-%s.%s'):format(tmpdir, name, format:lower())
+    local encode = measure(20, function()
+      check(src:write_image(format .. ':' .. path))
+    end)
+    local blob = slurp(path)
+    os.remove(path)
+    encode.bytes = #blob
+    encode.mb_per_second = encode.seconds > 0 and #blob * encode.iterations / encode.seconds / 1e6 or 0
+    local work = magick.new_magick_wand()
+    r[name] = {
+      decode = throughput(20, #blob, function()
+        check(work:read_image_blob(blob))
+        check(work:remove_image())
+      end),
+      encode = encode,
+    }
+  end
+  results.codecs[format] = r
+end
+
+results.operations = (function()
+  local src = inputs.logo
+  local over = magick.CompositeOperator.OverCompositeOp
+  local triangle = magick.FilterTypes.TriangleFilter
+  local work = magick.new_magick_wand()
+  local function op(fn)
+    return measure(50, function()
+      check(work:add_image(src))
+      fn()
+      check(work:remove_image())
+    end)
+  end
+  return {
+    composite = op(function()
+      check(work:composite_image(inputs.radial, over, 0, 0))
+    end),
+    resize = op(function()
+      check(work:resize_image(320, 240, triangle, 1))
+    end),
+    thumbnail = op(function()
+      check(work:thumbnail_image(128, 96))
+    end),
+  }
+end)()
+
+local function u32(s, i)
+  local a, b, c, d = s:byte(i, i + 3)
+  return a + b * 0x100 + c * 0x10000 + d * 0x1000000
+end
+
+-- The pure Lua path that read_blp replaces: unpack an uncompressed BLP2 and
+-- set its pixels one by one.
+local function lua_read_blp(wand, blob)
+  local width, height, offset = u32(blob, 13), u32(blob, 17), u32(blob, 21)
+  local pixel = magick.new_pixel_wand()
+  check(wand:new_image(width, height, pixel))
+  for y = 0, height - 1 do
+    for x = 0, width - 1 do
+      local i = offset + (y * width + x) * 4 + 1
+      local b, g, r, a = blob:byte(i, i + 3)
+      pixel:set_red(r / 255)
+      pixel:set_green(g / 255)
+      pixel:set_blue(b / 255)
+      pixel:set_alpha(a / 255)
+      check(wand:set_image_pixel_color(x, y, pixel))
+    end
+  end
+end
+
+results.blp = (function()
+  local src = inputs.logo
+  local work = magick.new_magick_wand()
+  local r = {}
+  for _, encoding in ipairs({ 'bgra', 'dxt1', 'dxt3', 'dxt5', 'palette' }) do
+    local opts = { encoding = encoding, mipmaps = false }
+    local blob = check(src:get_blp_blob(opts))
+    r[encoding] = {
+      decode = throughput(20, #blob, function()
+        check(work:read_blp(blob, opts))
+        check(work:remove_image())
+      end),
+      encode = throughput(20, #blob, function()
+        check(src:get_blp_blob(opts))
+      end),
+    }
+  end
+  local blob = check(src:get_blp_blob({ encoding = 'bgra', mipmaps = false }))
+  r.bgra.lua_decode = throughput(1, #blob, function()
+    lua_read_blp(work, blob)
+    check(work:remove_image())
+  end)
+  return r
+end)()
+
+results.block_compression = (function()
+  local src = inputs.radial
+  local width, height = src:get_image_width(), src:get_image_height()
+  local work = magick.new_magick_wand()
+  local r = { kernel_limit = os.getenv('LUAMAGICK_SIMD') or 'none' }
+  for _, format in ipairs({ 'bc1', 'bc2', 'bc3' }) do
+    local f = {}
+    for quality = 0, 2 do
+      f['encode_quality_' .. quality] = throughput(10, width * height * 4, function()
+        check(src:get_bc_blob({ format = format, quality = quality }))
+      end)
+    end
+    local blocks = check(src:get_bc_blob({ format = format }))
+    f.decode = throughput(20, width * height * 4, function()
+      check(work:read_bc(blocks, width, height, { format = format }))
+      check(work:remove_image())
+    end)
+    r[format] = f
+  end
+  return r
+end)()
+
+results.pixel_hash = (function()
+  local src = inputs.radial
+  local bytes = src:get_image_width() * src:get_image_height() * 8
+  return {
+    kernel_limit = os.getenv('LUAMAGICK_SIMD') or 'none',
+    xxh3 = throughput(20, bytes, function()
+      -- Any pixel-changing call drops the memo; this one is cheap.
+      check(src:set_image_delay(0))
+      check(src:pixel_hash())
+    end),
+    memoized = measure(10000, function()
+      check(src:pixel_hash())
+    end),
+    signature = throughput(20, bytes, function()
+      check(src:set_image_delay(0))
+      check(src:get_image_signature())
+    end),
+  }
+end)()
+
+results.pipelines = (function()
+  local blob = check(inputs.logo:get_image_blob())
+  local ops = { { 'resize_image', 320, 240, 0, 1 }, { 'flop_image' } }
+  local opts = { blob = true, format = 'png' }
+  local dir = os.tmpname()
+  os.remove(dir)
+  local cache = check(magick.cache_open(dir, 64 * 1024 * 1024))
+  local r = {
+    run = measure(20, function()
+      check(magick.run(blob, ops, opts))
+    end),
+    cache_miss = measure(20, function(i)
+      check(cache:run(blob, { { 'set_image_delay', i }, unpack(ops) }, opts))
+    end),
+    cache_hit = measure(200, function()
+      check(cache:run(blob, ops, opts))
+    end),
+  }
+  os.execute(('rm -r %q'):format(dir))
+  return r
+end)()
+
+results.tiled = (function()
+  local src = input('radial-gradient:white-black', 2048, 2048)
+  local ops = { { 'blur_image', 0, 2 } }
+  local path = tmpdir .. '/luamagick-bench-tiled.miff'
+  local r = {
+    whole = measure(2, function()
+      check(magick.run(src, ops, { format = 'miff' }))
+    end),
+  }
+  for _, tile in ipairs({ 256, 1024 }) do
+    r['tile_' .. tile] = measure(2, function()
+      check(magick.process_tiled(src, path, ops, { tile = tile, overlap = 8 }))
+    end)
+  end
+  os.remove(path)
+  return r
+end)()
+
+results.checkpoints = (function()
+  local src = input('radial-gradient:white-black', 2048, 2048)
+  local png = tmpdir .. '/luamagick-bench-checkpoint.png'
+  local mpc = tmpdir .. '/luamagick-bench-checkpoint.mpc'
+  check(src:write_image(png))
+  check(src:checkpoint(mpc))
+  local work = magick.new_magick_wand()
+  local r = {
+    decode_png = measure(5, function()
+      check(work:read_image(png))
+      check(work:remove_image())
+    end),
+    open_checkpoint = measure(5, function()
+      check(magick.open_checkpoint(mpc))
+    end),
+  }
+  os.remove(png)
+  os.remove(mpc)
+  os.remove(tmpdir .. '/luamagick-bench-checkpoint.cache')
+  return r
+end)()
+
+results.font_metrics = (function()
+  local draw = magick.new_drawing_wand()
+  draw:set_font_size(24)
+  local labels = {}
+  for i = 1, 100 do
+    labels[i] = 'label ' .. i
+  end
+  local function query(i)
+    inputs.logo:query_font_metrics(draw, labels[i % #labels + 1])
+  end
+  local r = {}
+  magick.set_font_metrics_cache(0)
+  r.uncached = measure(1000, query)
+  magick.set_font_metrics_cache(4096)
+  r.cached = measure(1000, query)
+  r.list = measure(10, function()
+    check(inputs.logo:query_font_metrics_list(draw, labels))
+  end)
+  return r
+end)()
+
+results.mvg = (function()
+  local lines, coordinates = {}, {}
+  for i = 1, 1000 do
+    lines[i] = ('line %d,%d %d,%d'):format(i % 640, i % 480, (i * 7) % 640, (i * 13) % 480)
+    for j, v in ipairs({ i % 640, i % 480, (i * 7) % 640, (i * 13) % 480 }) do
+      coordinates[4 * (i - 1) + j] = v
+    end
+  end
+  local mvg = table.concat(lines, '\n')
+  return {
+    calls = measure(20, function()
+      local draw = magick.new_drawing_wand()
+      for i = 1, 1000 do
+        draw:line(i % 640, i % 480, (i * 7) % 640, (i * 13) % 480)
+      end
+    end),
+    append_mvg = measure(20, function()
+      check(magick.new_drawing_wand():append_mvg(mvg))
+    end),
+    batch = measure(20, function()
+      magick.new_drawing_wand():lines(coordinates)
+    end),
+  }
+end)()
+
+results.color_arguments = (function()
+  local work = magick.new_magick_wand()
+  check(work:set_size(64, 64))
+  check(work:read_image('xc:white'))
+  return {
+    pixel_wand = measure(1e4, function()
+      local pixel = magick.new_pixel_wand()
+      check(pixel:set_color('#336699'))
+      check(work:set_image_background_color(pixel))
+    end),
+    string = measure(1e4, function()
+      check(work:set_image_background_color('#336699'))
+    end),
+  }
+end)()
+
+results.palettes = (function()
+  local sprites = { inputs.logo, inputs.gradient, inputs.radial }
+  local palette = check(magick.build_palette(sprites, 256))
+  local work = magick.new_magick_wand()
+  local function op(fn)
+    return measure(10, function()
+      check(work:add_image(inputs.logo))
+      fn()
+      check(work:remove_image())
+    end)
+  end
+  return {
+    build = measure(5, function()
+      check(magick.build_palette(sprites, 256))
+    end),
+    apply = op(function()
+      check(work:apply_palette(palette))
+    end),
+    apply_dither = op(function()
+      check(work:apply_palette(palette, { dither = true }))
+    end),
+    remap = op(function()
+      check(work:remap_image(palette, magick.DitherMethod.NoDitherMethod))
+    end),
+  }
+end)()
+
+results.metadata = (function()
+  local src = inputs.logo
+  check(src:set_image_property('comment', 'luamagick'))
+  return {
+    get_metadata = measure(1e4, function()
+      check(src:get_metadata())
+    end),
+    per_key = measure(1e4, function()
+      for _, name in ipairs({ src:get_image_properties('*') }) do
+        src:get_image_property(name)
+      end
+    end),
+  }
+end)()
+
+results.describe = (function()
+  local src = inputs.logo
+  local into = {}
+  return {
+    describe_fast = measure(1e5, function()
+      src:describe_fast(nil, into)
+    end),
+    getters = measure(1e5, function()
+      into.width = src:get_image_width()
+      into.height = src:get_image_height()
+      into.format = src:get_image_format()
+      into.depth = src:get_image_depth()
+      into.colorspace = src:get_image_colorspace()
+      into.matte = src:get_image_matte()
+      into.images = src:get_number_images()
+      into.delay = src:get_image_delay()
+      into.iterations = src:get_image_iterations()
+      into.compression = src:get_image_compression()
+    end),
+  }
+end)()
+
+results.renditions = (function()
+  local src = input('radial-gradient:white-black', 2048, 1536)
+  local specs = {
+    { w = 1600, fmt = 'JPEG', q = 85 },
+    { w = 1024, fmt = 'PNG' },
+    { w = 1024, fmt = 'JPEG', q = 80 },
+    { w = 512, fmt = 'PNG' },
+    { w = 256, fmt = 'JPEG', q = 80 },
+    { w = 128, fmt = 'PNG' },
+  }
+  local lanczos = magick.FilterTypes.LanczosFilter
+  return {
+    renditions = measure(5, function()
+      check(src:renditions(specs))
+    end),
+    clones = measure(5, function()
+      for _, spec in ipairs(specs) do
+        local work = src:get_image()
+        check(work:resize_image(spec.w, spec.w * 3 / 4, lanczos, 1))
+        check(work:set_image_format(spec.fmt))
+        check(work:get_image_blob())
+      end
+    end),
+  }
+end)()
+
+results.lazy = (function()
+  local src = input('radial-gradient:white-black', 2048, 1536)
+  local lanczos = magick.FilterTypes.LanczosFilter
+  local ops = {
+    { 'resize_image', 1024, 768, lanczos, 1 },
+    { 'resize_image', 512, 384, lanczos, 1 },
+    { 'crop_image', 128, 96, 64, 48 },
+    { 'rotate_image', 'none', 90 },
+    { 'flop_image' },
+  }
+  local function run(eager)
+    local work = src:get_image()
+    if eager then
+      check(work:apply(ops))
+    else
+      local lazy = work:lazy()
+      for _, op in ipairs(ops) do
+        lazy[op[1]](lazy, unpack(op, 2))
+      end
+      check(lazy:execute())
+    end
+  end
+  return {
+    eager = measure(5, function()
+      run(true)
+    end),
+    lazy = measure(5, function()
+      run(false)
+    end),
+  }
+end)()
+
+results.read_region = (function()
+  local src = input('radial-gradient:white-black', 4096, 4096)
+  check(src:set_image_format('JPEG'))
+  local blob = src:get_image_blob()
+  local function region(native)
+    local work = magick.new_magick_wand()
+    if native then
+      check(work:read_region(blob, 1024, 128, 256, 256))
+    else
+      check(work:read_image_blob(blob))
+      check(work:crop_image(256, 256, 1024, 128))
+    end
+  end
+  return {
+    read_region = measure(5, function()
+      region(true)
+    end),
+    decode_and_crop = measure(5, function()
+      region(false)
+    end),
+  }
+end)()
+
+results.peak_rss_kb = peak_rss_kb()
+
+local function encode(v, out)
+  local t = type(v)
+  if t == 'table' then
+    local keys = {}
+    for k in pairs(v) do
+      table.insert(keys, k)
+    end
+    table.sort(keys)
+    table.insert(out, '{')
+    for i, k in ipairs(keys) do
+      table.insert(out, (i > 1 and ',' or '') .. ('%q:'):format(k))
+      encode(v[k], out)
+    end
+    table.insert(out, '}')
+  elseif t == 'number' then
+    table.insert(out, v ~= v and 'null' or ('%.17g'):format(v))
+  elseif t == 'string' then
+    table.insert(out, ('%q'):format(v))
+  elseif t == 'boolean' then
+    table.insert(out, tostring(v))
+  else
+    table.insert(out, 'null')
+  end
+end
+
+local jit = rawget(_G, 'jit')
+local out = {}
+encode({
+  lua = jit and jit.version or _VERSION,
+  results = results,
+  scale = scale,
+}, out)
+local json = table.concat(out) .. '\n'
+if arg and arg[1] then
+  local f = assert(io.open(arg[1], 'w'))
+  f:write(json)
+  f:close()
+else
+  io.write(json)
+end
@@ -20,21 +20,24 @@ local basenumtypes = {
 
 local allfuncs, numtypes, enums = (function()
   local function splitArgs(args)
-    local t = {}
-    for _, arg in ipairs(sx.split(args, ',')) do
+    local t, c = {}, {}
+    for i, arg in ipairs(sx.split(args, ',')) do
       arg = sx.strip(arg)
       if sx.startswith(arg, 'const ') then
         arg = arg:sub(7)
+        c[i] = true
       end
       table.insert(t, arg)
     end
-    return t
+    return t, c
   end
   local function parseQualType(ty)
     local ret, args = ty:match('^(.+)%((.*)%)$')
+    local t, c = splitArgs(args)
     return {
       ret = sx.strip(ret),
-      args = splitArgs(args),
+      args = t,
+      consts = c,
     }
   end
   local t, ns = {}, {}
@@ -90,9 +93,9 @@ local allfuncs, numtypes, enums = (function()
 end)()
 
 local argCode = {
-  ['char *'] = 'const char *arg$num = luaL_checkstring(L, $num);',
-  ['MagickBooleanType'] = 'int arg$num = lua_toboolean(L, $num);',
-  ['unsigned char *'] = 'const char *arg$num = luaL_checkstring(L, $num);',
+  ['char *'] = 'const char *arg$num = luaL_checkstring(L, $idx);',
+  ['MagickBooleanType'] = 'int arg$num = lua_toboolean(L, $idx);',
+  ['unsigned char *'] = 'const char *arg$num = luaL_checkstring(L, $idx);',
 }
 
 local retCode = {
@@ -117,15 +120,31 @@ local retCode = {
 
 for k in pairs(wandtypes) do
   local pty = k .. 'Wand *'
-  argCode[pty] = pty .. 'arg$num = check_' .. k:lower() .. '_wand(L, $num);'
+  argCode[pty] = pty .. 'arg$num = check_' .. k:lower() .. '_wand(L, $idx);'
   retCode[pty] = 'return wrap_' .. k:lower() .. '_wand(L, $fcall);'
 end
 
 for k in pairs(numtypes) do
-  argCode[k] = k .. ' arg$num = luaL_checknumber(L, $num);'
+  argCode[k] = k .. ' arg$num = luaL_checknumber(L, $idx);'
   retCode[k] = 'lua_pushnumber(L, $fcall);\nreturn 1;'
 end
 
+-- Input arrays are passed as a single Lua argument; the size_t before them is
+-- the element count and is derived from the array rather than passed from Lua.
+local arrayCode = {
+  ['double *'] = 'double',
+  ['PointInfo *'] = 'point',
+  ['size_t *'] = 'size',
+}
+
+for k, v in pairs(arrayCode) do
+  local ty = k:sub(1, -3)
+  arrayCode[k] = tmpl(table.concat({
+    ty .. ' arg${num}buf[STACK_ARRAY_LENGTH];',
+    'const ' .. ty .. ' *arg$num = check_' .. v .. '_array(L, $idx, arg${num}buf, STACK_ARRAY_LENGTH, &arg$count);',
+  }, '\n'))
+end
+
 for k, v in pairs(argCode) do
   argCode[k] = tmpl(v)
 end
@@ -144,9 +163,20 @@ local skips = {
   ['WandView *'] = true,
 }
 
+local function arrayArgs(v)
+  local t = {}
+  for i, arg in ipairs(v.args) do
+    if arrayCode[arg] and v.consts[i] and v.args[i - 1] == 'size_t' then
+      t[i] = true
+    end
+  end
+  return t
+end
+
 local function isValid(v)
-  for _, arg in ipairs(v.args) do
-    if not argCode[arg] then
+  local arrays = arrayArgs(v)
+  for i, arg in ipairs(v.args) do
+    if not argCode[arg] and not arrays[i] then
       return false
     end
   end
@@ -176,188 +206,4203 @@ end
 -- TODO handle these generically
 wands.Drawing.funcs.Clear = { name = 'ClearDrawingWand' }
 wands.Drawing.funcs.Clone = { name = 'CloneDrawingWand' }
-wands.Magick.funcs.DistortImage = {
+wands.Magick.funcs.ConvolveImage = { square = true }
+wands.Magick.funcs.ConvolveImageChannel = { square = true }
+wands.Magick.funcs.GetOptions = {
   special = [[
   MagickWand *wand = check_magick_wand(L, 1);
-  lua_Number method = luaL_checknumber(L, 2);
-  luaL_checktype(L, 3, LUA_TTABLE);
-  MagickBooleanType bestfit = lua_toboolean(L, 4);
+  const char *pattern = luaL_checkstring(L, 2);
+  size_t num_options;
+  char **value = MagickGetOptions(wand, pattern, &num_options);
+  for (int i = 0; i < num_options; ++i) {
+    lua_pushstring(L, value[i]);
+    MagickRelinquishMemory(value[i]);
+  }
+  MagickRelinquishMemory(value);
+  return num_options;]],
+}
+wands.Magick.funcs.GetImageArtifacts = {
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  const char *pattern = luaL_checkstring(L, 2);
+  size_t num_artifacts = 0;
+  char **value = MagickGetImageArtifacts(wand, pattern, &num_artifacts);
+  if (value == NULL) {
+    return magick_error(L, wand);
+  }
+  return push_string_list(L, value, num_artifacts, "too many artifacts");]],
+}
+wands.Magick.funcs.GetImageProfile = {
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  const char *name = luaL_checkstring(L, 2);
+  size_t length;
+  unsigned char *value = MagickGetImageProfile(wand, name, &length);
+  if (value == NULL) {
+    lua_pushnil(L);
+  } else {
+    lua_pushlstring(L, (const char *)value, length);
+    MagickRelinquishMemory(value);
+  }
+  return 1;]],
+}
+wands.Magick.funcs.GetImageProfiles = {
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  const char *pattern = luaL_checkstring(L, 2);
+  size_t num_profiles = 0;
+  char **value = MagickGetImageProfiles(wand, pattern, &num_profiles);
+  if (value == NULL) {
+    return magick_error(L, wand);
+  }
+  return push_string_list(L, value, num_profiles, "too many profiles");]],
+}
+wands.Magick.funcs.GetImageProperties = {
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  const char *pattern = luaL_checkstring(L, 2);
+  size_t num_properties = 0;
+  char **value = MagickGetImageProperties(wand, pattern, &num_properties);
+  if (value == NULL) {
+    return magick_error(L, wand);
+  }
+  return push_string_list(L, value, num_properties, "too many properties");]],
+}
+wands.Magick.funcs.SetImageProfile = {
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  const char *name = luaL_checkstring(L, 2);
+  size_t length;
+  const char *profile = luaL_checklstring(L, 3, &length);
+  if (MagickSetImageProfile(wand, name, profile, length) != MagickTrue) {
+    return magick_error(L, wand);
+  }
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Magick.funcs.QueryFontMetrics = {
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  DrawingWand *draw = check_drawing_wand(L, 2);
+  const char *text = luaL_checkstring(L, 3);
+  double metrics[13];
+  if (!query_font_metrics(L, wand, draw, text, 0, metrics)) {
+    return 0;
+  }
+  push_font_metrics(L, metrics);
+  return 1;]],
+}
+wands.Magick.funcs.QueryMultilineFontMetrics = {
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  DrawingWand *draw = check_drawing_wand(L, 2);
+  const char *text = luaL_checkstring(L, 3);
+  double metrics[13];
+  if (!query_font_metrics(L, wand, draw, text, 1, metrics)) {
+    return 0;
+  }
+  push_font_metrics(L, metrics);
+  return 1;]],
+}
+wands.Magick.funcs.ReadImageBlob = {
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  size_t length;
+  const char *data = luaL_checklstring(L, 2, &length);
+  if (MagickReadImageBlob(wand, data, length) != MagickTrue) {
+    return magick_error(L, wand);
+  }
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Drawing.funcs.AppendMvg = {
+  extension = true,
+  special = [[
+  DrawingWand *wand = check_drawing_wand(L, 1);
+  const char *mvg = luaL_checkstring(L, 2);
+  int appended = append_mvg(wand, mvg);
+  if (appended < 0) {
+    return luaL_error(L, "MVG tokens must be shorter than %d bytes", MVG_CHUNK);
+  } else if (appended == 0) {
+    return drawing_error(L, wand);
+  }
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Drawing.funcs.GetMvg = {
+  extension = true,
+  special = [[
+  DrawingWand *wand = check_drawing_wand(L, 1);
+  char *xml = DrawGetVectorGraphics(wand);
+  const char *start, *end = NULL;
+  if (xml == NULL) {
+    return drawing_error(L, wand);
+  }
+  start = strstr(xml, "<vector-graphics>");
+  if (start != NULL) {
+    start += strlen("<vector-graphics>");
+    end = strstr(start, "</vector-graphics>");
+  }
+  if (end != NULL) {
+    push_xml_text(L, start, end);
+  } else {
+    lua_pushliteral(L, "");
+  }
+  MagickRelinquishMemory(xml);
+  return 1;]],
+}
+wands.Drawing.funcs.Circles = {
+  extension = true,
+  special = [[
+  return draw_quads(L, DrawCircle);]],
+}
+wands.Drawing.funcs.Lines = {
+  extension = true,
+  special = [[
+  return draw_quads(L, DrawLine);]],
+}
+wands.Drawing.funcs.Polygons = {
+  extension = true,
+  special = [[
+  DrawingWand *wand = check_drawing_wand(L, 1);
+  PointInfo buf[STACK_ARRAY_LENGTH];
+  const PointInfo *points;
+  size_t i, n, count;
   int top = lua_gettop(L);
-  size_t nargs = lua_objlen(L, 3);
-  size_t i;
-  double *args;
-  MagickBooleanType ret;
-  for (i = 1; i <= nargs; ++i) {
-    lua_pushnumber(L, i);
-    lua_gettable(L, 3);
-    luaL_checknumber(L, top + 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = lua_objlen(L, 2);
+  for (i = 1; i <= n; ++i) {
+    lua_rawgeti(L, 2, i);
+    points = check_point_array(L, top + 1, buf, STACK_ARRAY_LENGTH, &count);
+    DrawPolygon(wand, count, points);
+    lua_settop(L, top);
+  }
+  return 0;]],
+}
+wands.Drawing.funcs.Rectangles = {
+  extension = true,
+  special = [[
+  return draw_quads(L, DrawRectangle);]],
+}
+wands.Magick.funcs.Apply = {
+  extension = true,
+  special = [[
+  int failed;
+  check_magick_wand(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if ((failed = apply_ops(L, 1, 2)) != 0) {
+    return failed;
+  }
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Magick.funcs.ApplyPalette = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  struct palette_tree *tree = lua_newuserdata(L, sizeof(*tree));
+  char *dither_option = get_wand_option(check_magick_wand(L, 2), palette_dither_option);
+  int dither = option_boolean(L, 3, "dither", dither_option != NULL);
+  unsigned char *pixels;
+  size_t width, height;
+  MagickBooleanType ok;
+  MagickRelinquishMemory(dither_option);
+  if (MagickGetNumberImages(wand) == 0) {
+    return luaL_argerror(L, 1, "wand has no image");
+  }
+  if (!palette_tree_load(L, 2, tree)) {
+    return magick_error(L, check_magick_wand(L, 2));
+  }
+  width = MagickGetImageWidth(wand);
+  height = MagickGetImageHeight(wand);
+  pixels = malloc(width * height * 4);
+  if (pixels == NULL) {
+    return luaL_error(L, "out of memory applying palette");
+  }
+  if (MagickExportImagePixels(wand, 0, 0, width, height, "RGBA", CharPixel, pixels) != MagickTrue) {
+    free(pixels);
+    return magick_error(L, wand);
+  }
+  if (!dither) {
+    palette_map(tree, pixels, width, height);
+  } else if (!palette_dither(tree, pixels, width, height)) {
+    free(pixels);
+    return luaL_error(L, "out of memory applying palette");
+  }
+  forget_pixel_hashes(wand);
+  ok = !tree->has_alpha || MagickSetImageAlphaChannel(wand, ActivateAlphaChannel) == MagickTrue;
+  ok = ok && MagickImportImagePixels(wand, 0, 0, width, height, "RGBA", CharPixel, pixels) == MagickTrue;
+  free(pixels);
+  if (!ok) {
+    return magick_error(L, wand);
+  }
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Magick.funcs.Checkpoint = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  if (MagickWriteImages(wand, lua_pushfstring(L, "mpc:%s", path), MagickTrue) != MagickTrue) {
+    return magick_error(L, wand);
+  }
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Magick.funcs.DescribeFast = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  size_t i, n;
+  int field;
+  if (MagickGetNumberImages(wand) == 0) {
+    return luaL_argerror(L, 1, "wand has no image");
+  }
+  lua_settop(L, 3);
+  if (!lua_istable(L, 3)) {
+    lua_createtable(L, 0, DESCRIBE_TYPE);
+    lua_replace(L, 3);
+  }
+  if (lua_isnil(L, 2)) {
+    for (field = 0; field < DESCRIBE_TYPE; ++field) {
+      push_describe_field(L, wand, field);
+      lua_setfield(L, 3, describe_fields[field]);
+    }
+    return 1;
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = lua_objlen(L, 2);
+  for (i = 1; i <= n; ++i) {
+    lua_rawgeti(L, 2, i);
+    field = luaL_checkoption(L, -1, NULL, describe_fields);
+    push_describe_field(L, wand, field);
+    lua_rawset(L, 3);
+  }
+  return 1;]],
+}
+wands.Magick.funcs.DrawMvg = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  const char *mvg = luaL_checkstring(L, 2);
+  DrawingWand *draw = NewDrawingWand();
+  int appended = append_mvg(draw, mvg), n;
+  MagickBooleanType ok;
+  if (appended < 0) {
+    DestroyDrawingWand(draw);
+    return luaL_error(L, "MVG tokens must be shorter than %d bytes", MVG_CHUNK);
+  } else if (appended == 0) {
+    n = drawing_error(L, draw);
+    DestroyDrawingWand(draw);
+    return n;
+  }
+  forget_pixel_hashes(wand);
+  ok = MagickDrawImage(wand, draw);
+  DestroyDrawingWand(draw);
+  if (ok != MagickTrue) {
+    return magick_error(L, wand);
+  }
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Magick.funcs.GenerateMipmaps = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  FilterTypes filter = option_enum(L, 2, "filter", MagickFilterOptions, BoxFilter);
+  size_t min_size = option_number(L, 2, "min_size", 1);
+  int gamma_correct = option_boolean(L, 2, "gamma_correct", 1);
+  ssize_t index = MagickGetIteratorIndex(wand);
+  MagickWand *work = MagickGetImage(wand);
+  ColorspaceType colorspace;
+  size_t columns, rows;
+  int linear;
+  luaL_argcheck(L, min_size > 0, 2, "min_size must be positive");
+  if (work == NULL) {
+    return magick_error(L, wand);
+  }
+  forget_pixel_hashes(work);
+  /* Levels are resampled in linear light and converted back as they are
+   * added, so only the working copy carries the conversion error. */
+  colorspace = MagickGetImageColorspace(work);
+  linear = gamma_correct && colorspace == sRGBColorspace;
+  if (linear && MagickTransformImageColorspace(work, RGBColorspace) != MagickTrue) {
+    DestroyMagickWand(work);
+    return magick_error(L, wand);
+  }
+  columns = MagickGetImageWidth(work);
+  rows = MagickGetImageHeight(work);
+  while (columns > min_size || rows > min_size) {
+    MagickWand *level;
+    MagickBooleanType ok;
+    columns = columns > 1 ? columns / 2 : 1;
+    rows = rows > 1 ? rows / 2 : 1;
+    if (MagickResizeImage(work, columns, rows, filter, 1.0) != MagickTrue) {
+      DestroyMagickWand(work);
+      return magick_error(L, wand);
+    }
+    level = CloneMagickWand(work);
+    ok = linear ? MagickTransformImageColorspace(level, colorspace) : MagickTrue;
+    /* Adding inserts after the current image, or before it after
+     * set_first_iterator, so move to the last one each time. */
+    MagickSetLastIterator(wand);
+    if (ok == MagickTrue) {
+      ok = MagickAddImage(wand, level);
+    }
+    DestroyMagickWand(level);
+    if (ok != MagickTrue) {
+      DestroyMagickWand(work);
+      return magick_error(L, wand);
+    }
+  }
+  DestroyMagickWand(work);
+  MagickSetIteratorIndex(wand, index);
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Magick.funcs.GetBcBlob = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  int format = option_choice(L, 2, "format", bc_formats, BC1) % 3;
+  int quality = option_number(L, 2, "quality", BC_QUALITY_NORMAL);
+  size_t width = MagickGetImageWidth(wand), height = MagickGetImageHeight(wand);
+  unsigned char *rgba, *blocks;
+  luaL_argcheck(L, quality >= BC_QUALITY_FAST && quality <= BC_QUALITY_HIGH, 2, "quality must be 0, 1 or 2");
+  rgba = malloc(width * height * 4 + bc_size(format, width, height) + 1);
+  if (rgba == NULL) {
+    return luaL_error(L, "out of memory encoding blocks");
+  }
+  blocks = rgba + width * height * 4;
+  if (MagickExportImagePixels(wand, 0, 0, width, height, "RGBA", CharPixel, rgba) != MagickTrue) {
+    free(rgba);
+    return magick_error(L, wand);
+  }
+  bc_encode(format, quality, rgba, width, height, blocks);
+  lua_pushlstring(L, (const char *)blocks, bc_size(format, width, height));
+  free(rgba);
+  return 1;]],
+}
+wands.Magick.funcs.GetBlpBlob = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  struct blp_header header;
+  struct blp_options options;
+  unsigned char *blob;
+  size_t length;
+  MagickWand *failed;
+  const char *err;
+  check_blp_options(L, 2, wand, &header, &options);
+  err = blp_write(wand, &header, &options, &blob, &length, &failed);
+  if (err == blp_magick_failed) {
+    return magick_error(L, failed);
+  } else if (err != NULL) {
+    return push_failure(L, CoderError, "%s", err);
+  }
+  lua_pushlstring(L, (const char *)blob, length);
+  free(blob);
+  return 1;]],
+}
+wands.Magick.funcs.GetCacheType = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  Image *image = GetImageFromMagickWand(wand);
+  if (image == NULL) {
+    return magick_error(L, wand);
+  }
+  switch (GetImagePixelCacheType(image)) {
+  case MemoryCache:
+    lua_pushliteral(L, "memory");
+    break;
+  case MapCache:
+    lua_pushliteral(L, "map");
+    break;
+  case DiskCache:
+    lua_pushliteral(L, "disk");
+    break;
+  case PingCache:
+    lua_pushliteral(L, "ping");
+    break;
+  default:
+    lua_pushliteral(L, "undefined");
+  }
+  return 1;]],
+}
+wands.Magick.funcs.GetMetadata = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  size_t i, n = 0, length;
+  char **names;
+  unsigned char *profile;
+  if (MagickGetNumberImages(wand) == 0) {
+    return luaL_argerror(L, 1, "wand has no image");
+  }
+  lua_createtable(L, 0, 3);
+  push_image_strings(L, wand, MagickGetImageArtifacts, MagickGetImageArtifact);
+  lua_setfield(L, -2, "artifacts");
+  push_image_strings(L, wand, MagickGetImageProperties, MagickGetImageProperty);
+  lua_setfield(L, -2, "properties");
+  names = MagickGetImageProfiles(wand, "*", &n);
+  lua_createtable(L, 0, n);
+  for (i = 0; names != NULL && i < n; ++i) {
+    profile = MagickGetImageProfile(wand, names[i], &length);
+    if (profile != NULL) {
+      lua_pushlstring(L, (const char *)profile, length);
+      lua_setfield(L, -2, names[i]);
+      MagickRelinquishMemory(profile);
+    }
+    MagickRelinquishMemory(names[i]);
+  }
+  MagickRelinquishMemory(names);
+  lua_setfield(L, -2, "profiles");
+  return 1;]],
+}
+wands.Magick.funcs.Lazy = {
+  extension = true,
+  special = [[
+  check_magick_wand(L, 1);
+  lua_newuserdata(L, 0);
+  luaL_getmetatable(L, lazy_wand_meta_name);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 0, 2);
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "wand");
+  lua_newtable(L);
+  lua_setfield(L, -2, "ops");
+  lua_setfenv(L, -2);
+  return 1;]],
+}
+wands.Magick.funcs.PixelHash = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  char hex[17];
+  option_choice(L, 2, "algo", pixel_hash_algorithms, 0);
+  if (memo_pixel_hash(wand, hex) != MagickTrue) {
+    return magick_error(L, wand);
+  }
+  lua_pushstring(L, hex);
+  return 1;]],
+}
+wands.Magick.funcs.QueryFontMetricsList = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  DrawingWand *draw = check_drawing_wand(L, 2);
+  int multiline = lua_toboolean(L, 4);
+  size_t i, n;
+  double metrics[13];
+  luaL_checktype(L, 3, LUA_TTABLE);
+  n = lua_objlen(L, 3);
+  lua_createtable(L, n, 0);
+  for (i = 1; i <= n; ++i) {
+    lua_rawgeti(L, 3, i);
+    luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 3, "texts must be strings");
+    if (!query_font_metrics(L, wand, draw, lua_tostring(L, -1), multiline, metrics)) {
+      return magick_error(L, wand);
+    }
+    push_font_metrics(L, metrics);
+    lua_rawseti(L, -3, i);
+    lua_pop(L, 1);
+  }
+  return 1;]],
+}
+wands.Magick.funcs.ReadBc = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  size_t length;
+  const char *blocks = luaL_checklstring(L, 2, &length);
+  size_t width = luaL_checknumber(L, 3);
+  size_t height = luaL_checknumber(L, 4);
+  int format = option_choice(L, 5, "format", bc_formats, BC1) % 3;
+  unsigned char *rgba;
+  luaL_argcheck(L, width > 0 && width <= 65535, 3, "width must be between 1 and 65535");
+  luaL_argcheck(L, height > 0 && height <= 65535, 4, "height must be between 1 and 65535");
+  if (length < bc_size(format, width, height)) {
+    return push_failure(L, CorruptImageError, "truncated block data");
+  }
+  rgba = malloc(width * height * 4);
+  if (rgba == NULL) {
+    return luaL_error(L, "out of memory decoding blocks");
+  }
+  bc_decode(format, (const unsigned char *)blocks, width, height, rgba);
+  if (MagickConstituteImage(wand, width, height, "RGBA", CharPixel, rgba) != MagickTrue) {
+    free(rgba);
+    return magick_error(L, wand);
+  }
+  free(rgba);
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Magick.funcs.ReadBlp = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  size_t length;
+  const char *source = luaL_checklstring(L, 2, &length);
+  int mipmaps = option_boolean(L, 3, "mipmaps", 1);
+  const char *err;
+  if (!is_blob(L, 3, source, length) && (source = push_file(L, source, &length)) == NULL) {
+    return push_failure(L, FileOpenError, "%s: %s", lua_tostring(L, 2), strerror(errno));
+  }
+  err = blp_read(wand, (const unsigned char *)source, length, mipmaps);
+  if (err == blp_magick_failed) {
+    return magick_error(L, wand);
+  } else if (err != NULL) {
+    return push_failure(L, CorruptImageError, "%s", err);
+  }
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Magick.funcs.ReadRegion = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  size_t length;
+  const char *source = luaL_checklstring(L, 2, &length);
+  double x = luaL_checknumber(L, 3);
+  double y = luaL_checknumber(L, 4);
+  size_t columns = luaL_checknumber(L, 5);
+  size_t rows = luaL_checknumber(L, 6);
+  int blob = is_blob(L, 7, source, length);
+  MagickWand *work;
+  struct region_stream s = {0};
+  size_t width, height;
+  char format[MaxTextExtent] = "", *value;
+  int owner, failed;
+  MagickBooleanType ok;
+  luaL_argcheck(L, x >= 0, 3, "x must not be negative");
+  luaL_argcheck(L, y >= 0, 4, "y must not be negative");
+  luaL_argcheck(L, columns > 0, 5, "width must be positive");
+  luaL_argcheck(L, rows > 0, 6, "height must be positive");
+  work = own_magick_wand(L, NewMagickWand());
+  owner = lua_gettop(L);
+  ok = blob ? MagickPingImageBlob(work, source, length) : MagickPingImage(work, source);
+  if (ok != MagickTrue) {
+    failed = magick_error(L, work);
+    release_magick_wand(L, owner);
+    return failed;
+  }
+  MagickSetFirstIterator(work);
+  width = MagickGetImageWidth(work);
+  height = MagickGetImageHeight(work);
+  if ((value = MagickGetImageFormat(work)) != NULL) {
+    CopyMagickString(format, value, MaxTextExtent);
+    MagickRelinquishMemory(value);
+  }
+  drop_images(work);
+  s.x = x;
+  s.y = y;
+  if (s.x >= width || s.y >= height) {
+    release_magick_wand(L, owner);
+    return luaL_argerror(L, 3, "region is outside the image");
+  }
+  s.columns = columns < width - s.x ? columns : width - s.x;
+  s.rows = rows < height - s.y ? rows : height - s.y;
+  if (plan_index(format, region_formats) >= 0) {
+    s.pixels = lua_newuserdata(L, 4 * s.columns * s.rows * sizeof(Quantum));
+  }
+  if (s.pixels != NULL && stream_region(source, length, blob, &s)) {
+    release_magick_wand(L, owner);
+    ok = MagickConstituteImage(wand, s.columns, s.rows, s.matte ? "RGBA" : "RGBP", QuantumPixel, s.pixels);
+    if (ok == MagickTrue) {
+      ok = MagickSetImageFormat(wand, format);
+    }
+    if (ok != MagickTrue) {
+      return magick_error(L, wand);
+    }
+    lua_pushboolean(L, 1);
+    lua_pushliteral(L, "stream");
+    return 2;
+  }
+  ok = blob ? MagickReadImageBlob(work, source, length) : MagickReadImage(work, source);
+  if (ok == MagickTrue) {
+    MagickSetFirstIterator(work);
+    ok = MagickCropImage(work, s.columns, s.rows, s.x, s.y);
+  }
+  if (ok == MagickTrue) {
+    ok = MagickSetImagePage(work, s.columns, s.rows, 0, 0);
+  }
+  while (ok == MagickTrue && MagickGetNumberImages(work) > 1) {
+    MagickSetLastIterator(work);
+    ok = MagickRemoveImage(work);
+  }
+  if (ok != MagickTrue || MagickAddImage(wand, work) != MagickTrue) {
+    failed = magick_error(L, work);
+    release_magick_wand(L, owner);
+    return failed;
+  }
+  release_magick_wand(L, owner);
+  lua_pushboolean(L, 1);
+  lua_pushliteral(L, "crop");
+  return 2;]],
+}
+wands.Magick.funcs.ReadThumbnail = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  size_t length;
+  const char *source = luaL_checklstring(L, 2, &length);
+  size_t columns = luaL_checknumber(L, 3);
+  size_t rows = luaL_checknumber(L, 4);
+  FilterTypes filter = option_enum(L, 5, "filter", MagickFilterOptions, UndefinedFilter);
+  int blob = is_blob(L, 5, source, length);
+  MagickWand *ping, *work;
+  MagickBooleanType ok;
+  double scale;
+  size_t w, h;
+  int owner, failed;
+  luaL_argcheck(L, columns > 0, 3, "width must be positive");
+  luaL_argcheck(L, rows > 0, 4, "height must be positive");
+  /* Frames are read into a copy of the wand, which keeps its settings, and
+   * each is shrunk and stripped there before they are added to the wand. */
+  work = own_magick_wand(L, CloneMagickWand(wand));
+  owner = lua_gettop(L);
+  drop_images(work);
+  ping = NewMagickWand();
+  /* Let the JPEG decoder scale down by DCT while keeping twice the target
+   * resolution for the final filter. */
+  ok = blob ? MagickPingImageBlob(ping, source, length) : MagickPingImage(ping, source);
+  if (ok == MagickTrue && MagickGetImageWidth(ping) > 2 * columns && MagickGetImageHeight(ping) > 2 * rows) {
+    char hint[MaxTextExtent];
+    snprintf(hint, sizeof(hint), "%lux%lu", (unsigned long)(2 * columns), (unsigned long)(2 * rows));
+    MagickSetOption(work, "jpeg:size", hint);
+  }
+  DestroyMagickWand(ping);
+  ok = blob ? MagickReadImageBlob(work, source, length) : MagickReadImage(work, source);
+  MagickResetIterator(work);
+  while (ok == MagickTrue && MagickNextImage(work) != MagickFalse) {
+    scale = (double)columns / MagickGetImageWidth(work);
+    if ((double)rows / MagickGetImageHeight(work) < scale) {
+      scale = (double)rows / MagickGetImageHeight(work);
+    }
+    w = MagickGetImageWidth(work) * scale + 0.5;
+    h = MagickGetImageHeight(work) * scale + 0.5;
+    w = w > 0 ? w : 1;
+    h = h > 0 ? h : 1;
+    if (filter == UndefinedFilter) {
+      ok = MagickThumbnailImage(work, w, h);
+    } else {
+      ok = MagickResizeImage(work, w, h, filter, 1.0);
+    }
+    if (ok == MagickTrue) {
+      ok = MagickStripImage(work);
+    }
+  }
+  if (ok != MagickTrue || MagickAddImage(wand, work) != MagickTrue) {
+    failed = magick_error(L, ok != MagickTrue ? work : wand);
+    release_magick_wand(L, owner);
+    return failed;
+  }
+  release_magick_wand(L, owner);
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Magick.funcs.RecolorImage = { square = true }
+wands.Magick.funcs.Renditions = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  FilterTypes filter = option_enum(L, 3, "filter", MagickFilterOptions, LanczosFilter);
+  MagickWand *level = NULL, *failed = NULL;
+  struct rendition *r;
+  size_t n, i, width, height;
+  int k;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (MagickGetNumberImages(wand) == 0) {
+    return luaL_argerror(L, 1, "wand has no image");
+  }
+  width = MagickGetImageWidth(wand);
+  height = MagickGetImageHeight(wand);
+  n = lua_objlen(L, 2);
+  r = lua_newuserdata(L, (n ? n : 1) * sizeof(*r));
+  for (i = 0; i < n; ++i) {
+    lua_rawgeti(L, 2, i + 1);
+    k = lua_gettop(L);
+    luaL_argcheck(L, lua_istable(L, k), 2, "renditions must be tables");
+    r[i].index = i;
+    r[i].columns = option_number(L, k, "w", 0);
+    r[i].rows = option_number(L, k, "h", 0);
+    r[i].format = option_string(L, k, "fmt", NULL);
+    r[i].quality = option_number(L, k, "q", 0);
+    r[i].path = option_string(L, k, "path", NULL);
+    r[i].wand = NULL;
+    r[i].blob = NULL;
     lua_pop(L, 1);
+    if (r[i].columns == 0 && r[i].rows == 0) {
+      r[i].columns = width;
+      r[i].rows = height;
+    } else if (r[i].rows == 0) {
+      r[i].rows = (size_t)((double)height * r[i].columns / width + 0.5);
+    } else if (r[i].columns == 0) {
+      r[i].columns = (size_t)((double)width * r[i].rows / height + 0.5);
+    }
+    r[i].columns = r[i].columns > 0 ? r[i].columns : 1;
+    r[i].rows = r[i].rows > 0 ? r[i].rows : 1;
+  }
+  qsort(r, n, sizeof(*r), rendition_order);
+  for (i = 0; i < n && failed == NULL; ++i) {
+    if (level == NULL || MagickGetImageWidth(level) < r[i].columns || MagickGetImageHeight(level) < r[i].rows) {
+      if (level != NULL) {
+        DestroyMagickWand(level);
+      }
+      if ((level = MagickGetImage(wand)) == NULL) {
+        failed = wand;
+        break;
+      }
+    }
+    if ((MagickGetImageWidth(level) != r[i].columns || MagickGetImageHeight(level) != r[i].rows) &&
+        MagickResizeImage(level, r[i].columns, r[i].rows, filter, 1.0) != MagickTrue) {
+      failed = level;
+      level = NULL;
+      break;
+    }
+    r[i].wand = CloneMagickWand(level);
+    if ((r[i].format != NULL && MagickSetImageFormat(r[i].wand, r[i].format) != MagickTrue) ||
+        (r[i].quality > 0 && MagickSetImageCompressionQuality(r[i].wand, r[i].quality) != MagickTrue)) {
+      failed = r[i].wand;
+    }
+  }
+  if (level != NULL) {
+    DestroyMagickWand(level);
+  }
+  if (failed == NULL) {
+    parallel_for(n, 1, encode_renditions, r);
+    for (i = 0; i < n && failed == NULL; ++i) {
+      failed = r[i].ok != MagickTrue ? r[i].wand : NULL;
+    }
+  }
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; ++i) {
+    if (r[i].blob != NULL) {
+      lua_pushlstring(L, (const char *)r[i].blob, r[i].length);
+      MagickRelinquishMemory(r[i].blob);
+    } else {
+      lua_pushboolean(L, 1);
+    }
+    lua_rawseti(L, -2, r[i].index + 1);
+    if (r[i].wand != NULL && r[i].wand != failed) {
+      DestroyMagickWand(r[i].wand);
+    }
+  }
+  if (failed != NULL) {
+    k = magick_error(L, failed);
+    if (failed != wand) {
+      DestroyMagickWand(failed);
+    }
+    return k;
+  }
+  return 1;]],
+}
+wands.Magick.funcs.SetCacheType = {
+  extension = true,
+  special = [[
+  check_magick_wand(L, 1);
+  int type = luaL_checkoption(L, 2, NULL, cache_types);
+  set_cache_policy(L, "type", type == CACHE_DEFAULT ? NULL : cache_types[type]);
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Magick.funcs.SetTemporaryPath = {
+  extension = true,
+  special = [[
+  check_magick_wand(L, 1);
+  const char *path = luaL_optstring(L, 2, NULL);
+  set_cache_policy(L, "path", path);
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+wands.Magick.funcs.WriteBlp = {
+  extension = true,
+  special = [[
+  MagickWand *wand = check_magick_wand(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  struct blp_header header;
+  struct blp_options options;
+  unsigned char *blob;
+  size_t length;
+  MagickWand *failed;
+  const char *err;
+  FILE *f;
+  int written, error;
+  check_blp_options(L, 3, wand, &header, &options);
+  err = blp_write(wand, &header, &options, &blob, &length, &failed);
+  if (err == blp_magick_failed) {
+    return magick_error(L, failed);
+  } else if (err != NULL) {
+    return push_failure(L, CoderError, "%s", err);
+  }
+  f = fopen(path, "wb");
+  written = f != NULL && fwrite(blob, 1, length, f) == length;
+  error = errno;
+  if (f != NULL && fclose(f) != 0 && written) {
+    written = 0;
+    error = errno;
+  }
+  free(blob);
+  if (!written) {
+    return push_failure(L, FileOpenError, "%s: %s", path, strerror(error));
+  }
+  lua_pushboolean(L, 1);
+  return 1;]],
+}
+
+-- TODO find a better way to maintain this blacklist
+wands.Magick.funcs.GetOrientationType = nil
+
+local function snake(s)
+  -- c/o https://codegolf.stackexchange.com/a/177958
+  return s
+    :gsub('%f[^%l]%u', '_%1')
+    :gsub('%f[^%a]%d', '_%1')
+    :gsub('%f[^%d]%a', '_%1')
+    :gsub('(%u)(%u%l)', '%1_%2')
+    :lower()
+end
+
+local function fixdent(s)
+  local t = require('pl.text')
+  return sx.rstrip(t.indent(t.dedent(s), 2))
+end
+
+-- Wrappers that may change pixels forget memoized pixel hashes. Any MagickWand
+-- function returning a status or a new wand is assumed to, apart from these
+-- read-only prefixes and the wand's own settings.
+local readOnlyPrefixes = {
+  'Animate',
+  'Clear',
+  'Compare',
+  'Display',
+  'Export',
+  'Get',
+  'Has',
+  'Identify',
+  'Next',
+  'Ping',
+  'Previous',
+  'Read',
+  'Write',
+}
+
+local function mayChangePixels(name, fname, cf)
+  if name == 'Magick' and cf.ret == 'MagickWand *' then
+    -- New wands' images are cloned with their artifacts, memoized hash included,
+    -- which only stays right for a plain copy of the current image.
+    return fname ~= 'GetImage'
+  elseif name ~= 'Magick' or cf.ret ~= 'MagickBooleanType' then
+    return false
+  end
+  for _, prefix in ipairs(readOnlyPrefixes) do
+    if sx.startswith(fname, prefix) then
+      return false
+    end
+  end
+  for _, word in ipairs({ 'Artifact', 'Iterator', 'Option', 'Property' }) do
+    if fname:find(word) then
+      return false
+    end
+  end
+  return not sx.startswith(fname, 'Set') or sx.startswith(fname, 'SetImage')
+end
+
+-- Lazy wands record the generated methods that may change the image and return
+-- a boolean; wand-returning methods and specials are left out.
+local function recordable(name, fname)
+  local func = wands[name].funcs[fname]
+  local cf = allfuncs[func.name or (wands[name].prefix .. fname)]
+  return not func.special
+    and not func.unsupported
+    and cf.ret == 'MagickBooleanType'
+    and mayChangePixels(name, fname, cf)
+end
+
+-- Pixel wand arguments also take color strings, apart from a pixel wand
+-- method's own wand and the arguments of getters, which write to them.
+local colorCode = tmpl('PixelWand *arg$num = check_color(L, $idx);')
+
+local function takesColor(name, fname, i, arg)
+  return arg == 'PixelWand *' and not (name == 'Pixel' and i == 1) and not sx.startswith(fname, 'Get')
+end
+
+local function funcbody(name, fname)
+  local t = {}
+  local wand = wands[name]
+  local func = wand.funcs[fname]
+  local args = {}
+  local cf = allfuncs[func.name or (wand.prefix .. fname)]
+  local arrays = arrayArgs(cf)
+  local idx = 0
+  for i, arg in ipairs(cf.args) do
+    table.insert(args, 'arg' .. i)
+    if arrays[i + 1] then
+      table.insert(t, '  size_t arg' .. i .. ';')
+    else
+      idx = idx + 1
+      local code = arrays[i] and arrayCode[arg] or takesColor(name, fname, i, arg) and colorCode or argCode[arg]
+      local s = code:substitute({ count = i - 1, idx = idx, num = i })
+      table.insert(t, '  ' .. (s:gsub('\n', '\n  ')))
+      if arrays[i] and func.square then
+        table.insert(t, ('  arg%d = check_square_order(L, %d, arg%d);'):format(i - 1, idx, i - 1))
+      end
+    end
+  end
+  local fcall = ('%s(%s)'):format(func.name or (wand.prefix .. fname), table.concat(args, ', '))
+  local forget = mayChangePixels(name, fname, cf)
+  if forget and cf.ret == 'MagickWand *' then
+    fcall = ('forget_pixel_hashes(%s)'):format(fcall)
+  elseif forget then
+    table.insert(t, '  forget_pixel_hashes(arg1);')
+  end
+  table.insert(
+    t,
+    fixdent(retCode[cf.ret]:substitute({
+      fcall = fcall,
+      lower = name:lower(),
+    }))
+  )
+  return table.concat(t, '\n')
+end
+
+local plsub = require('pl.template').substitute
+pf.write(
+  'luamagick.c',
+  assert(plsub(
+    [[
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <wand/MagickWand.h>
+
+#include "src/bcn.h"
+#include "src/blp.h"
+#include "src/cpu.h"
+#include "src/palette.h"
+#include "src/xxh3.h"
+
+#define STACK_ARRAY_LENGTH 64
+
+static lua_Number array_number(lua_State *L, int k, size_t i) {
+  lua_Number n;
+  lua_rawgeti(L, k, i);
+  if (!lua_isnumber(L, -1)) {
+    luaL_argerror(L, k, "array of numbers expected");
+  }
+  n = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  return n;
+}
+
+static void *array_buffer(lua_State *L, void *buf, size_t buflen, size_t n, size_t size) {
+  return n <= buflen ? buf : lua_newuserdata(L, n * size);
+}
+
+/* Strings and full userdata are taken as packed native-endian elements, and
+ * are used in place when suitably aligned. Returns NULL for any other type. */
+static const void *packed_array(lua_State *L, int k, void *buf, size_t buflen, size_t *n, size_t size) {
+  const void *data;
+  void *copy;
+  size_t len;
+  if (lua_type(L, k) == LUA_TSTRING) {
+    data = lua_tolstring(L, k, &len);
+  } else if (lua_type(L, k) == LUA_TUSERDATA) {
+    data = lua_touserdata(L, k);
+    len = lua_objlen(L, k);
+  } else {
+    return NULL;
+  }
+  luaL_argcheck(L, len % size == 0, k, "packed array length is not a multiple of element size");
+  *n = len / size;
+  if ((uintptr_t)data % sizeof(double) == 0) {
+    return data;
+  }
+  copy = array_buffer(L, buf, buflen, *n, size);
+  memcpy(copy, data, len);
+  return copy;
+}
+
+static const double *check_double_array(lua_State *L, int k, double *buf, size_t buflen, size_t *n) {
+  const double *packed = packed_array(L, k, buf, buflen, n, sizeof(*buf));
+  double *array;
+  size_t i;
+  if (packed != NULL) {
+    return packed;
+  }
+  luaL_checktype(L, k, LUA_TTABLE);
+  *n = lua_objlen(L, k);
+  array = array_buffer(L, buf, buflen, *n, sizeof(*array));
+  for (i = 0; i < *n; ++i) {
+    array[i] = array_number(L, k, i + 1);
+  }
+  return array;
+}
+
+static const size_t *check_size_array(lua_State *L, int k, size_t *buf, size_t buflen, size_t *n) {
+  const size_t *packed = packed_array(L, k, buf, buflen, n, sizeof(*buf));
+  size_t *array;
+  size_t i;
+  if (packed != NULL) {
+    return packed;
+  }
+  luaL_checktype(L, k, LUA_TTABLE);
+  *n = lua_objlen(L, k);
+  array = array_buffer(L, buf, buflen, *n, sizeof(*array));
+  for (i = 0; i < *n; ++i) {
+    array[i] = array_number(L, k, i + 1);
+  }
+  return array;
+}
+
+/* Tables of points are flat: { x1, y1, x2, y2, ... }. */
+static const PointInfo *check_point_array(lua_State *L, int k, PointInfo *buf, size_t buflen, size_t *n) {
+  const PointInfo *packed = packed_array(L, k, buf, buflen, n, sizeof(*buf));
+  PointInfo *array;
+  size_t i;
+  if (packed != NULL) {
+    return packed;
+  }
+  luaL_checktype(L, k, LUA_TTABLE);
+  *n = lua_objlen(L, k);
+  luaL_argcheck(L, *n % 2 == 0, k, "odd number of point coordinates");
+  *n /= 2;
+  array = array_buffer(L, buf, buflen, *n, sizeof(*array));
+  for (i = 0; i < *n; ++i) {
+    array[i].x = array_number(L, k, 2 * i + 1);
+    array[i].y = array_number(L, k, 2 * i + 2);
+  }
+  return array;
+}
+
+static size_t check_square_order(lua_State *L, int k, size_t n) {
+  size_t order = 0;
+  while (order * order < n) {
+    ++order;
+  }
+  luaL_argcheck(L, n > 0 && order * order == n, k, "array length must be a nonzero perfect square");
+  return order;
+}
+
+static lua_Number option_number(lua_State *L, int k, const char *name, lua_Number def) {
+  lua_Number n = def;
+  if (lua_istable(L, k)) {
+    lua_getfield(L, k, name);
+    if (!lua_isnil(L, -1)) {
+      if (!lua_isnumber(L, -1)) {
+        luaL_error(L, "option '%s' must be a number", name);
+      }
+      n = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+  return n;
+}
+
+static int option_boolean(lua_State *L, int k, const char *name, int def) {
+  int b = def;
+  if (lua_istable(L, k)) {
+    lua_getfield(L, k, name);
+    if (!lua_isnil(L, -1)) {
+      b = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+  return b;
+}
+
+/* Enum options may be given by value or by name, e.g. 'Box' for BoxFilter. */
+static ssize_t option_enum(lua_State *L, int k, const char *name, CommandOption type, ssize_t def) {
+  ssize_t n = def;
+  if (lua_istable(L, k)) {
+    lua_getfield(L, k, name);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      n = ParseCommandOption(type, MagickFalse, lua_tostring(L, -1));
+      if (n < 0) {
+        luaL_error(L, "option '%s' has unknown value '%s'", name, lua_tostring(L, -1));
+      }
+    } else if (!lua_isnil(L, -1)) {
+      if (!lua_isnumber(L, -1)) {
+        luaL_error(L, "option '%s' must be a number or a name", name);
+      }
+      n = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+  return n;
+}
+
+static int option_choice(lua_State *L, int k, const char *name, const char *const choices[], int def) {
+  int n = def;
+  if (lua_istable(L, k)) {
+    lua_getfield(L, k, name);
+    if (!lua_isnil(L, -1)) {
+      const char *s = lua_tostring(L, -1);
+      for (n = 0; choices[n] != NULL && (s == NULL || strcmp(choices[n], s) != 0); ++n) {
+      }
+      if (choices[n] == NULL) {
+        luaL_error(L, "option '%s' has unknown value '%s'", name, s != NULL ? s : luaL_typename(L, -1));
+      }
+    }
+    lua_pop(L, 1);
+  }
+  return n;
+}
+
+/* The string stays valid while the options table refers to it. */
+static const char *option_string(lua_State *L, int k, const char *name, const char *def) {
+  const char *s = def;
+  if (lua_istable(L, k)) {
+    lua_getfield(L, k, name);
+    if (!lua_isnil(L, -1)) {
+      if (lua_type(L, -1) != LUA_TSTRING) {
+        luaL_error(L, "option '%s' must be a string", name);
+      }
+      s = lua_tostring(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+  return s;
+}
+
+/* Sources are blobs if the blob option says so, or if they start with control
+ * characters that no path would contain, as image headers usually do. */
+static int is_blob(lua_State *L, int opts, const char *source, size_t length) {
+  size_t i;
+  if (lua_istable(L, opts)) {
+    lua_getfield(L, opts, "blob");
+    if (!lua_isnil(L, -1)) {
+      int blob = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+      return blob;
+    }
+    lua_pop(L, 1);
+  }
+  for (i = 0; i < length && i < 16; ++i) {
+    if ((unsigned char)source[i] < ' ') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Pushes the contents of a file as a string, or pushes nothing and returns
+ * NULL with errno set. */
+static const char *push_file(lua_State *L, const char *path, size_t *length) {
+  FILE *f = fopen(path, "rb");
+  luaL_Buffer b;
+  size_t n;
+  if (f == NULL) {
+    return NULL;
+  }
+  luaL_buffinit(L, &b);
+  while ((n = fread(luaL_prepbuffer(&b), 1, LUAL_BUFFERSIZE, f)) > 0) {
+    luaL_addsize(&b, n);
+  }
+  luaL_pushresult(&b);
+  if (ferror(f)) {
+    fclose(f);
+    lua_pop(L, 1);
+    errno = EIO;
+    return NULL;
+  }
+  fclose(f);
+  return lua_tolstring(L, -1, length);
+}
+
+static const char *const bc_formats[] = {"bc1", "bc2", "bc3", "dxt1", "dxt3", "dxt5", NULL};
+
+static void write_u32(unsigned char *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static const char *const blp_encodings[] = {"palette", "dxt1", "dxt3", "dxt5", "bgra", NULL};
+
+/* Fills in the header fields chosen by the options; the defaults follow the
+ * current image's alpha channel. */
+static void check_blp_options(lua_State *L, int k, MagickWand *wand, struct blp_header *h, struct blp_options *o) {
+  int alpha = MagickGetImageAlphaChannel(wand) == MagickTrue;
+  int encoding;
+  memset(h, 0, sizeof(*h));
+  h->version = option_number(L, k, "version", 2);
+  luaL_argcheck(L, h->version == 1 || h->version == 2, k, "BLP version must be 1 or 2");
+  encoding = option_choice(L, k, "encoding", blp_encodings, h->version == 1 ? 0 : alpha ? 3 : 1);
+  luaL_argcheck(L, h->version == 2 || encoding == 0, k, "BLP1 images must be palettized");
+  h->encoding = encoding == 0 ? BLP_PALETTE : encoding == 4 ? BLP_BGRA : BLP_DXT;
+  h->format = encoding == 3 ? BC3 : encoding == 2 ? BC2 : BC1;
+  h->alpha_type = h->encoding != BLP_DXT ? 0 : encoding == 3 ? 7 : encoding == 2 ? 1 : 0;
+  h->alpha_bits = option_number(L, k, "alpha_bits", !alpha ? 0 : encoding == 1 ? 1 : 8);
+  switch (encoding) {
+  case 0:
+    luaL_argcheck(L,
+                  h->alpha_bits == 0 || h->alpha_bits == 8 ||
+                      (h->version == 2 && (h->alpha_bits == 1 || h->alpha_bits == 4)),
+                  k, "alpha_bits must be 0 or 8, or 1 or 4 for BLP2");
+    break;
+  case 1:
+    luaL_argcheck(L, h->alpha_bits == 0 || h->alpha_bits == 1, k, "alpha_bits must be 0 or 1 for DXT1");
+    break;
+  case 4:
+    luaL_argcheck(L, h->alpha_bits == 0 || h->alpha_bits == 8, k, "alpha_bits must be 0 or 8 for BGRA");
+    break;
+  default:
+    h->alpha_bits = 8;
+  }
+  o->dither = option_boolean(L, k, "dither", 0);
+  o->mipmaps = option_boolean(L, k, "mipmaps", 1);
+  o->quality = option_number(L, k, "quality", BC_QUALITY_NORMAL);
+  luaL_argcheck(L, o->quality >= BC_QUALITY_FAST && o->quality <= BC_QUALITY_HIGH, k, "quality must be 0, 1 or 2");
+}
+
+/* Pixel hashes are XXH3 over the dimensions and the hashes of each row's 16-bit
+ * RGBA samples, which are computed in parallel a band of rows at a time. They
+ * are memoized in an image artifact, which wrappers that may change pixels
+ * delete from the images of the wand they change or return. */
+#define PIXEL_HASH_BAND 256
+
+static const char pixel_hash_artifact[] = "luamagick:pixel-hash";
+static const char *const pixel_hash_algorithms[] = {"xxh3", NULL};
+
+/* Walks the image list directly, since moving the wand's iterator would change
+ * where later calls add images. Returns the wand. */
+static MagickWand *forget_pixel_hashes(MagickWand *wand) {
+  Image *image;
+  if (wand == NULL || MagickGetNumberImages(wand) == 0) {
+    return wand;
+  }
+  image = GetFirstImageInList(GetImageFromMagickWand(wand));
+  for (; image != NULL; image = GetNextImageInList(image)) {
+    DeleteImageArtifact(image, pixel_hash_artifact);
+  }
+  return wand;
+}
+
+struct pixel_hash_job {
+  const unsigned short *pixels;
+  size_t width;
+  unsigned char *hashes;
+};
+
+static void pixel_hash_rows(void *ctx, size_t begin, size_t end) {
+  const struct pixel_hash_job *job = ctx;
+  size_t y;
+  for (y = begin; y < end; ++y) {
+    uint64_t h = xxh3_64(job->pixels + y * job->width * 4, job->width * 8);
+    write_u32(job->hashes + y * 8, h);
+    write_u32(job->hashes + y * 8 + 4, h >> 32);
+  }
+}
+
+static MagickBooleanType pixel_hash(MagickWand *wand, uint64_t *hash) {
+  size_t width = MagickGetImageWidth(wand), height = MagickGetImageHeight(wand), y, n;
+  struct pixel_hash_job job;
+  unsigned short *pixels;
+  unsigned char *hashes;
+  MagickBooleanType ok = MagickTrue;
+  if (width == 0 || height == 0) {
+    return MagickFalse;
+  }
+  pixels = malloc(width * 8 * (height < PIXEL_HASH_BAND ? height : PIXEL_HASH_BAND));
+  hashes = malloc((height + 2) * 8);
+  if (pixels == NULL || hashes == NULL) {
+    free(pixels);
+    free(hashes);
+    return MagickFalse;
+  }
+  write_u32(hashes, width);
+  write_u32(hashes + 4, (uint64_t)width >> 32);
+  write_u32(hashes + 8, height);
+  write_u32(hashes + 12, (uint64_t)height >> 32);
+  job.pixels = pixels;
+  job.width = width;
+  for (y = 0; y < height && ok == MagickTrue; y += n) {
+    n = height - y < PIXEL_HASH_BAND ? height - y : PIXEL_HASH_BAND;
+    ok = MagickExportImagePixels(wand, 0, y, width, n, "RGBA", ShortPixel, pixels);
+    job.hashes = hashes + (y + 2) * 8;
+    if (ok == MagickTrue) {
+      parallel_rows(n, pixel_hash_rows, &job);
+    }
+  }
+  *hash = xxh3_64(hashes, (height + 2) * 8);
+  free(pixels);
+  free(hashes);
+  return ok;
+}
+
+/* Writes the current image's digest as hex, reusing the memoized one unless
+ * pixels may have changed since. */
+static MagickBooleanType memo_pixel_hash(MagickWand *wand, char hex[17]) {
+  char *memo = MagickGetImageArtifact(wand, pixel_hash_artifact);
+  uint64_t hash;
+  if (memo != NULL && strlen(memo) == 16) {
+    memcpy(hex, memo, 17);
+    MagickRelinquishMemory(memo);
+    return MagickTrue;
+  }
+  MagickRelinquishMemory(memo);
+  if (pixel_hash(wand, &hash) != MagickTrue) {
+    return MagickFalse;
+  }
+  snprintf(hex, 17, "%016llx", (unsigned long long)hash);
+  MagickSetImageArtifact(wand, pixel_hash_artifact, hex);
+  return MagickTrue;
+}
+
+#define SEVERITY_COUNT 800
+
+static const char error_message_meta_name[] = "luamagick error message";
+
+static int structured_errors = 0;
+static size_t error_counts[SEVERITY_COUNT];
+
+/* A structured error takes the wand's exception text when it is made, so later
+ * calls on the wand don't change it, but only becomes a Lua string when
+ * converted with tostring. */
+struct error_message {
+  char *text;
+};
+
+static void count_error(ExceptionType severity) {
+  if ((size_t)severity < SEVERITY_COUNT) {
+    ++error_counts[severity];
+  }
+}
+
+/* Reports a failure without a wand exception the way magick_error does, as nil
+ * and a message or, with structured errors on, nil, the severity and the
+ * message as a string. */
+static int push_failure(lua_State *L, ExceptionType severity, const char *fmt, ...) {
+  va_list ap;
+  count_error(severity);
+  lua_pushnil(L);
+  if (structured_errors) {
+    lua_pushinteger(L, severity);
+  }
+  va_start(ap, fmt);
+  lua_pushvfstring(L, fmt, ap);
+  va_end(ap);
+  return structured_errors ? 3 : 2;
+}
+
+static int push_error_message(lua_State *L, void *wand, char *(*get_exception)(void *, ExceptionType *)) {
+  struct error_message *msg = lua_newuserdata(L, sizeof(*msg));
+  ExceptionType severity;
+  msg->text = get_exception(wand, &severity);
+  luaL_getmetatable(L, error_message_meta_name);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int error_message_gc(lua_State *L) {
+  struct error_message *msg = luaL_checkudata(L, 1, error_message_meta_name);
+  if (msg->text != NULL) {
+    MagickRelinquishMemory(msg->text);
+    msg->text = NULL;
+  }
+  return 0;
+}
+
+static int error_message_tostring(lua_State *L) {
+  struct error_message *msg = luaL_checkudata(L, 1, error_message_meta_name);
+  lua_pushstring(L, msg->text == NULL ? "" : msg->text);
+  return 1;
+}
+
+static struct luaL_Reg error_message_meta[] = {
+  {"__gc", error_message_gc},
+  {"__tostring", error_message_tostring},
+  {NULL, NULL},
+};
+
+static int get_error_counts(lua_State *L) {
+  int i;
+  lua_newtable(L);
+  for (i = 0; i < SEVERITY_COUNT; ++i) {
+    if (error_counts[i] != 0) {
+      lua_pushnumber(L, error_counts[i]);
+      lua_rawseti(L, -2, i);
+    }
+  }
+  return 1;
+}
+
+static int reset_error_counts(lua_State *L) {
+  memset(error_counts, 0, sizeof(error_counts));
+  return 0;
+}
+
+static int set_structured_errors(lua_State *L) {
+  structured_errors = lua_toboolean(L, 1);
+  return 0;
+}
+
+#define MEMORY_CLASSES 64
+#define POOL_MIN_CLASS 4
+#define POOL_MAX_CLASS 16
+
+enum { MEMORY_OFF, MEMORY_COUNT, MEMORY_POOL };
+
+/* Prefixed to every block handed to ImageMagick; keeps 16-byte alignment. */
+union memory_header {
+  size_t size;
+  union memory_header *next;
+  double align[2];
+};
+
+static int memory_mode = MEMORY_OFF;
+static size_t memory_current;
+static size_t memory_peak;
+static size_t memory_allocations;
+static size_t memory_frees;
+static size_t memory_histogram[MEMORY_CLASSES];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static union memory_header *pool_blocks[POOL_MAX_CLASS + 1];
+static size_t pool_bytes;
+
+static int memory_class(size_t size) {
+  int c = 0;
+  while (c < MEMORY_CLASSES - 1 && ((size_t)1 << c) < size) {
+    ++c;
+  }
+  return c;
+}
+
+static int pool_class(size_t size) {
+  int c = memory_class(size);
+  if (memory_mode != MEMORY_POOL || c > POOL_MAX_CLASS) {
+    return -1;
+  }
+  return c < POOL_MIN_CLASS ? POOL_MIN_CLASS : c;
+}
+
+static void count_acquire(size_t size) {
+  size_t current = __atomic_add_fetch(&memory_current, size, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&memory_peak, __ATOMIC_RELAXED);
+  while (current > peak &&
+         !__atomic_compare_exchange_n(&memory_peak, &peak, current, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  __atomic_add_fetch(&memory_allocations, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&memory_histogram[memory_class(size)], 1, __ATOMIC_RELAXED);
+}
+
+static void count_release(size_t size) {
+  __atomic_sub_fetch(&memory_current, size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&memory_frees, 1, __ATOMIC_RELAXED);
+}
+
+static void *counting_acquire(size_t size) {
+  int c = pool_class(size);
+  union memory_header *h = NULL;
+  if (c >= 0) {
+    pthread_mutex_lock(&pool_lock);
+    h = pool_blocks[c];
+    if (h != NULL) {
+      pool_blocks[c] = h->next;
+      pool_bytes -= (size_t)1 << c;
+    }
+    pthread_mutex_unlock(&pool_lock);
+  }
+  if (h == NULL) {
+    h = malloc(sizeof(*h) + (c >= 0 ? (size_t)1 << c : size));
+    if (h == NULL) {
+      return NULL;
+    }
+  }
+  h->size = size;
+  count_acquire(size);
+  return h + 1;
+}
+
+static void counting_destroy(void *p) {
+  union memory_header *h;
+  int c;
+  if (p == NULL) {
+    return;
+  }
+  h = (union memory_header *)p - 1;
+  count_release(h->size);
+  c = pool_class(h->size);
+  if (c < 0) {
+    free(h);
+    return;
+  }
+  pthread_mutex_lock(&pool_lock);
+  h->next = pool_blocks[c];
+  pool_blocks[c] = h;
+  pool_bytes += (size_t)1 << c;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static void *counting_resize(void *p, size_t size) {
+  union memory_header *h;
+  size_t old;
+  void *q;
+  if (p == NULL) {
+    return counting_acquire(size);
+  }
+  h = (union memory_header *)p - 1;
+  old = h->size;
+  if (pool_class(old) < 0 && pool_class(size) < 0) {
+    h = realloc(h, sizeof(*h) + size);
+    if (h == NULL) {
+      return NULL;
+    }
+  } else if (pool_class(old) != pool_class(size)) {
+    q = counting_acquire(size);
+    if (q != NULL) {
+      memcpy(q, p, old < size ? old : size);
+      counting_destroy(p);
+    }
+    return q;
+  }
+  count_release(old);
+  count_acquire(size);
+  h->size = size;
+  return h + 1;
+}
+
+/* Must run before MagickWandGenesis, since blocks allocated by the default
+ * handlers cannot be released through the counting ones. */
+static void setup_memory_methods(void) {
+  const char *mode = getenv("LUAMAGICK_MEMORY");
+  if (mode == NULL) {
+    return;
+  }
+  if (strcmp(mode, "count") == 0) {
+    memory_mode = MEMORY_COUNT;
+  } else if (strcmp(mode, "pool") == 0) {
+    memory_mode = MEMORY_POOL;
+  } else {
+    return;
+  }
+  SetMagickMemoryMethods(counting_acquire, counting_resize, counting_destroy);
+}
+
+static int memory_stats(lua_State *L) {
+  int i;
+  if (memory_mode == MEMORY_OFF) {
+    return push_failure(L, OptionError,
+                        "memory accounting is disabled; set LUAMAGICK_MEMORY before loading luamagick");
+  }
+  lua_createtable(L, 0, 7);
+  lua_pushstring(L, memory_mode == MEMORY_POOL ? "pool" : "count");
+  lua_setfield(L, -2, "mode");
+  lua_pushnumber(L, __atomic_load_n(&memory_current, __ATOMIC_RELAXED));
+  lua_setfield(L, -2, "current");
+  lua_pushnumber(L, __atomic_load_n(&memory_peak, __ATOMIC_RELAXED));
+  lua_setfield(L, -2, "peak");
+  lua_pushnumber(L, __atomic_load_n(&memory_allocations, __ATOMIC_RELAXED));
+  lua_setfield(L, -2, "allocations");
+  lua_pushnumber(L, __atomic_load_n(&memory_frees, __ATOMIC_RELAXED));
+  lua_setfield(L, -2, "frees");
+  pthread_mutex_lock(&pool_lock);
+  lua_pushnumber(L, pool_bytes);
+  pthread_mutex_unlock(&pool_lock);
+  lua_setfield(L, -2, "pooled");
+  lua_newtable(L);
+  for (i = 0; i < MEMORY_CLASSES; ++i) {
+    size_t n = __atomic_load_n(&memory_histogram[i], __ATOMIC_RELAXED);
+    if (n != 0) {
+      lua_pushnumber(L, (lua_Number)((size_t)1 << i));
+      lua_pushnumber(L, n);
+      lua_settable(L, -3);
+    }
+  }
+  lua_setfield(L, -2, "histogram");
+  return 1;
+}
+
+static int reset_memory_stats(lua_State *L) {
+  int i;
+  __atomic_store_n(&memory_peak, __atomic_load_n(&memory_current, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  __atomic_store_n(&memory_allocations, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&memory_frees, 0, __ATOMIC_RELAXED);
+  for (i = 0; i < MEMORY_CLASSES; ++i) {
+    __atomic_store_n(&memory_histogram[i], 0, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+/* Returns pooled free blocks to the system, e.g. between batch jobs. */
+static int trim_memory(lua_State *L) {
+  int c;
+  pthread_mutex_lock(&pool_lock);
+  for (c = 0; c <= POOL_MAX_CLASS; ++c) {
+    while (pool_blocks[c] != NULL) {
+      union memory_header *h = pool_blocks[c];
+      pool_blocks[c] = h->next;
+      free(h);
+    }
+  }
+  pool_bytes = 0;
+  pthread_mutex_unlock(&pool_lock);
+  return 0;
+}
+
+> for name, wand in sorted(wands) do
+static const char $(name:lower())_wand_meta_name[] = "luamagick $(name:lower()) wand";
+
+static char *$(name:lower())_exception(void *wand, ExceptionType *severity) {
+  return $(wand.prefix)GetException(wand, severity);
+}
+
+static int $(name:lower())_error(lua_State *L, $(name)Wand *wand) {
+  ExceptionType severity;
+  char *error;
+  lua_pushnil(L);
+  if (structured_errors) {
+    severity = $(wand.prefix)GetExceptionType(wand);
+    count_error(severity);
+    lua_pushinteger(L, severity);
+    push_error_message(L, wand, $(name:lower())_exception);
+    return 3;
+  }
+  error = $(wand.prefix)GetException(wand, &severity);
+  count_error(severity);
+  lua_pushstring(L, error);
+  MagickRelinquishMemory(error);
+  return 2;
+}
+
+static $(name)Wand *check_$(name:lower())_wand(lua_State *L, int k) {
+  void *ud = luaL_checkudata(L, k, $(name:lower())_wand_meta_name);
+  luaL_argcheck(L, ud != NULL, k, "$(name:lower()) wand expected");
+  return *($(name)Wand **)ud;
+}
+
+static int wrap_$(name:lower())_wand(lua_State *L, $(name)Wand *wand) {
+  $(name)Wand **p = lua_newuserdata(L, sizeof(*p));
+  luaL_getmetatable(L, $(name:lower())_wand_meta_name);
+  lua_setmetatable(L, -2);
+  *p = wand;
+  return 1;
+}
+
+static int new_$(name:lower())_wand(lua_State *L) {
+  return wrap_$(name:lower())_wand(L, New$(name)Wand());
+}
+
+> end
+/* Wands have no finalizer, so temporary ones are owned by a holder pushed on
+ * the stack, which destroys them when collected if a Lua error unwinds the
+ * call, and by release_magick_wand as soon as they are done with. */
+static const char owned_wand_meta_name[] = "luamagick owned wand";
+
+static MagickWand *own_magick_wand(lua_State *L, MagickWand *wand) {
+  MagickWand **p = lua_newuserdata(L, sizeof(*p));
+  *p = wand;
+  luaL_getmetatable(L, owned_wand_meta_name);
+  lua_setmetatable(L, -2);
+  return wand;
+}
+
+static void release_magick_wand(lua_State *L, int k) {
+  MagickWand **p = luaL_checkudata(L, k, owned_wand_meta_name);
+  if (*p != NULL) {
+    DestroyMagickWand(*p);
+    *p = NULL;
+  }
+}
+
+static int owned_wand_gc(lua_State *L) {
+  release_magick_wand(L, 1);
+  return 0;
+}
+
+/* Color strings passed for pixel wands are parsed once into pixel wands kept
+ * in a registry table, whose element 0 counts them, and which is replaced by
+ * an empty one on reaching COLOR_CACHE_LENGTH entries. The wands are userdata
+ * destroyed when collected, and take the place of the string argument they
+ * were parsed from, so they live until the call returns even if their table
+ * is replaced meanwhile. */
+#define COLOR_CACHE_LENGTH 1024
+
+static const char color_cache_name[] = "luamagick colors";
+static const char color_meta_name[] = "luamagick color";
+
+static int color_gc(lua_State *L) {
+  PixelWand **p = luaL_checkudata(L, 1, color_meta_name);
+  if (*p != NULL) {
+    DestroyPixelWand(*p);
+    *p = NULL;
+  }
+  return 0;
+}
+
+static PixelWand *check_color(lua_State *L, int k) {
+  PixelWand **p;
+  lua_Integer length = 0;
+  if (lua_type(L, k) != LUA_TSTRING) {
+    return check_pixel_wand(L, k);
+  }
+  lua_getfield(L, LUA_REGISTRYINDEX, color_cache_name);
+  if (lua_istable(L, -1)) {
+    lua_rawgeti(L, -1, 0);
+    length = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+  }
+  if (!lua_istable(L, -1) || length == COLOR_CACHE_LENGTH) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, color_cache_name);
+    length = 0;
+  }
+  lua_pushvalue(L, k);
+  lua_rawget(L, -2);
+  p = lua_touserdata(L, -1);
+  if (p == NULL) {
+    lua_pop(L, 1);
+    p = lua_newuserdata(L, sizeof(*p));
+    *p = NewPixelWand();
+    luaL_getmetatable(L, color_meta_name);
+    lua_setmetatable(L, -2);
+    if (PixelSetColor(*p, lua_tostring(L, k)) != MagickTrue) {
+      luaL_argerror(L, k, lua_pushfstring(L, "unrecognized color '%s'", lua_tostring(L, k)));
+    }
+    lua_pushvalue(L, k);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+    lua_pushinteger(L, length + 1);
+    lua_rawseti(L, -3, 0);
+  }
+  lua_replace(L, k);
+  lua_pop(L, 1);
+  return *p;
+}
+
+/* Pixel cache policies are kept in a registry table weakly keyed by the wands
+ * they were set on, and applied while those wands' methods run by adjusting
+ * ImageMagick's resource limits, which decide where new pixel caches go, and
+ * its temporary path around the call. IM6 has no per-image setting for either,
+ * so both are process-wide: anything running meanwhile, in another thread or
+ * lua_State, sees the policy too. The method hooks are installed while any
+ * wand has a policy. */
+enum cache_type { CACHE_DEFAULT, CACHE_MEMORY, CACHE_MAP, CACHE_DISK };
+
+static const char cache_policy_name[] = "luamagick cache policies";
+static const char *const cache_types[] = {"default", "memory", "map", "disk", NULL};
+static const ResourceType cache_resources[] = {AreaResource, MemoryResource, MapResource};
+static int cache_policies = 0;
+
+struct cache_scope {
+  int active;
+  int has_path;
+  MagickSizeType limits[sizeof(cache_resources) / sizeof(*cache_resources)];
+  char *path;
+};
+
+static void install_all_hooks(lua_State *L);
+
+static char *get_wand_option(MagickWand *wand, const char *name) {
+  char *value = MagickGetOption(wand, name);
+  if (value != NULL && *value == '\0') {
+    value = MagickRelinquishMemory(value);
+  }
+  return value;
+}
+
+static void push_cache_policies(lua_State *L) {
+  lua_getfield(L, LUA_REGISTRYINDEX, cache_policy_name);
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, cache_policy_name);
+  }
+}
+
+/* Pops the policy table, installing the method hooks if it holds a policy and
+ * they are not yet installed, and the plain methods if it holds none. */
+static void update_cache_policies(lua_State *L) {
+  int any;
+  lua_pushnil(L);
+  any = lua_next(L, -2);
+  lua_pop(L, any ? 3 : 1);
+  if (any != cache_policies) {
+    cache_policies = any;
+    install_all_hooks(L);
+  }
+}
+
+/* Sets, or clears given NULL, a field of the policy of the wand at index 1. */
+static void set_cache_policy(lua_State *L, const char *field, const char *value) {
+  int empty;
+  push_cache_policies(L);
+  lua_pushvalue(L, 1);
+  lua_rawget(L, -2);
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  lua_pushstring(L, value);
+  lua_setfield(L, -2, field);
+  lua_pushnil(L);
+  empty = !lua_next(L, -2);
+  lua_pop(L, empty ? 1 : 3);
+  if (empty) {
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+  }
+  update_cache_policies(L);
+}
+
+static void enter_cache_policy(lua_State *L, struct cache_scope *scope) {
+  const char *type, *path;
+  size_t i;
+  scope->active = 0;
+  push_cache_policies(L);
+  lua_pushvalue(L, 1);
+  lua_rawget(L, -2);
+  if (!lua_istable(L, -1)) {
+    /* Wands with a policy may have been collected since. */
+    lua_pop(L, 1);
+    update_cache_policies(L);
+    return;
+  }
+  lua_getfield(L, -1, "type");
+  lua_getfield(L, -2, "path");
+  type = lua_tostring(L, -2);
+  path = lua_tostring(L, -1);
+  scope->active = 1;
+  for (i = 0; i < sizeof(cache_resources) / sizeof(*cache_resources); ++i) {
+    scope->limits[i] = MagickGetResourceLimit(cache_resources[i]);
+  }
+  if (type != NULL) {
+    MagickSizeType unlimited = ~(MagickSizeType)0, memory = strcmp(type, "memory") == 0 ? unlimited : 0;
+    MagickSetResourceLimit(AreaResource, memory);
+    MagickSetResourceLimit(MemoryResource, memory);
+    MagickSetResourceLimit(MapResource, strcmp(type, "disk") == 0 ? 0 : unlimited);
+  }
+  scope->has_path = path != NULL;
+  if (path != NULL) {
+    ExceptionInfo *exception = AcquireExceptionInfo();
+    scope->path = GetImageRegistry(StringRegistryType, "temporary-path", exception);
+    SetImageRegistry(StringRegistryType, "temporary-path", path, exception);
+    DestroyExceptionInfo(exception);
+  }
+  lua_pop(L, 4);
+}
+
+static void leave_cache_policy(struct cache_scope *scope) {
+  size_t i;
+  for (i = 0; i < sizeof(cache_resources) / sizeof(*cache_resources); ++i) {
+    MagickSetResourceLimit(cache_resources[i], scope->limits[i]);
+  }
+  if (scope->has_path && scope->path != NULL) {
+    ExceptionInfo *exception = AcquireExceptionInfo();
+    SetImageRegistry(StringRegistryType, "temporary-path", scope->path, exception);
+    DestroyExceptionInfo(exception);
+    MagickRelinquishMemory(scope->path);
+  } else if (scope->has_path) {
+    DeleteImageRegistry("temporary-path");
+  }
+}
+
+/* Calls func under the policy of the wand it is a method of, restoring the
+ * previous settings even if it raises an error. */
+static int call_with_cache_policy(lua_State *L, lua_CFunction func) {
+  struct cache_scope scope;
+  int top = lua_gettop(L), i, status;
+  enter_cache_policy(L, &scope);
+  if (!scope.active) {
+    return func(L);
+  }
+  lua_pushcfunction(L, func);
+  for (i = 1; i <= top; ++i) {
+    lua_pushvalue(L, i);
+  }
+  status = lua_pcall(L, top, LUA_MULTRET, 0);
+  leave_cache_policy(&scope);
+  if (status != 0) {
+    return lua_error(L);
+  }
+  return lua_gettop(L) - top;
+}
+
+/* Pipelines are lists of operations, each a magick wand method name followed
+ * by its arguments, e.g. {{'resize_image', 64, 64, 0, 1}, {'flop_image'}}.
+ * Returns the number of results a failing method left on the stack, or 0. */
+static int apply_ops(lua_State *L, int wand, int ops) {
+  size_t i, j, n = lua_objlen(L, ops);
+  for (i = 1; i <= n; ++i) {
+    int top = lua_gettop(L);
+    size_t args;
+    lua_rawgeti(L, ops, i);
+    if (!lua_istable(L, top + 1)) {
+      return luaL_error(L, "operation %d is not a table", (int)i);
+    }
+    args = lua_objlen(L, top + 1);
+    luaL_getmetatable(L, magick_wand_meta_name);
+    lua_rawgeti(L, top + 1, 1);
+    if (lua_type(L, top + 3) != LUA_TSTRING) {
+      return luaL_error(L, "operation %d has no method name", (int)i);
+    }
+    lua_gettable(L, top + 2);
+    if (!lua_isfunction(L, top + 3)) {
+      lua_rawgeti(L, top + 1, 1);
+      return luaL_error(L, "operation %d has unknown method '%s'", (int)i, lua_tostring(L, -1));
+    }
+    lua_pushvalue(L, wand);
+    luaL_checkstack(L, args, "too many operation arguments");
+    for (j = 2; j <= args; ++j) {
+      lua_rawgeti(L, top + 1, j);
+    }
+    lua_call(L, args, LUA_MULTRET);
+    if (lua_gettop(L) > top + 2 && lua_isnil(L, top + 3)) {
+      return lua_gettop(L) - top - 2;
+    }
+    lua_settop(L, top);
+  }
+  return 0;
+}
+
+/* Pushes a string identifying the value at k in result cache keys. Wands are
+ * identified by content: magick wands by pixel hash and format, and drawing
+ * wands by their MVG. */
+static void push_cache_key(lua_State *L, int k);
+
+struct cache_key_part {
+  const char *data;
+  size_t length;
+};
+
+static int cache_key_part_order(const void *a, const void *b) {
+  const struct cache_key_part *x = a, *y = b;
+  int c = memcmp(x->data, y->data, x->length < y->length ? x->length : y->length);
+  return c != 0 ? c : (x->length > y->length) - (x->length < y->length);
+}
+
+/* Pushes the fields of the table at k outside its array part of n elements,
+ * each key with its value, sorted since lua_next's order depends on the
+ * table's history. Pushes nothing if there are none. */
+static void push_cache_key_fields(lua_State *L, int k, size_t n) {
+  struct cache_key_part *parts;
+  size_t i, m = 0;
+  int entries;
+  lua_newtable(L);
+  entries = lua_gettop(L);
+  lua_pushnil(L);
+  while (lua_next(L, k) != 0) {
+    lua_Number index = lua_type(L, -2) == LUA_TNUMBER ? lua_tonumber(L, -2) : 0;
+    if (index < 1 || index > n || index != floor(index)) {
+      push_cache_key(L, -2);
+      push_cache_key(L, -2);
+      lua_concat(L, 2);
+      lua_rawseti(L, entries, ++m);
+    }
+    lua_pop(L, 1);
+  }
+  if (m == 0) {
+    lua_pop(L, 1);
+    return;
+  }
+  parts = lua_newuserdata(L, m * sizeof(*parts));
+  for (i = 0; i < m; ++i) {
+    lua_rawgeti(L, entries, i + 1);
+    parts[i].data = lua_tolstring(L, -1, &parts[i].length);
+    lua_pop(L, 1);
+  }
+  qsort(parts, m, sizeof(*parts), cache_key_part_order);
+  lua_pushfstring(L, "h%d:", (int)m);
+  for (i = 0; i < m; ++i) {
+    lua_pushlstring(L, parts[i].data, parts[i].length);
+    lua_concat(L, 2);
+  }
+  lua_replace(L, entries);
+  lua_pop(L, 1);
+}
+
+static void push_cache_key(lua_State *L, int k) {
+  size_t i, n;
+  int top;
+  k = k > 0 ? k : lua_gettop(L) + k + 1;
+  luaL_checkstack(L, 8, NULL);
+  switch (lua_type(L, k)) {
+  case LUA_TNIL:
+    lua_pushliteral(L, "z");
+    break;
+  case LUA_TBOOLEAN:
+    lua_pushstring(L, lua_toboolean(L, k) ? "t" : "f");
+    break;
+  case LUA_TNUMBER: {
+    lua_Number number = lua_tonumber(L, k);
+    lua_pushliteral(L, "n");
+    lua_pushlstring(L, (const char *)&number, sizeof(number));
+    lua_concat(L, 2);
+    break;
+  }
+  case LUA_TSTRING:
+    lua_tolstring(L, k, &n);
+    lua_pushfstring(L, "s%d:", (int)n);
+    lua_pushvalue(L, k);
+    lua_concat(L, 2);
+    break;
+  case LUA_TTABLE:
+    n = lua_objlen(L, k);
+    lua_pushfstring(L, "a%d:", (int)n);
+    for (i = 1; i <= n; ++i) {
+      lua_rawgeti(L, k, i);
+      push_cache_key(L, -1);
+      lua_remove(L, -2);
+      lua_concat(L, 2);
+    }
+    top = lua_gettop(L);
+    push_cache_key_fields(L, k, n);
+    lua_concat(L, lua_gettop(L) - top + 1);
+    break;
+  case LUA_TUSERDATA:
+    if (!lua_getmetatable(L, k)) {
+      lua_pushnil(L);
+    }
+    luaL_getmetatable(L, magick_wand_meta_name);
+    luaL_getmetatable(L, pixel_wand_meta_name);
+    luaL_getmetatable(L, drawing_wand_meta_name);
+    if (lua_rawequal(L, -4, -3)) {
+      MagickWand *wand = check_magick_wand(L, k);
+      char hex[17] = "", *format = NULL;
+      if (MagickGetNumberImages(wand) > 0 && memo_pixel_hash(wand, hex) != MagickTrue) {
+        luaL_error(L, "cannot hash wand in cache key");
+      }
+      format = MagickGetImageFormat(wand);
+      lua_pushfstring(L, "w%s:%s", hex, format != NULL ? format : "");
+      MagickRelinquishMemory(format);
+    } else if (lua_rawequal(L, -4, -2)) {
+      PixelWand *wand = check_pixel_wand(L, k);
+      char *color = PixelGetColorAsString(wand);
+      lua_pushfstring(L, "p%s/%f", color, PixelGetAlpha(wand));
+      MagickRelinquishMemory(color);
+    } else if (lua_rawequal(L, -4, -1)) {
+      char *mvg = DrawGetVectorGraphics(check_drawing_wand(L, k));
+      lua_pushfstring(L, "d%d:", mvg != NULL ? (int)strlen(mvg) : 0);
+      lua_pushstring(L, mvg != NULL ? mvg : "");
+      lua_concat(L, 2);
+      MagickRelinquishMemory(mvg);
+    } else {
+      luaL_error(L, "cannot use userdata in cache keys");
+    }
+    lua_replace(L, -5);
+    lua_pop(L, 3);
+    break;
+  default:
+    luaL_error(L, "cannot use %s values in cache keys", luaL_typename(L, k));
+  }
+}
+
+/* Decodes the pipeline source at k, applies the operations at k + 1, and
+ * encodes the result with the options at k + 2. Sources are a wand, whose
+ * current image is copied, or a blob or path; data read from the path may be
+ * passed in. Returns the number of results, a blob on success. */
+static int run_pipeline(lua_State *L, int k, const char *data, size_t length) {
+  const char *format = option_string(L, k + 2, "format", NULL);
+  size_t quality = option_number(L, k + 2, "quality", 0);
+  MagickBooleanType ok = MagickTrue;
+  MagickWand *work;
+  unsigned char *blob;
+  size_t size;
+  int failed, owner;
+  luaL_checktype(L, k + 1, LUA_TTABLE);
+  if (lua_type(L, k) == LUA_TUSERDATA) {
+    MagickWand *wand = check_magick_wand(L, k);
+    if ((work = MagickGetImage(wand)) == NULL) {
+      return magick_error(L, wand);
+    }
+  } else {
+    size_t n;
+    const char *source = luaL_checklstring(L, k, &n);
+    work = NewMagickWand();
+    if (data != NULL) {
+      MagickSetFilename(work, source);
+      ok = MagickReadImageBlob(work, data, length);
+    } else if (is_blob(L, k + 2, source, n)) {
+      ok = MagickReadImageBlob(work, source, n);
+    } else {
+      ok = MagickReadImage(work, source);
+    }
+  }
+  own_magick_wand(L, work);
+  owner = lua_gettop(L);
+  wrap_magick_wand(L, work);
+  failed = ok == MagickTrue ? apply_ops(L, owner + 1, k + 1) : magick_error(L, work);
+  if (failed) {
+    release_magick_wand(L, owner);
+    return failed;
+  }
+  if (format != NULL) {
+    MagickResetIterator(work);
+    while (ok == MagickTrue && MagickNextImage(work) != MagickFalse) {
+      ok = MagickSetImageFormat(work, format);
+    }
+  }
+  if (quality > 0) {
+    MagickSetCompressionQuality(work, quality);
+  }
+  blob = ok == MagickTrue ? MagickGetImagesBlob(work, &size) : NULL;
+  if (blob == NULL) {
+    failed = magick_error(L, work);
+    release_magick_wand(L, owner);
+    return failed;
+  }
+  lua_pushlstring(L, (const char *)blob, size);
+  MagickRelinquishMemory(blob);
+  release_magick_wand(L, owner);
+  return 1;
+}
+
+/* Frees a wand's images but, unlike ClearMagickWand, keeps its exception for
+ * error messages read later. */
+static void drop_images(MagickWand *wand) {
+  while (MagickGetNumberImages(wand) > 0) {
+    MagickRemoveImage(wand);
+  }
+}
+
+/* Lazy wands record operations in the pipeline format and optimize them before
+ * running. Runs of flips, flops, transposes, transverses and rotations by right
+ * angles are folded into one element of the square's symmetry group, kept as
+ * a number of clockwise turns after an optional flop. A resize followed by one
+ * to no larger a size is dropped, and colorspace conversions to the colorspace
+ * the image is already in are dropped. A crop following a resize is done first when it
+ * maps onto whole source pixels, so fewer pixels are resampled. */
+enum plan_kind { PLAN_OTHER, PLAN_DROPPED, PLAN_RESIZE, PLAN_CROP, PLAN_ORIENT, PLAN_COLORSPACE };
+
+struct plan_op {
+  enum plan_kind kind;
+  int source; /* index of the unchanged operation, or 0 once rewritten */
+  int method; /* index into plan_resizes */
+  int turns, mirrored;
+  int args;
+  double v[4]; /* resize: width, height, filter, blur; crop: width, height, x, y */
+};
+
+static const char *const plan_resizes[] = {
+  "resize_image", "scale_image", "sample_image", "thumbnail_image", "adaptive_resize_image", NULL,
+};
+
+/* Mirrored orientations by their turns: a flip is two turns after a flop. */
+static const char *const plan_orients[] = {"flop_image", "transverse_image", "flip_image", "transpose_image", NULL};
+
+static const char lazy_wand_meta_name[] = "luamagick lazy wand";
+
+/* Magick wand methods that lazy wands record: those that change the image in
+ * place and only report whether they succeeded, so that they can be chained. */
+static const char *const lazy_methods[] = {
+> for fname in sorted(wands.Magick.funcs) do
+> if recordable('Magick', fname) then
+  "$(snake(fname))",
+> end
+> end
+  NULL,
+};
+
+static int plan_index(const char *name, const char *const *names) {
+  int i;
+  for (i = 0; names[i] != NULL; ++i) {
+    if (strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Reads numeric arguments 2 to n of the operation on top of the stack. */
+static int plan_numbers(lua_State *L, int n, double *v) {
+  int j, ok = 1;
+  for (j = 2; j <= n; ++j) {
+    lua_rawgeti(L, -1, j);
+    ok = ok && lua_type(L, -1) == LUA_TNUMBER;
+    v[j - 2] = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+  }
+  return ok;
+}
+
+static void plan_parse(lua_State *L, struct plan_op *p) {
+  int i, n = lua_objlen(L, -1);
+  const char *name;
+  double degrees;
+  p->kind = PLAN_OTHER;
+  p->args = n - 1;
+  lua_rawgeti(L, -1, 1);
+  name = lua_tostring(L, -1);
+  lua_pop(L, 1);
+  if (name == NULL) {
+    return;
+  } else if ((i = plan_index(name, plan_resizes)) >= 0) {
+    if (n == (i == 0 ? 5 : 3) && plan_numbers(L, n, p->v)) {
+      p->kind = PLAN_RESIZE;
+      p->method = i;
+    }
+  } else if (strcmp(name, "crop_image") == 0) {
+    if (n == 5 && plan_numbers(L, n, p->v)) {
+      p->kind = PLAN_CROP;
+    }
+  } else if ((i = plan_index(name, plan_orients)) >= 0) {
+    if (n == 1) {
+      p->kind = PLAN_ORIENT;
+      p->turns = i;
+      p->mirrored = 1;
+    }
+  } else if (strcmp(name, "rotate_image") == 0) {
+    lua_rawgeti(L, -1, 3);
+    degrees = lua_tonumber(L, -1);
+    if (n == 3 && lua_type(L, -1) == LUA_TNUMBER && fmod(degrees, 90) == 0) {
+      p->kind = PLAN_ORIENT;
+      p->turns = ((int)fmod(degrees / 90, 4) + 4) % 4;
+      p->mirrored = 0;
+    }
+    lua_pop(L, 1);
+  } else if (strcmp(name, "transform_image_colorspace") == 0) {
+    if (n == 2 && plan_numbers(L, n, p->v)) {
+      p->kind = PLAN_COLORSPACE;
+    }
+  }
+}
+
+static void plan_note(lua_State *L, int notes, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  lua_pushvfstring(L, fmt, ap);
+  va_end(ap);
+  lua_rawseti(L, notes, lua_objlen(L, notes) + 1);
+}
+
+/* Returns the index of the first operation from i on that was not dropped. */
+static int plan_next(const struct plan_op *plan, int n, int i) {
+  while (i < n && plan[i].kind == PLAN_DROPPED) {
+    ++i;
+  }
+  return i;
+}
+
+static void plan_fold_orients(lua_State *L, struct plan_op *plan, int n, int notes) {
+  int i, j, first;
+  for (i = plan_next(plan, n, 0); i < n; i = plan_next(plan, n, i + 1)) {
+    int turns = 0, mirrored = 0, count = 0;
+    if (plan[i].kind != PLAN_ORIENT) {
+      continue;
+    }
+    for (j = i; j < n && plan[j].kind == PLAN_ORIENT; j = plan_next(plan, n, j + 1)) {
+      /* A flop reverses the turns made before it. */
+      turns = ((plan[j].mirrored ? plan[j].turns - turns : plan[j].turns + turns) % 4 + 4) % 4;
+      mirrored ^= plan[j].mirrored;
+      ++count;
+    }
+    if (count > 1 || (turns == 0 && !mirrored)) {
+      first = i;
+      for (; i < j; ++i) {
+        plan[i].kind = PLAN_DROPPED;
+      }
+      if (turns != 0 || mirrored) {
+        plan[first].kind = PLAN_ORIENT;
+        plan[first].source = 0;
+        plan[first].turns = turns;
+        plan[first].mirrored = mirrored;
+      }
+      if (mirrored) {
+        plan_note(L, notes, "folded %d orientation operations into %s", count, plan_orients[turns]);
+      } else if (turns != 0) {
+        plan_note(L, notes, "folded %d orientation operations into rotate_image by %d", count, turns * 90);
+      } else {
+        plan_note(L, notes, "dropped %d orientation operations that cancel out", count);
+      }
+    }
+    i = j - 1;
+  }
+}
+
+/* Drops each resize followed by one to no larger a size in either dimension,
+ * which then resamples the larger image instead. A resize followed by a larger
+ * one is kept, since the detail it loses shows in the result, and so is a
+ * thumbnail, which also strips profiles. */
+static void plan_fuse_resizes(lua_State *L, struct plan_op *plan, int n, int notes) {
+  int i, j, count = 1;
+  for (i = plan_next(plan, n, 0); i < n; i = j) {
+    j = plan_next(plan, n, i + 1);
+    if (plan[i].kind == PLAN_RESIZE && j < n && plan[j].kind == PLAN_RESIZE &&
+        strcmp(plan_resizes[plan[i].method], "thumbnail_image") != 0 && plan[j].v[0] <= plan[i].v[0] &&
+        plan[j].v[1] <= plan[i].v[1]) {
+      plan[i].kind = PLAN_DROPPED;
+      ++count;
+    } else if (count > 1) {
+      plan_note(L, notes, "fused %d resizes into %s", count, plan_resizes[plan[i].method]);
+      count = 1;
+    }
+  }
+}
+
+/* Drops colorspace conversions to the colorspace the image is already in,
+ * starting from colorspace, or -1 when that is unknown. Conversions are never
+ * merged, since one to a narrower colorspace such as gray loses information
+ * that converting back does not restore. */
+static void plan_drop_colorspaces(lua_State *L, struct plan_op *plan, int n, int notes, int colorspace) {
+  int i;
+  for (i = plan_next(plan, n, 0); i < n; i = plan_next(plan, n, i + 1)) {
+    switch (plan[i].kind) {
+    case PLAN_RESIZE:
+    case PLAN_CROP:
+    case PLAN_ORIENT:
+      break;
+    case PLAN_COLORSPACE:
+      if (plan[i].v[0] == colorspace) {
+        plan[i].kind = PLAN_DROPPED;
+        plan_note(L, notes, "dropped transform_image_colorspace to the image's own colorspace");
+      } else {
+        colorspace = (int)plan[i].v[0];
+      }
+      break;
+    default:
+      colorspace = -1;
+    }
+  }
+}
+
+/* Moves crops ahead of the resizes they follow, starting from an image of
+ * width by height pixels, or of unknown size when width is 0. */
+static void plan_hoist_crops(lua_State *L, struct plan_op *plan, int n, int notes, double width, double height) {
+  int i, j;
+  for (i = plan_next(plan, n, 0); i < n; i = plan_next(plan, n, i + 1)) {
+    struct plan_op *p = &plan[i], *crop;
+    double *r;
+    switch (p->kind) {
+    case PLAN_RESIZE:
+      j = plan_next(plan, n, i + 1);
+      crop = j < n && plan[j].kind == PLAN_CROP ? &plan[j] : NULL;
+      r = crop == NULL ? NULL : crop->v;
+      if (r != NULL && width > 0 && p->v[0] >= 1 && p->v[1] >= 1 && r[0] >= 1 && r[1] >= 1 && r[2] >= 0 &&
+          r[3] >= 0 && r[2] + r[0] <= p->v[0] && r[3] + r[1] <= p->v[1] && fmod(r[0] * width, p->v[0]) == 0 &&
+          fmod(r[2] * width, p->v[0]) == 0 && fmod(r[1] * height, p->v[1]) == 0 &&
+          fmod(r[3] * height, p->v[1]) == 0) {
+        struct plan_op resize = *p;
+        *p = *crop;
+        p->source = 0;
+        p->v[0] = r[0] * width / resize.v[0];
+        p->v[1] = r[1] * height / resize.v[1];
+        p->v[2] = r[2] * width / resize.v[0];
+        p->v[3] = r[3] * height / resize.v[1];
+        resize.source = 0;
+        resize.v[0] = r[0];
+        resize.v[1] = r[1];
+        *crop = resize;
+        plan_note(L, notes, "moved crop_image ahead of %s", plan_resizes[resize.method]);
+        width = resize.v[0];
+        height = resize.v[1];
+        i = j;
+      } else {
+        width = p->v[0];
+        height = p->v[1];
+      }
+      break;
+    case PLAN_CROP:
+      if (width > 0 && p->v[2] >= 0 && p->v[3] >= 0 && p->v[2] < width && p->v[3] < height) {
+        width = p->v[0] < width - p->v[2] ? p->v[0] : width - p->v[2];
+        height = p->v[1] < height - p->v[3] ? p->v[1] : height - p->v[3];
+      } else {
+        width = 0;
+      }
+      break;
+    case PLAN_ORIENT:
+      if (p->turns % 2 == 1) {
+        double swap = width;
+        width = height;
+        height = swap;
+      }
+      break;
+    case PLAN_COLORSPACE:
+      break;
+    default:
+      width = 0;
+    }
+  }
+}
+
+static void plan_push(lua_State *L, int ops, const struct plan_op *p) {
+  int j;
+  if (p->source != 0) {
+    lua_rawgeti(L, ops, p->source);
+    return;
+  }
+  lua_newtable(L);
+  switch (p->kind) {
+  case PLAN_RESIZE:
+    lua_pushstring(L, plan_resizes[p->method]);
+    break;
+  case PLAN_CROP:
+    lua_pushstring(L, "crop_image");
+    break;
+  case PLAN_ORIENT:
+    lua_pushstring(L, p->mirrored ? plan_orients[p->turns] : "rotate_image");
+    lua_rawseti(L, -2, 1);
+    if (!p->mirrored) {
+      lua_pushstring(L, "none");
+      lua_rawseti(L, -2, 2);
+      lua_pushnumber(L, p->turns * 90);
+      lua_rawseti(L, -2, 3);
+    }
+    return;
+  default:
+    lua_pushstring(L, "transform_image_colorspace");
+  }
+  lua_rawseti(L, -2, 1);
+  for (j = 0; j < p->args; ++j) {
+    lua_pushnumber(L, p->v[j]);
+    lua_rawseti(L, -2, j + 2);
+  }
+}
+
+/* Pushes an optimized copy of the operations at ops, for the current image of
+ * the magick wand at wand or for any image if wand is 0, and the list of the
+ * rewrites made. */
+static void optimize_ops(lua_State *L, int ops, int wand) {
+  int i, notes, n = lua_objlen(L, ops);
+  struct plan_op *plan = lua_newuserdata(L, n * sizeof(*plan) + 1);
+  MagickWand *image = wand == 0 ? NULL : check_magick_wand(L, wand);
+  int has_image = image != NULL && MagickGetNumberImages(image) > 0;
+  for (i = 0; i < n; ++i) {
+    lua_rawgeti(L, ops, i + 1);
+    if (!lua_istable(L, -1)) {
+      luaL_error(L, "operation %d is not a table", i + 1);
+    }
+    plan_parse(L, &plan[i]);
+    plan[i].source = i + 1;
+    lua_pop(L, 1);
+  }
+  lua_newtable(L);
+  notes = lua_gettop(L);
+  plan_fold_orients(L, plan, n, notes);
+  plan_drop_colorspaces(L, plan, n, notes, has_image ? (int)MagickGetImageColorspace(image) : -1);
+  plan_fuse_resizes(L, plan, n, notes);
+  plan_hoist_crops(L, plan, n, notes, has_image ? MagickGetImageWidth(image) : 0,
+                   has_image ? MagickGetImageHeight(image) : 0);
+  lua_newtable(L);
+  for (i = 0; i < n; ++i) {
+    if (plan[i].kind != PLAN_DROPPED) {
+      plan_push(L, ops, &plan[i]);
+      lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+    }
+  }
+  lua_insert(L, -2);
+  lua_remove(L, -3);
+}
+
+static int optimize_pipeline(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  optimize_ops(L, 1, lua_isnoneornil(L, 2) ? 0 : 2);
+  return 2;
+}
+
+/* A lazy wand's environment holds its magick wand and the operations recorded
+ * so far. Indexing it with the name of a method in lazy_methods gives a
+ * function that records a call to it; other magick wand methods raise an
+ * error, since their results would be lost. */
+static int lazy_record(lua_State *L) {
+  int j, n = lua_gettop(L);
+  luaL_checkudata(L, 1, lazy_wand_meta_name);
+  lua_getfenv(L, 1);
+  lua_getfield(L, -1, "ops");
+  lua_createtable(L, n, 0);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_rawseti(L, -2, 1);
+  for (j = 2; j <= n; ++j) {
+    lua_pushvalue(L, j);
+    lua_rawseti(L, -2, j);
+  }
+  lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int lazy_index(lua_State *L) {
+  luaL_getmetatable(L, lazy_wand_meta_name);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  if (!lua_isnil(L, -1)) {
+    return 1;
+  }
+  luaL_getmetatable(L, magick_wand_meta_name);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  if (!lua_isfunction(L, -1)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (plan_index(lua_tostring(L, 2), lazy_methods) < 0) {
+    return luaL_error(L, "%s cannot be recorded on a lazy wand", lua_tostring(L, 2));
+  }
+  lua_pushvalue(L, 2);
+  lua_pushcclosure(L, lazy_record, 1);
+  return 1;
+}
+
+/* Pushes the lazy wand's magick wand and recorded operations. */
+static void lazy_state(lua_State *L) {
+  luaL_checkudata(L, 1, lazy_wand_meta_name);
+  lua_settop(L, 1);
+  lua_getfenv(L, 1);
+  lua_getfield(L, 2, "wand");
+  lua_getfield(L, 2, "ops");
+}
+
+static int lazy_optimize(lua_State *L) {
+  lazy_state(L);
+  optimize_ops(L, 4, 3);
+  return 2;
+}
+
+static int lazy_execute(lua_State *L) {
+  int failed;
+  lazy_state(L);
+  lua_newtable(L);
+  lua_setfield(L, 2, "ops");
+  optimize_ops(L, 4, 3);
+  if ((failed = apply_ops(L, 3, 5)) != 0) {
+    return failed;
+  }
+  lua_pushboolean(L, 1);
+  lua_insert(L, 6);
+  return 2;
+}
+
+static struct luaL_Reg lazy_wand_index[] = {
+  {"__index", lazy_index},
+  {"execute", lazy_execute},
+  {"optimize", lazy_optimize},
+  {NULL, NULL},
+};
+
+/* Font metrics are cached, most recently used first, keyed on the drawing
+ * wand's font settings, the image resolution and the text, since measuring
+ * renders the text through FreeType every time. */
+struct font_metrics_entry {
+  struct font_metrics_entry *prev, *next, *chain;
+  uint64_t hash;
+  size_t length;
+  double metrics[13];
+  char key[1];
+};
+
+static struct {
+  struct font_metrics_entry lru;
+  struct font_metrics_entry **buckets;
+  size_t capacity, mask, entries, hits, misses, evictions;
+} font_metrics = {{&font_metrics.lru, &font_metrics.lru, NULL, 0, 0, {0}, {0}}, NULL, 4096, 0, 0, 0, 0, 0};
+
+static void add_key_string(luaL_Buffer *b, char *s) {
+  size_t n = s == NULL ? 0 : strlen(s) + 1;
+  luaL_addlstring(b, (const char *)&n, sizeof(n));
+  if (s != NULL) {
+    luaL_addlstring(b, s, n - 1);
+    MagickRelinquishMemory(s);
+  }
+}
+
+static void add_key_number(luaL_Buffer *b, double v) {
+  luaL_addlstring(b, (const char *)&v, sizeof(v));
+}
+
+static void unlink_font_metrics(struct font_metrics_entry *e) {
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+}
+
+static void link_font_metrics(struct font_metrics_entry *e) {
+  e->prev = &font_metrics.lru;
+  e->next = font_metrics.lru.next;
+  e->next->prev = e;
+  font_metrics.lru.next = e;
+}
+
+static void clear_font_metrics(void) {
+  struct font_metrics_entry *e = font_metrics.lru.next;
+  while (e != &font_metrics.lru) {
+    struct font_metrics_entry *next = e->next;
+    free(e);
+    e = next;
+  }
+  font_metrics.lru.prev = font_metrics.lru.next = &font_metrics.lru;
+  free(font_metrics.buckets);
+  font_metrics.buckets = NULL;
+  font_metrics.entries = 0;
+}
+
+static void store_font_metrics(const char *key, size_t length, uint64_t hash, const double *metrics) {
+  struct font_metrics_entry *e, **p;
+  if (font_metrics.buckets == NULL) {
+    size_t n = 16;
+    while (n < font_metrics.capacity) {
+      n *= 2;
+    }
+    font_metrics.buckets = calloc(n, sizeof(*font_metrics.buckets));
+    if (font_metrics.buckets == NULL) {
+      return;
+    }
+    font_metrics.mask = n - 1;
+  }
+  if (font_metrics.entries == font_metrics.capacity) {
+    e = font_metrics.lru.prev;
+    for (p = &font_metrics.buckets[e->hash & font_metrics.mask]; *p != e; p = &(*p)->chain) {
+    }
+    *p = e->chain;
+    unlink_font_metrics(e);
+    free(e);
+    --font_metrics.entries;
+    ++font_metrics.evictions;
+  }
+  e = malloc(sizeof(*e) + length);
+  if (e == NULL) {
+    return;
+  }
+  e->hash = hash;
+  e->length = length;
+  memcpy(e->metrics, metrics, sizeof(e->metrics));
+  memcpy(e->key, key, length);
+  p = &font_metrics.buckets[hash & font_metrics.mask];
+  e->chain = *p;
+  *p = e;
+  link_font_metrics(e);
+  ++font_metrics.entries;
+}
+
+static int measure_text(MagickWand *wand, DrawingWand *draw, const char *text, int multiline, double *metrics) {
+  double *ret = multiline ? MagickQueryMultilineFontMetrics(wand, draw, text) : MagickQueryFontMetrics(wand, draw, text);
+  if (ret == NULL) {
+    return 0;
+  }
+  memcpy(metrics, ret, 13 * sizeof(*metrics));
+  MagickRelinquishMemory(ret);
+  return 1;
+}
+
+/* Measures text as MagickQueryFontMetrics or, if multiline, as
+ * MagickQueryMultilineFontMetrics does, filling metrics. Returns 0, leaving
+ * the exception on the wand, if the text cannot be measured. */
+static int query_font_metrics(lua_State *L, MagickWand *wand, DrawingWand *draw, const char *text, int multiline,
+                              double *metrics) {
+  luaL_Buffer b;
+  const char *key;
+  size_t length;
+  uint64_t hash;
+  double x = 0, y = 0;
+  int ok;
+  struct font_metrics_entry *e;
+  if (font_metrics.capacity == 0) {
+    return measure_text(wand, draw, text, multiline, metrics);
+  }
+  MagickGetImageResolution(wand, &x, &y);
+  luaL_buffinit(L, &b);
+  luaL_addchar(&b, multiline ? 'm' : 's');
+  add_key_string(&b, DrawGetFont(draw));
+  add_key_string(&b, DrawGetFontFamily(draw));
+  add_key_string(&b, DrawGetDensity(draw));
+  add_key_number(&b, DrawGetFontSize(draw));
+  add_key_number(&b, DrawGetFontWeight(draw));
+  add_key_number(&b, DrawGetFontStretch(draw));
+  add_key_number(&b, DrawGetFontStyle(draw));
+  add_key_number(&b, DrawGetTextKerning(draw));
+  add_key_number(&b, DrawGetTextInterwordSpacing(draw));
+  add_key_number(&b, DrawGetTextInterlineSpacing(draw));
+  add_key_number(&b, x);
+  add_key_number(&b, y);
+  luaL_addstring(&b, text);
+  luaL_pushresult(&b);
+  key = lua_tolstring(L, -1, &length);
+  hash = xxh3_64(key, length);
+  if (font_metrics.buckets != NULL) {
+    for (e = font_metrics.buckets[hash & font_metrics.mask]; e != NULL; e = e->chain) {
+      if (e->hash == hash && e->length == length && memcmp(e->key, key, length) == 0) {
+        unlink_font_metrics(e);
+        link_font_metrics(e);
+        memcpy(metrics, e->metrics, sizeof(e->metrics));
+        ++font_metrics.hits;
+        lua_pop(L, 1);
+        return 1;
+      }
+    }
+  }
+  ++font_metrics.misses;
+  ok = measure_text(wand, draw, text, multiline, metrics);
+  if (ok) {
+    store_font_metrics(key, length, hash, metrics);
+  }
+  lua_pop(L, 1);
+  return ok;
+}
+
+static void push_font_metrics(lua_State *L, const double *metrics) {
+  int i;
+  lua_createtable(L, 13, 0);
+  for (i = 0; i < 13; ++i) {
+    lua_pushnumber(L, metrics[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+}
+
+static int font_metrics_stats(lua_State *L) {
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, font_metrics.capacity);
+  lua_setfield(L, -2, "capacity");
+  lua_pushnumber(L, font_metrics.entries);
+  lua_setfield(L, -2, "entries");
+  lua_pushnumber(L, font_metrics.evictions);
+  lua_setfield(L, -2, "evictions");
+  lua_pushnumber(L, font_metrics.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, font_metrics.misses);
+  lua_setfield(L, -2, "misses");
+  return 1;
+}
+
+static int set_font_metrics_cache(lua_State *L) {
+  lua_Number capacity = luaL_checknumber(L, 1);
+  luaL_argcheck(L, capacity >= 0, 1, "capacity must not be negative");
+  clear_font_metrics();
+  font_metrics.capacity = capacity;
+  font_metrics.hits = font_metrics.misses = font_metrics.evictions = 0;
+  return 0;
+}
+
+/* Renditions are made largest first, each resized from the previous one when
+ * that covers it, and then encoded in parallel, one per thread. */
+struct rendition {
+  size_t index, columns, rows;
+  const char *format, *path;
+  double quality;
+  MagickWand *wand;
+  unsigned char *blob;
+  size_t length;
+  MagickBooleanType ok;
+};
+
+static int rendition_order(const void *a, const void *b) {
+  const struct rendition *x = a, *y = b;
+  size_t ax = x->columns * x->rows, ay = y->columns * y->rows;
+  if (ax != ay) {
+    return ax < ay ? 1 : -1;
+  }
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static void encode_renditions(void *ctx, size_t begin, size_t end) {
+  struct rendition *r = ctx;
+  size_t i;
+  for (i = begin; i < end; ++i) {
+    if (r[i].path != NULL) {
+      r[i].ok = MagickWriteImage(r[i].wand, r[i].path);
+    } else {
+      r[i].blob = MagickGetImageBlob(r[i].wand, &r[i].length);
+      r[i].ok = r[i].blob != NULL ? MagickTrue : MagickFalse;
+    }
+  }
+}
+
+/* Image attributes for describe_fast, in the order they are filled by
+ * default. Type is only filled on request, since deciding it may scan every
+ * pixel. */
+enum describe_field {
+  DESCRIBE_WIDTH,
+  DESCRIBE_HEIGHT,
+  DESCRIBE_FORMAT,
+  DESCRIBE_DEPTH,
+  DESCRIBE_COLORSPACE,
+  DESCRIBE_MATTE,
+  DESCRIBE_IMAGES,
+  DESCRIBE_INDEX,
+  DESCRIBE_SCENE,
+  DESCRIBE_DELAY,
+  DESCRIBE_ITERATIONS,
+  DESCRIBE_DISPOSE,
+  DESCRIBE_COMPRESSION,
+  DESCRIBE_QUALITY,
+  DESCRIBE_INTERLACE,
+  DESCRIBE_ORIENTATION,
+  DESCRIBE_UNITS,
+  DESCRIBE_X_RESOLUTION,
+  DESCRIBE_Y_RESOLUTION,
+  DESCRIBE_PAGE_WIDTH,
+  DESCRIBE_PAGE_HEIGHT,
+  DESCRIBE_PAGE_X,
+  DESCRIBE_PAGE_Y,
+  DESCRIBE_FILENAME,
+  DESCRIBE_TYPE,
+};
+
+static const char *const describe_fields[] = {
+  "width", "height", "format", "depth", "colorspace", "matte", "images", "index", "scene",
+  "delay", "iterations", "dispose", "compression", "quality", "interlace", "orientation", "units",
+  "x_resolution", "y_resolution", "page_width", "page_height", "page_x", "page_y", "filename", "type",
+  NULL,
+};
+
+static void push_describe_field(lua_State *L, MagickWand *wand, int field) {
+  double x, y;
+  lua_Number page[4];
+  size_t width, height;
+  ssize_t page_x, page_y;
+  char *s;
+  switch (field) {
+  case DESCRIBE_WIDTH:
+    lua_pushnumber(L, MagickGetImageWidth(wand));
+    break;
+  case DESCRIBE_HEIGHT:
+    lua_pushnumber(L, MagickGetImageHeight(wand));
+    break;
+  case DESCRIBE_FORMAT:
+  case DESCRIBE_FILENAME:
+    s = field == DESCRIBE_FORMAT ? MagickGetImageFormat(wand) : MagickGetImageFilename(wand);
+    lua_pushstring(L, s);
+    MagickRelinquishMemory(s);
+    break;
+  case DESCRIBE_DEPTH:
+    lua_pushnumber(L, MagickGetImageDepth(wand));
+    break;
+  case DESCRIBE_COLORSPACE:
+    lua_pushnumber(L, MagickGetImageColorspace(wand));
+    break;
+  case DESCRIBE_MATTE:
+    lua_pushboolean(L, MagickGetImageMatte(wand) == MagickTrue);
+    break;
+  case DESCRIBE_IMAGES:
+    lua_pushnumber(L, MagickGetNumberImages(wand));
+    break;
+  case DESCRIBE_INDEX:
+    lua_pushnumber(L, MagickGetIteratorIndex(wand));
+    break;
+  case DESCRIBE_SCENE:
+    lua_pushnumber(L, MagickGetImageScene(wand));
+    break;
+  case DESCRIBE_DELAY:
+    lua_pushnumber(L, MagickGetImageDelay(wand));
+    break;
+  case DESCRIBE_ITERATIONS:
+    lua_pushnumber(L, MagickGetImageIterations(wand));
+    break;
+  case DESCRIBE_DISPOSE:
+    lua_pushnumber(L, MagickGetImageDispose(wand));
+    break;
+  case DESCRIBE_COMPRESSION:
+    lua_pushnumber(L, MagickGetImageCompression(wand));
+    break;
+  case DESCRIBE_QUALITY:
+    lua_pushnumber(L, MagickGetImageCompressionQuality(wand));
+    break;
+  case DESCRIBE_INTERLACE:
+    lua_pushnumber(L, MagickGetImageInterlaceScheme(wand));
+    break;
+  case DESCRIBE_ORIENTATION:
+    lua_pushnumber(L, MagickGetImageOrientation(wand));
+    break;
+  case DESCRIBE_UNITS:
+    lua_pushnumber(L, MagickGetImageUnits(wand));
+    break;
+  case DESCRIBE_X_RESOLUTION:
+  case DESCRIBE_Y_RESOLUTION:
+    x = y = 0;
+    MagickGetImageResolution(wand, &x, &y);
+    lua_pushnumber(L, field == DESCRIBE_X_RESOLUTION ? x : y);
+    break;
+  case DESCRIBE_PAGE_WIDTH:
+  case DESCRIBE_PAGE_HEIGHT:
+  case DESCRIBE_PAGE_X:
+  case DESCRIBE_PAGE_Y:
+    width = height = 0;
+    page_x = page_y = 0;
+    MagickGetImagePage(wand, &width, &height, &page_x, &page_y);
+    page[0] = width;
+    page[1] = height;
+    page[2] = page_x;
+    page[3] = page_y;
+    lua_pushnumber(L, page[field - DESCRIBE_PAGE_WIDTH]);
+    break;
+  default:
+    lua_pushnumber(L, MagickGetImageType(wand));
+  }
+}
+
+/* Regions are streamed when the coder allows it: ReadStream hands each decoded
+ * row to region_row instead of caching the image, which keeps the part inside
+ * the region and stops the decoder after its last row, so only one row of the
+ * source is held at a time. region_row cannot tell which row it is given, so
+ * only formats in region_formats, whose coders hand rows over top to bottom,
+ * are streamed: BMP and TGA can store rows bottom up, GIF interlaces them and
+ * a ping cannot tell stripped TIFF images from tiled ones. CMYK images, whose
+ * black is not in the row, fail the stream. */
+static const char *const region_formats[] = {"JPEG", "PNG", NULL};
+
+struct region_stream {
+  size_t x, y, columns, rows;
+  size_t row;
+  int matte, failed;
+  Quantum *pixels;
+};
+
+static size_t region_row(const Image *image, const void *pixels, const size_t columns) {
+  struct region_stream *s = image->client_data;
+  const PixelPacket *p = (const PixelPacket *)pixels + s->x;
+  Quantum *q;
+  size_t i;
+  if (columns != image->columns || image->colorspace == CMYKColorspace) {
+    s->failed = 1;
+    return 0;
+  }
+  if (s->row >= s->y) {
+    q = s->pixels + 4 * (s->row - s->y) * s->columns;
+    for (i = 0; i < s->columns; ++i, ++p) {
+      *q++ = GetPixelRed(p);
+      *q++ = GetPixelGreen(p);
+      *q++ = GetPixelBlue(p);
+      *q++ = GetPixelAlpha(p);
+    }
+    s->matte = image->matte != MagickFalse;
+  }
+  return ++s->row < s->y + s->rows ? columns : 0;
+}
+
+/* Streams the region from a path or blob, returning whether all its rows were
+ * read. Stopping the decoder early leaves an exception, which is dropped. */
+static int stream_region(const char *source, size_t length, int blob, struct region_stream *s) {
+  ImageInfo *info = AcquireImageInfo();
+  ExceptionInfo *exception = AcquireExceptionInfo();
+  Image *image;
+  if (blob) {
+    SetImageInfoBlob(info, source, length);
+  } else {
+    CopyMagickString(info->filename, source, MaxTextExtent);
+  }
+  info->client_data = s;
+  image = ReadStream(info, region_row, exception);
+  if (image != NULL) {
+    DestroyImageList(image);
+  }
+  DestroyExceptionInfo(exception);
+  DestroyImageInfo(info);
+  return !s->failed && s->row >= s->y + s->rows;
+}
+
+/* Pushes the strings of a list returned by the wand and frees it, raising an
+ * error after freeing it if the stack cannot hold them all. */
+static int push_string_list(lua_State *L, char **value, size_t n, const char *msg) {
+  int fits = n <= INT_MAX && lua_checkstack(L, (int)n);
+  for (size_t i = 0; i < n; ++i) {
+    if (fits) {
+      lua_pushstring(L, value[i]);
+    }
+    MagickRelinquishMemory(value[i]);
+  }
+  MagickRelinquishMemory(value);
+  if (!fits) {
+    return luaL_error(L, "stack overflow (%s)", msg);
+  }
+  return (int)n;
+}
+
+/* Pushes a table of the current image's properties or artifacts, listed and
+ * read with the given pair of functions. */
+static void push_image_strings(lua_State *L, MagickWand *wand, char **(*list)(MagickWand *, const char *, size_t *),
+                               char *(*get)(MagickWand *, const char *)) {
+  size_t i, n = 0;
+  char **names = list(wand, "*", &n), *value;
+  lua_createtable(L, 0, n);
+  for (i = 0; names != NULL && i < n; ++i) {
+    value = get(wand, names[i]);
+    if (value != NULL) {
+      lua_pushstring(L, value);
+      lua_setfield(L, -2, names[i]);
+      MagickRelinquishMemory(value);
+    }
+    MagickRelinquishMemory(names[i]);
+  }
+  MagickRelinquishMemory(names);
+}
+
+/* Batches of primitives that take two points are flat arrays of four
+ * coordinates per primitive, drawn in one call. */
+static int draw_quads(lua_State *L, void (*draw)(DrawingWand *, double, double, double, double)) {
+  DrawingWand *wand = check_drawing_wand(L, 1);
+  double buf[STACK_ARRAY_LENGTH];
+  size_t i, n;
+  const double *v = check_double_array(L, 2, buf, STACK_ARRAY_LENGTH, &n);
+  luaL_argcheck(L, n % 4 == 0, 2, "array length is not a multiple of 4");
+  for (i = 0; i < n; i += 4) {
+    draw(wand, v[i], v[i + 1], v[i + 2], v[i + 3]);
+  }
+  return 0;
+}
+
+/* MVG is appended to a drawing wand as comments that start with a newline,
+ * the only way the API takes text verbatim, in chunks at line breaks since
+ * each comment must fit the wand's spare buffer. Returns 1, 0 if the wand
+ * reported an error, or -1 if a token is too long for a chunk. */
+#define MVG_CHUNK (4 * MaxTextExtent)
+
+static int append_mvg(DrawingWand *draw, const char *mvg) {
+  char chunk[MVG_CHUNK + 2];
+  size_t length = strlen(mvg), n;
+  ExceptionType severity = DrawGetExceptionType(draw);
+  while (length > 0) {
+    n = length;
+    if (n > MVG_CHUNK) {
+      for (n = MVG_CHUNK; n > 0 && mvg[n - 1] != '\n'; --n) {
+      }
+      for (n = n > 0 ? n : MVG_CHUNK; n > 0 && !strchr(" \t\n", mvg[n - 1]); --n) {
+      }
+      if (n == 0) {
+        return -1;
+      }
+    }
+    chunk[0] = '\n';
+    memcpy(chunk + 1, mvg, n);
+    chunk[n + 1] = '\0';
+    DrawComment(draw, chunk);
+    if (DrawGetExceptionType(draw) != severity) {
+      return 0;
+    }
+    mvg += n;
+    length -= n;
+  }
+  return 1;
+}
+
+/* Pushes XML character data with its entity and character references
+ * decoded. */
+static void push_xml_text(lua_State *L, const char *s, const char *end) {
+  static const char *const entities[] = {"&amp;", "&", "&apos;", "'", "&gt;", ">", "&lt;", "<", "&quot;", "\"", NULL};
+  luaL_Buffer b;
+  const char *semi;
+  int i;
+  luaL_buffinit(L, &b);
+  while (s < end) {
+    semi = *s == '&' ? memchr(s, ';', end - s) : NULL;
+    if (semi == NULL) {
+      luaL_addchar(&b, *s++);
+      continue;
+    }
+    if (s[1] == '#') {
+      luaL_addchar(&b, s[2] == 'x' ? strtol(s + 3, NULL, 16) : strtol(s + 2, NULL, 10));
+    } else {
+      for (i = 0; entities[i] != NULL && strncmp(s, entities[i], semi + 1 - s) != 0; i += 2) {
+      }
+      luaL_addlstring(&b, entities[i] != NULL ? entities[i + 1] : s, entities[i] != NULL ? 1 : semi + 1 - s);
+    }
+    s = semi + 1;
+  }
+  luaL_pushresult(&b);
+}
+
+static const char palette_dither_option[] = "luamagick:dither";
+
+/* Reads a palette wand's colors into a tree. Returns 0, leaving the
+ * exception on the wand, if they cannot be exported. */
+static int palette_tree_load(lua_State *L, int k, struct palette_tree *t) {
+  MagickWand *palette = check_magick_wand(L, k);
+  unsigned char rgba[PALETTE_MAX * 4];
+  size_t width, height;
+  if (MagickGetNumberImages(palette) == 0) {
+    return luaL_argerror(L, k, "palette wand has no image");
+  }
+  width = MagickGetImageWidth(palette);
+  height = MagickGetImageHeight(palette);
+  luaL_argcheck(L, width * height <= PALETTE_MAX, k, "palette has more than 256 colors");
+  if (MagickExportImagePixels(palette, 0, 0, width, height, "RGBA", CharPixel, rgba) != MagickTrue) {
+    return 0;
+  }
+  palette_tree_init(t, rgba, width * height);
+  return 1;
+}
+
+> for name, wand in sorted(wands) do
+> for fname, func in sorted(wand.funcs) do
+> if not func.unsupported then
+static int $(name:lower())_$(snake(fname))(lua_State *L) {
+$(func.special or funcbody(name, fname))
+}
+
+> end
+> end
+static struct luaL_Reg $(name:lower())_wand_index[] = {
+> for fname, func in sorted(wand.funcs) do
+> if not func.unsupported then
+  {"$(snake(fname))", $(name:lower())_$(snake(fname))},
+> end
+> end
+  {NULL, NULL},
+};
+
+> end
+struct call_stats {
+  size_t calls;
+  size_t errors;
+  double seconds;
+};
+
+struct hook {
+  const char *wand;
+  const char *meta_name;
+  const luaL_Reg *reg;
+  struct call_stats stats;
+};
+
+> for name in sorted(wands) do
+static struct hook $(name:lower())_wand_hooks[sizeof($(name:lower())_wand_index) / sizeof(*$(name:lower())_wand_index)];
+> end
+
+#define TRACE_CAPACITY 65536
+#define TRACE_NAME_LENGTH 48
+#define PROGRESS_DEPTH 8
+
+struct trace_event {
+  double ts;
+  const void *wand;
+  const char *category;
+  unsigned long tid;
+  size_t columns;
+  size_t rows;
+  char name[TRACE_NAME_LENGTH];
+  char phase;
+};
+
+static int stats_enabled = 0;
+static int trace_enabled = 0;
+static struct trace_event *trace_events = NULL;
+static size_t trace_capacity = 0;
+static size_t trace_count = 0;
+static double trace_start;
+static unsigned long trace_tid;
+static char progress_tags[PROGRESS_DEPTH][TRACE_NAME_LENGTH];
+static int progress_depth = 0;
+/* Progress monitors can run on ImageMagick's worker threads, so the buffer and
+ * the open progress spans are only touched under trace_lock. */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double monotonic_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Copies at most the first two components of a progress tag, e.g.
+ * "Resize/Image" out of "Resize/Image/logo.gif", keeping the JSON clean. */
+static void copy_trace_name(char *dst, const char *src, int components) {
+  int i;
+  for (i = 0; i < TRACE_NAME_LENGTH - 1 && src[i] != '\0'; ++i) {
+    if (src[i] == '/' && --components == 0) {
+      break;
+    }
+    dst[i] = src[i] == '"' || src[i] == '\\' || src[i] < ' ' ? '_' : src[i];
+  }
+  dst[i] = '\0';
+}
+
+static struct trace_event *trace_event(const char *category, const char *name, char phase) {
+  struct trace_event *e = &trace_events[trace_count++ % trace_capacity];
+  e->ts = (monotonic_seconds() - trace_start) * 1e6;
+  e->wand = NULL;
+  e->category = category;
+  e->tid = trace_tid;
+  e->columns = 0;
+  e->rows = 0;
+  copy_trace_name(e->name, name, 2);
+  e->phase = phase;
+  return e;
+}
+
+static void pop_progress_spans(int depth) {
+  while (progress_depth > depth) {
+    trace_event("progress", progress_tags[--progress_depth], 'E');
+  }
+}
+
+static MagickBooleanType trace_progress(const char *text, const MagickOffsetType offset, const MagickSizeType extent, void *client_data) {
+  char tag[TRACE_NAME_LENGTH];
+  int i;
+  if (!trace_enabled) {
+    return MagickTrue;
+  }
+  copy_trace_name(tag, text, 2);
+  pthread_mutex_lock(&trace_lock);
+  i = progress_depth - 1;
+  while (i >= 0 && strcmp(progress_tags[i], tag) != 0) {
+    --i;
+  }
+  if (i < 0 && progress_depth < PROGRESS_DEPTH) {
+    i = progress_depth++;
+    strcpy(progress_tags[i], tag);
+    trace_event("progress", tag, 'B');
+  }
+  if (i >= 0) {
+    pop_progress_spans(offset + 1 >= (MagickOffsetType)extent ? i : i + 1);
+  }
+  pthread_mutex_unlock(&trace_lock);
+  return MagickTrue;
+}
+
+static void trace_call(lua_State *L, const struct hook *hook, char phase) {
+  struct trace_event *e;
+  void *wand = NULL;
+  if (lua_getmetatable(L, 1)) {
+    luaL_getmetatable(L, hook->meta_name);
+    if (lua_rawequal(L, -1, -2)) {
+      wand = *(void **)lua_touserdata(L, 1);
+    }
+    lua_pop(L, 2);
+  }
+  pthread_mutex_lock(&trace_lock);
+  if (phase == 'B') {
+    trace_tid = (unsigned long)pthread_self();
+    progress_depth = 0;
+  } else {
+    pop_progress_spans(0);
+  }
+  e = trace_event(hook->wand, hook->reg->name, phase);
+  e->wand = wand;
+  if (wand != NULL && hook->meta_name == magick_wand_meta_name) {
+    if (phase == 'B') {
+      MagickSetProgressMonitor(wand, trace_progress, NULL);
+    }
+    if (MagickGetNumberImages(wand) != 0) {
+      e->columns = MagickGetImageWidth(wand);
+      e->rows = MagickGetImageHeight(wand);
+      if (phase == 'B') {
+        MagickSetImageProgressMonitor(wand, trace_progress, NULL);
+      }
+    }
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+static int call_hooked(lua_State *L, const struct hook *hook) {
+  if (cache_policies && hook->meta_name == magick_wand_meta_name) {
+    return call_with_cache_policy(L, hook->reg->func);
+  }
+  return hook->reg->func(L);
+}
+
+static int protected_hooked_call(lua_State *L) {
+  return call_hooked(L, lua_touserdata(L, lua_upvalueindex(1)));
+}
+
+static int hooked_call(lua_State *L) {
+  struct hook *hook = lua_touserdata(L, lua_upvalueindex(1));
+  int traced = trace_enabled, top = lua_gettop(L), status = 0, i, n;
+  double start = 0;
+  if (traced) {
+    trace_call(L, hook, 'B');
+  }
+  if (stats_enabled) {
+    start = monotonic_seconds();
+  }
+  if (traced) {
+    /* Errors are caught so that the span is still closed, then raised again. */
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushcclosure(L, protected_hooked_call, 1);
+    for (i = 1; i <= top; ++i) {
+      lua_pushvalue(L, i);
+    }
+    status = lua_pcall(L, top, LUA_MULTRET, 0);
+    n = lua_gettop(L) - top;
+  } else {
+    n = call_hooked(L, hook);
+  }
+  if (stats_enabled) {
+    hook->stats.seconds += monotonic_seconds() - start;
+    ++hook->stats.calls;
+    if (status != 0 || (n >= 2 && lua_isnil(L, -n))) {
+      ++hook->stats.errors;
+    }
+  }
+  if (traced) {
+    trace_call(L, hook, 'E');
+  }
+  if (status != 0) {
+    return lua_error(L);
+  }
+  return n;
+}
+
+/* Stats, tracing and cache policies work by swapping the metatable's methods
+ * for hooked closures, so that nothing is paid while all are unused. */
+static void install_hooks(lua_State *L, const char *wand, const char *meta_name, const luaL_Reg *reg, struct hook *hook) {
+  luaL_getmetatable(L, meta_name);
+  for (; reg->name != NULL; ++reg, ++hook) {
+    hook->wand = wand;
+    hook->meta_name = meta_name;
+    hook->reg = reg;
+    if (stats_enabled || trace_enabled || cache_policies) {
+      lua_pushlightuserdata(L, hook);
+      lua_pushcclosure(L, hooked_call, 1);
+    } else {
+      lua_pushcfunction(L, reg->func);
+    }
+    lua_setfield(L, -2, reg->name);
+  }
+  lua_pop(L, 1);
+}
+
+static void install_all_hooks(lua_State *L) {
+> for name in sorted(wands) do
+  install_hooks(L, "$(name:lower())", $(name:lower())_wand_meta_name, $(name:lower())_wand_index, $(name:lower())_wand_hooks);
+> end
+}
+
+static void push_stats(lua_State *L, const char *wand, const luaL_Reg *reg, const struct hook *hook) {
+  for (; reg->name != NULL; ++reg, ++hook) {
+    if (hook->stats.calls == 0) {
+      continue;
+    }
+    lua_pushfstring(L, "%s:%s", wand, reg->name);
+    lua_createtable(L, 0, 3);
+    lua_pushnumber(L, hook->stats.calls);
+    lua_setfield(L, -2, "calls");
+    lua_pushnumber(L, hook->stats.errors);
+    lua_setfield(L, -2, "errors");
+    lua_pushnumber(L, hook->stats.seconds);
+    lua_setfield(L, -2, "seconds");
+    lua_settable(L, -3);
+  }
+}
+
+static void clear_stats(struct hook *hook, size_t n) {
+  for (; n > 0; --n, ++hook) {
+    memset(&hook->stats, 0, sizeof(hook->stats));
+  }
+}
+
+static int get_stats(lua_State *L) {
+  lua_newtable(L);
+> for name in sorted(wands) do
+  push_stats(L, "$(name:lower())", $(name:lower())_wand_index, $(name:lower())_wand_hooks);
+> end
+  return 1;
+}
+
+static int reset_stats(lua_State *L) {
+> for name in sorted(wands) do
+  clear_stats($(name:lower())_wand_hooks, sizeof($(name:lower())_wand_hooks) / sizeof(*$(name:lower())_wand_hooks));
+> end
+  return 0;
+}
+
+static int set_stats(lua_State *L) {
+  stats_enabled = lua_toboolean(L, 1);
+  install_all_hooks(L);
+  return 0;
+}
+
+/* Enabling tracing starts a new trace in a ring buffer of the given number of
+ * events; disabling it keeps the events for trace_dump. */
+static int set_trace(lua_State *L) {
+  int enable = lua_toboolean(L, 1);
+  size_t capacity = luaL_optnumber(L, 2, TRACE_CAPACITY);
+  if (enable) {
+    luaL_argcheck(L, capacity > 0, 2, "trace capacity must be positive");
+    pthread_mutex_lock(&trace_lock);
+    free(trace_events);
+    trace_events = malloc(capacity * sizeof(*trace_events));
+    trace_capacity = capacity;
+    trace_count = 0;
+    trace_start = monotonic_seconds();
+    progress_depth = 0;
+    pthread_mutex_unlock(&trace_lock);
+    if (trace_events == NULL) {
+      trace_enabled = 0;
+      install_all_hooks(L);
+      return luaL_error(L, "cannot allocate trace buffer");
+    }
+  }
+  trace_enabled = enable;
+  install_all_hooks(L);
+  return 0;
+}
+
+static int trace_dump(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  FILE *f = fopen(path, "w");
+  size_t i = trace_count > trace_capacity ? trace_count - trace_capacity : 0;
+  const char *sep = "";
+  int depth = 0;
+  if (f == NULL) {
+    return push_failure(L, FileOpenError, "%s: %s", path, strerror(errno));
+  }
+  fputs("{\"traceEvents\":[", f);
+  for (; i < trace_count; ++i) {
+    const struct trace_event *e = &trace_events[i % trace_capacity];
+    /* Skip ends whose beginnings were overwritten in the ring buffer. */
+    if (e->phase == 'E' && depth == 0) {
+      continue;
+    }
+    depth += e->phase == 'B' ? 1 : -1;
+    fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%lu", sep, e->name,
+            e->category, e->phase, e->ts, (int)getpid(), e->tid);
+    fprintf(f, ",\"args\":{\"wand\":\"%p\",\"columns\":%lu,\"rows\":%lu}}", e->wand, (unsigned long)e->columns,
+            (unsigned long)e->rows);
+    sep = ",";
+  }
+  fputs("\n]}\n", f);
+  if (fclose(f) != 0) {
+    return push_failure(L, FileOpenError, "%s: %s", path, strerror(errno));
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+struct atlas_sprite {
+  MagickWand *wand;
+  size_t index;
+  size_t x;
+  size_t y;
+  size_t w;
+  size_t h;
+  unsigned short *pixels;
+};
+
+struct atlas_rect {
+  size_t x;
+  size_t y;
+  size_t w;
+  size_t h;
+};
+
+struct atlas_packer {
+  struct atlas_rect *free;
+  size_t count;
+  size_t capacity;
+};
+
+static int atlas_push_free(struct atlas_packer *p, size_t x, size_t y, size_t w, size_t h) {
+  if (p->count == p->capacity) {
+    size_t capacity = p->capacity * 2 + 16;
+    struct atlas_rect *free_rects = realloc(p->free, capacity * sizeof(*free_rects));
+    if (free_rects == NULL) {
+      return 0;
+    }
+    p->free = free_rects;
+    p->capacity = capacity;
+  }
+  p->free[p->count].x = x;
+  p->free[p->count].y = y;
+  p->free[p->count].w = w;
+  p->free[p->count].h = h;
+  ++p->count;
+  return 1;
+}
+
+static int atlas_contains(const struct atlas_rect *a, const struct atlas_rect *b) {
+  return b->x >= a->x && b->y >= a->y && b->x + b->w <= a->x + a->w && b->y + b->h <= a->y + a->h;
+}
+
+/* MaxRects: splits every free rectangle overlapping the placed one into the
+ * maximal free rectangles around it, then drops any contained in another. */
+static int atlas_place(struct atlas_packer *p, const struct atlas_rect *used) {
+  size_t i, j, n = p->count;
+  for (i = 0; i < n; ++i) {
+    struct atlas_rect f = p->free[i];
+    if (used->x >= f.x + f.w || used->x + used->w <= f.x || used->y >= f.y + f.h || used->y + used->h <= f.y) {
+      continue;
+    }
+    if (used->x > f.x && !atlas_push_free(p, f.x, f.y, used->x - f.x, f.h)) {
+      return 0;
+    }
+    if (used->x + used->w < f.x + f.w && !atlas_push_free(p, used->x + used->w, f.y, f.x + f.w - used->x - used->w, f.h)) {
+      return 0;
+    }
+    if (used->y > f.y && !atlas_push_free(p, f.x, f.y, f.w, used->y - f.y)) {
+      return 0;
+    }
+    if (used->y + used->h < f.y + f.h && !atlas_push_free(p, f.x, used->y + used->h, f.w, f.y + f.h - used->y - used->h)) {
+      return 0;
+    }
+    p->free[i].w = 0;
+  }
+  for (i = 0; i < p->count; ++i) {
+    for (j = 0; j < p->count && p->free[i].w != 0; ++j) {
+      if (i != j && p->free[j].w != 0 && atlas_contains(&p->free[j], &p->free[i])) {
+        p->free[i].w = 0;
+      }
+    }
+  }
+  for (i = j = 0; i < p->count; ++i) {
+    if (p->free[i].w != 0) {
+      p->free[j++] = p->free[i];
+    }
+  }
+  p->count = j;
+  return 1;
+}
+
+/* Packs the sprites into a bin of the given size using best short side fit.
+ * Returns 1 on success, 0 if they do not fit and -1 if out of memory. */
+static int atlas_pack(struct atlas_sprite *sprites, size_t n, size_t width, size_t height, size_t padding) {
+  struct atlas_packer p = {NULL, 0, 0};
+  size_t i, j;
+  int ok = atlas_push_free(&p, 0, 0, width + padding, height + padding) ? 1 : -1;
+  for (i = 0; i < n && ok == 1; ++i) {
+    struct atlas_rect used = {0, 0, 0, 0};
+    size_t best = (size_t)-1, best_long = (size_t)-1;
+    used.w = sprites[i].w + padding;
+    used.h = sprites[i].h + padding;
+    for (j = 0; j < p.count; ++j) {
+      const struct atlas_rect *f = &p.free[j];
+      if (used.w <= f->w && used.h <= f->h) {
+        size_t dw = f->w - used.w, dh = f->h - used.h;
+        size_t short_side = dw < dh ? dw : dh, long_side = dw < dh ? dh : dw;
+        if (short_side < best || (short_side == best && long_side < best_long)) {
+          best = short_side;
+          best_long = long_side;
+          used.x = f->x;
+          used.y = f->y;
+        }
+      }
+    }
+    if (best == (size_t)-1) {
+      ok = 0;
+    } else if (!atlas_place(&p, &used)) {
+      ok = -1;
+    } else {
+      sprites[i].x = used.x;
+      sprites[i].y = used.y;
+    }
+  }
+  free(p.free);
+  return ok;
+}
+
+static int atlas_sprite_order(const void *a, const void *b) {
+  const struct atlas_sprite *x = a, *y = b;
+  size_t mx = x->w > x->h ? x->w : x->h, my = y->w > y->h ? y->w : y->h;
+  if (mx != my) {
+    return mx < my ? 1 : -1;
+  }
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+struct atlas_blit {
+  const struct atlas_sprite *sprites;
+  size_t n;
+  size_t width;
+  unsigned short *pixels;
+};
+
+static void atlas_blit_rows(void *ctx, size_t begin, size_t end) {
+  const struct atlas_blit *b = ctx;
+  size_t i, y;
+  for (i = 0; i < b->n; ++i) {
+    const struct atlas_sprite *s = &b->sprites[i];
+    size_t y0 = s->y > begin ? s->y : begin, y1 = s->y + s->h < end ? s->y + s->h : end;
+    for (y = y0; y < y1; ++y) {
+      memcpy(b->pixels + (y * b->width + s->x) * 4, s->pixels + (y - s->y) * s->w * 4, s->w * 4 * sizeof(*s->pixels));
+    }
+  }
+}
+
+static size_t next_power_of_two(size_t n) {
+  size_t p = 1;
+  while (p < n) {
+    p *= 2;
+  }
+  return p;
+}
+
+static int pack_atlas(lua_State *L) {
+  size_t n, i, area = 0, side = 1, width, height, total = 0;
+  size_t max_size = option_number(L, 2, "max_size", 4096);
+  size_t padding = option_number(L, 2, "padding", 0);
+  int power_of_two = option_boolean(L, 2, "power_of_two", 0);
+  struct atlas_sprite *sprites;
+  struct atlas_blit blit;
+  unsigned short *buffer;
+  MagickWand *atlas;
+  int packed = 0;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_objlen(L, 1);
+  sprites = lua_newuserdata(L, (n ? n : 1) * sizeof(*sprites));
+  for (i = 0; i < n; ++i) {
+    lua_rawgeti(L, 1, i + 1);
+    sprites[i].wand = check_magick_wand(L, -1);
+    lua_pop(L, 1);
+    if (MagickGetNumberImages(sprites[i].wand) == 0) {
+      return luaL_argerror(L, 1, "sprite wand has no image");
+    }
+    sprites[i].index = i;
+    sprites[i].w = MagickGetImageWidth(sprites[i].wand);
+    sprites[i].h = MagickGetImageHeight(sprites[i].wand);
+    sprites[i].pixels = NULL;
+    area += (sprites[i].w + padding) * (sprites[i].h + padding);
+    side = sprites[i].w > side ? sprites[i].w : side;
+    side = sprites[i].h > side ? sprites[i].h : side;
+  }
+  qsort(sprites, n, sizeof(*sprites), atlas_sprite_order);
+  side = next_power_of_two(side);
+  while (side * side < area) {
+    side *= 2;
+  }
+  /* Grow the bin, alternating width and height, until everything fits. */
+  width = height = side;
+  while (width <= max_size && height <= max_size) {
+    packed = atlas_pack(sprites, n, width, height, padding);
+    if (packed != 0) {
+      break;
+    }
+    if (width == height) {
+      width *= 2;
+    } else {
+      height *= 2;
+    }
+  }
+  if (packed < 0) {
+    return luaL_error(L, "out of memory packing atlas");
+  }
+  if (packed == 0) {
+    return push_failure(L, OptionError, "sprites do not fit within max_size");
+  }
+  width = height = 1;
+  for (i = 0; i < n; ++i) {
+    width = sprites[i].x + sprites[i].w > width ? sprites[i].x + sprites[i].w : width;
+    height = sprites[i].y + sprites[i].h > height ? sprites[i].y + sprites[i].h : height;
+    total += sprites[i].w * sprites[i].h * 4;
   }
-  args = malloc(nargs * sizeof(*args));
-  for (i = 1; i <= nargs; ++i) {
-    lua_pushnumber(L, i);
-    lua_gettable(L, 3);
-    args[i - 1] = luaL_checknumber(L, top + 1);
-    lua_pop(L, 1);
+  if (power_of_two) {
+    width = next_power_of_two(width);
+    height = next_power_of_two(height);
   }
-  ret = MagickDistortImage(wand, method, nargs, args, bestfit);
-  free(args);
-  if (ret != MagickTrue) {
-    return magick_error(L, wand);
+  buffer = calloc(width * height * 4 + total, sizeof(*buffer));
+  if (buffer == NULL) {
+    return luaL_error(L, "out of memory composing atlas");
   }
-  lua_pushboolean(L, 1);
-  return 1;]],
-}
-wands.Magick.funcs.GetOptions = {
-  special = [[
-  MagickWand *wand = check_magick_wand(L, 1);
-  const char *pattern = luaL_checkstring(L, 2);
-  size_t num_options;
-  char **value = MagickGetOptions(wand, pattern, &num_options);
-  for (int i = 0; i < num_options; ++i) {
-    lua_pushstring(L, value[i]);
-    MagickRelinquishMemory(value[i]);
+  total = width * height * 4;
+  for (i = 0; i < n; ++i) {
+    sprites[i].pixels = buffer + total;
+    total += sprites[i].w * sprites[i].h * 4;
+    if (MagickExportImagePixels(sprites[i].wand, 0, 0, sprites[i].w, sprites[i].h, "RGBA", ShortPixel, sprites[i].pixels) != MagickTrue) {
+      free(buffer);
+      return magick_error(L, sprites[i].wand);
+    }
   }
-  MagickRelinquishMemory(value);
-  return num_options;]],
-}
-wands.Magick.funcs.QueryFontMetrics = { doubles = 13 }
-wands.Magick.funcs.QueryMultilineFontMetrics = { doubles = 13 }
-wands.Magick.funcs.ReadImageBlob = {
-  special = [[
-  MagickWand *wand = check_magick_wand(L, 1);
-  size_t length;
-  const char *data = luaL_checklstring(L, 2, &length);
-  if (MagickReadImageBlob(wand, data, length) != MagickTrue) {
-    return magick_error(L, wand);
+  blit.sprites = sprites;
+  blit.n = n;
+  blit.width = width;
+  blit.pixels = buffer;
+  parallel_rows(height, atlas_blit_rows, &blit);
+  atlas = NewMagickWand();
+  if (MagickConstituteImage(atlas, width, height, "RGBA", ShortPixel, buffer) != MagickTrue) {
+    free(buffer);
+    wrap_magick_wand(L, atlas);
+    return magick_error(L, atlas);
   }
-  lua_pushboolean(L, 1);
-  return 1;]],
+  free(buffer);
+  wrap_magick_wand(L, atlas);
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; ++i) {
+    lua_createtable(L, 0, 4);
+    lua_pushnumber(L, sprites[i].x);
+    lua_setfield(L, -2, "x");
+    lua_pushnumber(L, sprites[i].y);
+    lua_setfield(L, -2, "y");
+    lua_pushnumber(L, sprites[i].w);
+    lua_setfield(L, -2, "w");
+    lua_pushnumber(L, sprites[i].h);
+    lua_setfield(L, -2, "h");
+    lua_rawseti(L, -2, sprites[i].index + 1);
+  }
+  return 2;
 }
 
--- TODO find a better way to maintain this blacklist
-wands.Magick.funcs.GetOrientationType = nil
+static int pipeline_run(lua_State *L) {
+  return run_pipeline(L, 1, NULL, 0);
+}
 
-local function snake(s)
-  -- c/o https://codegolf.stackexchange.com/a/177958
-  return s
-    :gsub('%f[^%l]%u', '_%1')
-    :gsub('%f[^%a]%d', '_%1')
-    :gsub('%f[^%d]%a', '_%1')
-    :gsub('(%u)(%u%l)', '%1_%2')
-    :lower()
-end
+/* Result caches are directories of blobs named by the 64-bit hash of their
+ * pipeline, kept under max_bytes by removing the least recently used, which
+ * hits mark by touching them. The directory may be shared between processes;
+ * each rescans it when its own count of the size goes over. */
+static const char result_cache_meta_name[] = "luamagick result cache";
 
-local function fixdent(s)
-  local t = require('pl.text')
-  return sx.rstrip(t.indent(t.dedent(s), 2))
-end
+struct result_cache {
+  size_t max_bytes;
+  size_t bytes;
+  size_t entries;
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  char dir[1];
+};
 
-local dtmpl = tmpl([[
-  double *ret = $fcall;
-  int i;
-  if (ret == NULL) {
-    return 0;
-  }
-  lua_createtable(L, $num, 0);
-  for (i = 0; i < $num; ++i) {
-    lua_pushnumber(L, ret[i]);
-    lua_rawseti(L, -2, i + 1);
-  }
-  return 1;
-]])
+struct cache_entry {
+  time_t used;
+  size_t size;
+  char name[24];
+};
 
-local function funcbody(name, fname)
-  local t = {}
-  local wand = wands[name]
-  local func = wand.funcs[fname]
-  local args = {}
-  local cf = allfuncs[func.name or (wand.prefix .. fname)]
-  for i, arg in ipairs(cf.args) do
-    table.insert(args, 'arg' .. i)
-    table.insert(t, '  ' .. argCode[arg]:substitute({ num = i }))
-  end
-  table.insert(
-    t,
-    fixdent((func.doubles and dtmpl or retCode[cf.ret]):substitute({
-      fcall = ('%s(%s)'):format(func.name or (wand.prefix .. fname), table.concat(args, ', ')),
-      lower = name:lower(),
-      num = func.doubles,
-    }))
-  )
-  return table.concat(t, '\n')
-end
+static int cache_entry_order(const void *a, const void *b) {
+  const struct cache_entry *x = a, *y = b;
+  return x->used < y->used ? -1 : x->used > y->used;
+}
 
-local plsub = require('pl.template').substitute
-pf.write(
-  'luamagick.c',
-  assert(plsub(
-    [[
-#include <lauxlib.h>
-#include <lua.h>
-#include <wand/MagickWand.h>
+static int is_cache_entry(const char *name) {
+  return strspn(name, "0123456789abcdef") == 16 && strcmp(name + 16, ".blob") == 0;
+}
 
-> for name, wand in sorted(wands) do
-static const char $(name:lower())_wand_meta_name[] = "luamagick $(name:lower()) wand";
+static void cache_scan(struct result_cache *cache) {
+  DIR *dir = opendir(cache->dir);
+  size_t n = 0, capacity = 0, removed = 0, i, length = strlen(cache->dir);
+  struct cache_entry *entries = NULL;
+  char *path = malloc(length + sizeof(entries->name) + 1);
+  struct dirent *e;
+  if (dir == NULL || path == NULL) {
+    if (dir != NULL) {
+      closedir(dir);
+    }
+    free(path);
+    return;
+  }
+  memcpy(path, cache->dir, length);
+  path[length] = '/';
+  cache->bytes = 0;
+  while ((e = readdir(dir)) != NULL) {
+    struct stat st;
+    if (!is_cache_entry(e->d_name)) {
+      continue;
+    }
+    strcpy(path + length + 1, e->d_name);
+    if (stat(path, &st) != 0) {
+      continue;
+    }
+    if (n == capacity) {
+      struct cache_entry *grown = realloc(entries, (capacity = capacity ? capacity * 2 : 64) * sizeof(*entries));
+      if (grown == NULL) {
+        break;
+      }
+      entries = grown;
+    }
+    entries[n].used = st.st_mtime;
+    entries[n].size = st.st_size;
+    strcpy(entries[n].name, e->d_name);
+    cache->bytes += st.st_size;
+    ++n;
+  }
+  closedir(dir);
+  if (n > 0) {
+    qsort(entries, n, sizeof(*entries), cache_entry_order);
+  }
+  for (i = 0; i < n && cache->bytes > cache->max_bytes; ++i) {
+    strcpy(path + length + 1, entries[i].name);
+    if (remove(path) == 0) {
+      cache->bytes -= entries[i].size;
+      ++cache->evictions;
+      ++removed;
+    }
+  }
+  cache->entries = n - removed;
+  free(entries);
+  free(path);
+}
 
-static int $(name:lower())_error(lua_State *L, $(name)Wand *wand) {
-  ExceptionType severity;
-  char *error = $(wand.prefix)GetException(wand, &severity);
-  lua_pushnil(L);
-  lua_pushstring(L, error);
-  MagickRelinquishMemory(error);
-  return 2;
+/* Blobs are written to a temporary file and renamed into place, so readers
+ * never see partial entries; failing to store one is not an error. */
+static void cache_store(lua_State *L, struct result_cache *cache, const char *path, const char *blob, size_t length) {
+  const char *tmp;
+  FILE *f;
+  int ok;
+  if (length > cache->max_bytes) {
+    return;
+  }
+  tmp = lua_pushfstring(L, "%s.%d.tmp", path, (int)getpid());
+  f = fopen(tmp, "wb");
+  if (f == NULL) {
+    lua_pop(L, 1);
+    return;
+  }
+  ok = fwrite(blob, 1, length, f) == length;
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp, path) != 0) {
+    remove(tmp);
+    lua_pop(L, 1);
+    return;
+  }
+  lua_pop(L, 1);
+  cache->bytes += length;
+  ++cache->entries;
+  if (cache->bytes > cache->max_bytes) {
+    cache_scan(cache);
+  }
 }
 
-static $(name)Wand *check_$(name:lower())_wand(lua_State *L, int k) {
-  void *ud = luaL_checkudata(L, k, $(name:lower())_wand_meta_name);
-  luaL_argcheck(L, ud != NULL, k, "$(name:lower()) wand expected");
-  return *($(name)Wand **)ud;
+/* Keys cover the source, the operations and the output options. Blobs and
+ * paths are keyed by content, paths also by extension, and wands by pixel
+ * hash and format. */
+static void pipeline_key(lua_State *L, int k, const char *data, size_t length, char hex[17]) {
+  int top = lua_gettop(L);
+  size_t n;
+  lua_pushliteral(L, "luamagick pipeline 1");
+  if (lua_type(L, k) == LUA_TUSERDATA) {
+    push_cache_key(L, k);
+  } else {
+    const char *source = lua_tolstring(L, k, &n), *extension = "";
+    if (data == NULL) {
+      data = source;
+      length = n;
+    } else if (strrchr(source, '.') != NULL) {
+      extension = strrchr(source, '.');
+    }
+    snprintf(hex, 17, "%016llx", (unsigned long long)xxh3_64(data, length));
+    lua_pushfstring(L, "b%s:%d:%s", hex, (int)strlen(extension), extension);
+  }
+  push_cache_key(L, k + 1);
+  if (lua_istable(L, k + 2)) {
+    lua_getfield(L, k + 2, "format");
+    push_cache_key(L, -1);
+    lua_remove(L, -2);
+    lua_getfield(L, k + 2, "quality");
+    push_cache_key(L, -1);
+    lua_remove(L, -2);
+  }
+  lua_concat(L, lua_gettop(L) - top);
+  data = lua_tolstring(L, -1, &n);
+  snprintf(hex, 17, "%016llx", (unsigned long long)xxh3_64(data, n));
+  lua_pop(L, 1);
 }
 
-static int wrap_$(name:lower())_wand(lua_State *L, $(name)Wand *wand) {
-  $(name)Wand **p = lua_newuserdata(L, sizeof(*p));
-  luaL_getmetatable(L, $(name:lower())_wand_meta_name);
+static int cache_open(lua_State *L) {
+  size_t n;
+  const char *dir = luaL_checklstring(L, 1, &n);
+  lua_Number max_bytes = luaL_checknumber(L, 2);
+  struct result_cache *cache;
+  luaL_argcheck(L, max_bytes >= 0, 2, "max_bytes must not be negative");
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+    return push_failure(L, FileOpenError, "%s: %s", dir, strerror(errno));
+  }
+  cache = lua_newuserdata(L, sizeof(*cache) + n);
+  memset(cache, 0, sizeof(*cache));
+  memcpy(cache->dir, dir, n + 1);
+  cache->max_bytes = max_bytes;
+  luaL_getmetatable(L, result_cache_meta_name);
   lua_setmetatable(L, -2);
-  *p = wand;
+  cache_scan(cache);
   return 1;
 }
 
-static int new_$(name:lower())_wand(lua_State *L) {
-  return wrap_$(name:lower())_wand(L, New$(name)Wand());
+static int cache_run(lua_State *L) {
+  struct result_cache *cache = luaL_checkudata(L, 1, result_cache_meta_name);
+  const char *data = NULL, *path, *blob;
+  size_t length = 0, n;
+  char hex[17];
+  int results;
+  if (lua_type(L, 2) != LUA_TUSERDATA) {
+    const char *source = luaL_checklstring(L, 2, &n);
+    if (!is_blob(L, 4, source, n) && (data = push_file(L, source, &length)) == NULL) {
+      return push_failure(L, FileOpenError, "%s: %s", source, strerror(errno));
+    }
+  }
+  luaL_checktype(L, 3, LUA_TTABLE);
+  pipeline_key(L, 2, data, length, hex);
+  path = lua_pushfstring(L, "%s/%s.blob", cache->dir, hex);
+  if (push_file(L, path, &n) != NULL) {
+    utime(path, NULL);
+    ++cache->hits;
+    lua_pushboolean(L, 1);
+    return 2;
+  }
+  ++cache->misses;
+  results = run_pipeline(L, 2, data, length);
+  if (lua_isnil(L, -results)) {
+    return results;
+  }
+  blob = lua_tolstring(L, -1, &n);
+  cache_store(L, cache, path, blob, n);
+  lua_pushboolean(L, 0);
+  return 2;
 }
 
-> end
-> for name, wand in sorted(wands) do
-> for fname, func in sorted(wand.funcs) do
-> if not func.unsupported then
-static int $(name:lower())_$(snake(fname))(lua_State *L) {
-$(func.special or funcbody(name, fname))
+static int cache_stats(lua_State *L) {
+  struct result_cache *cache = luaL_checkudata(L, 1, result_cache_meta_name);
+  lua_createtable(L, 0, 6);
+  lua_pushnumber(L, cache->bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, cache->entries);
+  lua_setfield(L, -2, "entries");
+  lua_pushnumber(L, cache->evictions);
+  lua_setfield(L, -2, "evictions");
+  lua_pushnumber(L, cache->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, cache->max_bytes);
+  lua_setfield(L, -2, "max_bytes");
+  lua_pushnumber(L, cache->misses);
+  lua_setfield(L, -2, "misses");
+  return 1;
 }
 
-> end
-> end
-static struct luaL_Reg $(name:lower())_wand_index[] = {
-> for fname, func in sorted(wand.funcs) do
-> if not func.unsupported then
-  {"$(snake(fname))", $(name:lower())_$(snake(fname))},
-> end
-> end
+static struct luaL_Reg result_cache_index[] = {
+  {"run", cache_run},
+  {"stats", cache_stats},
   {NULL, NULL},
 };
 
-> end
+/* Tiled processing cuts each tile from the source with up to overlap pixels
+ * around it, applies the operations, which must keep its size, and imports
+ * the inner part into the output. Only point and local operations reaching no
+ * further than the overlap give the same result as whole-image processing. */
+struct tiled_job {
+  MagickWand *src;
+  MagickWand *tile;
+  MagickWand *out;
+  int owns_src;
+};
+
+static int process_tiles(lua_State *L) {
+  struct tiled_job *job = lua_touserdata(L, 5);
+  size_t tile = option_number(L, 4, "tile", 1024), overlap = option_number(L, 4, "overlap", 16);
+  const char *dst = luaL_checkstring(L, 2);
+  size_t width, height, x, y;
+  unsigned short *pixels;
+  PixelWand *background;
+  MagickBooleanType ok;
+  int tile_index, failed;
+  luaL_argcheck(L, tile > 0, 4, "tile must be positive");
+  luaL_checktype(L, 3, LUA_TTABLE);
+  if (lua_type(L, 1) == LUA_TUSERDATA) {
+    job->src = check_magick_wand(L, 1);
+  } else {
+    const char *path = luaL_checkstring(L, 1);
+    job->src = NewMagickWand();
+    job->owns_src = 1;
+    if (MagickReadImage(job->src, path) != MagickTrue) {
+      return magick_error(L, job->src);
+    }
+  }
+  width = MagickGetImageWidth(job->src);
+  height = MagickGetImageHeight(job->src);
+  if (width == 0 || height == 0) {
+    return magick_error(L, job->src);
+  }
+  job->tile = NewMagickWand();
+  wrap_magick_wand(L, job->tile);
+  tile_index = lua_gettop(L);
+  job->out = NewMagickWand();
+  background = NewPixelWand();
+  ok = MagickNewImage(job->out, width, height, background);
+  DestroyPixelWand(background);
+  if (ok != MagickTrue || MagickSetImageDepth(job->out, MagickGetImageDepth(job->src)) != MagickTrue) {
+    return magick_error(L, job->out);
+  }
+  pixels = lua_newuserdata(L, tile * tile * 4 * sizeof(*pixels));
+  for (y = 0; y < height; y += tile) {
+    for (x = 0; x < width; x += tile) {
+      size_t w = width - x < tile ? width - x : tile, h = height - y < tile ? height - y : tile;
+      size_t left = x < overlap ? x : overlap, top = y < overlap ? y : overlap;
+      size_t right = width - x - w < overlap ? width - x - w : overlap;
+      size_t bottom = height - y - h < overlap ? height - y - h : overlap;
+      MagickWand *region = MagickGetImageRegion(job->src, left + w + right, top + h + bottom, x - left, y - top);
+      if (region == NULL) {
+        return magick_error(L, job->src);
+      }
+      ok = MagickAddImage(job->tile, region);
+      DestroyMagickWand(region);
+      if (ok != MagickTrue) {
+        return magick_error(L, job->tile);
+      }
+      if ((failed = apply_ops(L, tile_index, 3)) != 0) {
+        return failed;
+      }
+      if (MagickGetImageWidth(job->tile) != left + w + right || MagickGetImageHeight(job->tile) != top + h + bottom) {
+        return push_failure(L, OptionError, "operations must keep the tile size");
+      }
+      if (MagickExportImagePixels(job->tile, left, top, w, h, "RGBA", ShortPixel, pixels) != MagickTrue) {
+        return magick_error(L, job->tile);
+      }
+      if (MagickImportImagePixels(job->out, x, y, w, h, "RGBA", ShortPixel, pixels) != MagickTrue) {
+        return magick_error(L, job->out);
+      }
+      drop_images(job->tile);
+    }
+  }
+  if (MagickWriteImage(job->out, dst) != MagickTrue) {
+    return magick_error(L, job->out);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* While tiles are processed, ImageMagick caches images larger than
+ * opts.memory bytes on disk, so neither the decoded source nor the output
+ * needs memory; the limits are restored and the wands destroyed afterwards,
+ * even on errors. */
+static int process_tiled(lua_State *L) {
+  size_t span = option_number(L, 4, "tile", 1024) + 2 * option_number(L, 4, "overlap", 16);
+  MagickSizeType memory = option_number(L, 4, "memory", span * span * 64);
+  MagickSizeType limits[sizeof(cache_resources) / sizeof(*cache_resources)], limit;
+  struct tiled_job job = {NULL, NULL, NULL, 0};
+  size_t i;
+  int status;
+  lua_settop(L, 4);
+  for (i = 0; i < sizeof(limits) / sizeof(*limits); ++i) {
+    /* The area limit counts pixels, each a PixelPacket of four quantums. */
+    limit = cache_resources[i] == AreaResource ? memory / (4 * sizeof(Quantum)) : memory;
+    limits[i] = MagickGetResourceLimit(cache_resources[i]);
+    if (limit < limits[i]) {
+      MagickSetResourceLimit(cache_resources[i], limit);
+    }
+  }
+  lua_pushcfunction(L, process_tiles);
+  lua_insert(L, 1);
+  lua_pushlightuserdata(L, &job);
+  status = lua_pcall(L, 5, LUA_MULTRET, 0);
+  for (i = 0; i < sizeof(limits) / sizeof(*limits); ++i) {
+    MagickSetResourceLimit(cache_resources[i], limits[i]);
+  }
+  if (job.owns_src) {
+    DestroyMagickWand(job.src);
+  }
+  if (job.tile != NULL) {
+    DestroyMagickWand(job.tile);
+  }
+  if (job.out != NULL) {
+    DestroyMagickWand(job.out);
+  }
+  if (status != 0) {
+    return lua_error(L);
+  }
+  return lua_gettop(L);
+}
+
+/* Checkpoints are MPC files, whose pixel cache ImageMagick maps rather than
+ * reads, so pixels are only loaded when touched. */
+static int open_checkpoint(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  MagickWand *wand = NewMagickWand();
+  wrap_magick_wand(L, wand);
+  if (MagickReadImage(wand, lua_pushfstring(L, "mpc:%s", path)) != MagickTrue) {
+    return magick_error(L, wand);
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+/* Palettes are built from a sample of at most PALETTE_SAMPLES pixels across
+ * all the wands. */
+static int build_palette(lua_State *L) {
+  size_t n, colors = luaL_optnumber(L, 2, PALETTE_MAX), count = 0, size, i, step;
+  int dither = option_boolean(L, 3, "dither", 0);
+  unsigned char *samples, rgba[PALETTE_MAX * 4];
+  MagickWand *wand;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_objlen(L, 1);
+  luaL_argcheck(L, colors >= 1 && colors <= PALETTE_MAX, 2, "palettes have 1 to 256 colors");
+  for (i = 1; i <= n; ++i) {
+    lua_rawgeti(L, 1, i);
+    wand = check_magick_wand(L, -1);
+    lua_pop(L, 1);
+    if (MagickGetNumberImages(wand) == 0) {
+      return luaL_argerror(L, 1, "wand has no image");
+    }
+  }
+  samples = lua_newuserdata(L, PALETTE_SAMPLES * 4);
+  for (i = 1; i <= n; ++i) {
+    size_t width, height, y, budget = PALETTE_SAMPLES / n;
+    lua_rawgeti(L, 1, i);
+    wand = check_magick_wand(L, -1);
+    lua_pop(L, 1);
+    width = MagickGetImageWidth(wand);
+    height = MagickGetImageHeight(wand);
+    step = width * height / budget + 1;
+    for (y = 0; y < height && count + width <= PALETTE_SAMPLES; y += step) {
+      if (MagickExportImagePixels(wand, 0, y, width, 1, "RGBA", CharPixel, samples + 4 * count) != MagickTrue) {
+        return magick_error(L, wand);
+      }
+      count += width;
+    }
+  }
+  luaL_argcheck(L, count > 0, 1, "wands have no pixels to sample");
+  size = palette_build(samples, count, colors, rgba);
+  if (size == 0) {
+    return luaL_error(L, "out of memory building palette");
+  }
+  wand = NewMagickWand();
+  wrap_magick_wand(L, wand);
+  if (MagickConstituteImage(wand, size, 1, "RGBA", CharPixel, rgba) != MagickTrue) {
+    return magick_error(L, wand);
+  }
+  if (dither && MagickSetOption(wand, palette_dither_option, "true") != MagickTrue) {
+    return magick_error(L, wand);
+  }
+  return 1;
+}
+
 static struct luaL_Reg module_index[] = {
+  {"build_palette", build_palette},
+  {"cache_open", cache_open},
+  {"error_counts", get_error_counts},
+  {"font_metrics_stats", font_metrics_stats},
+  {"memory_stats", memory_stats},
 > for name in sorted(wands) do
   {"new_$(name:lower())_wand", new_$(name:lower())_wand},
 > end
+  {"open_checkpoint", open_checkpoint},
+  {"optimize", optimize_pipeline},
+  {"pack_atlas", pack_atlas},
+  {"process_tiled", process_tiled},
+  {"reset_error_counts", reset_error_counts},
+  {"reset_memory_stats", reset_memory_stats},
+  {"reset_stats", reset_stats},
+  {"run", pipeline_run},
+  {"set_font_metrics_cache", set_font_metrics_cache},
+  {"set_stats", set_stats},
+  {"set_structured_errors", set_structured_errors},
+  {"set_trace", set_trace},
+  {"stats", get_stats},
+  {"trace_dump", trace_dump},
+  {"trim_memory", trim_memory},
   {NULL, NULL},
 };
 
 int luaopen_luamagick(lua_State *L) {
   if (IsMagickWandInstantiated() == MagickFalse) {
+    setup_memory_methods();
     MagickWandGenesis();
   }
+  bc_setup_kernels();
+  xxh3_setup_kernels();
+  luaL_newmetatable(L, error_message_meta_name);
+  luaL_register(L, NULL, error_message_meta);
+  lua_pop(L, 1);
+  luaL_newmetatable(L, result_cache_meta_name);
+  lua_pushstring(L, "__index");
+  lua_pushvalue(L, -2);
+  lua_settable(L, -3);
+  luaL_register(L, NULL, result_cache_index);
+  lua_pop(L, 1);
+  luaL_newmetatable(L, color_meta_name);
+  lua_pushcfunction(L, color_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, owned_wand_meta_name);
+  lua_pushcfunction(L, owned_wand_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, lazy_wand_meta_name);
+  luaL_register(L, NULL, lazy_wand_index);
+  lua_pop(L, 1);
 > for name in sorted(wands) do
   luaL_newmetatable(L, $(name:lower())_wand_meta_name);
   lua_pushstring(L, "__index");
@@ -385,6 +4430,7 @@ int luaopen_luamagick(lua_State *L) {
       _escape = '>',
       enums = enums,
       funcbody = funcbody,
+      recordable = recordable,
       snake = snake,
       sorted = sorted,
       wands = wands,
@@ -405,6 +4451,322 @@ A simple mapping of the [ImageMagick](https://imagemagick.org) MagickWand C API
 luarocks install luamagick
 ```
 
+## Benchmarks
+
+```sh
+MAGICK_THREAD_LIMIT=1 lua bench/run.lua results.json
+```
+
+`bench/run.lua` measures per-call overhead, wand creation, codec and resize
+throughput, BLP coding against a pure Lua decoder, BC block coding in MB/s of
+RGBA pixels and peak RSS, and writes the results as JSON for comparing runs on
+the same machine. Set `BENCH_SCALE` to scale the iteration counts.
+
+## Array Arguments
+
+C functions that take a count followed by a `const` array of `double`, `size_t`
+or `PointInfo` take a single Lua argument in its place. It may be a table of
+numbers (points as a flat `{ x1, y1, x2, y2, ... }` list), or a string or
+userdata holding the packed native-endian elements. The count is derived from
+the array; for convolution and recolor kernels the matrix order is its square root.
+
+## Color Arguments
+
+Wherever a method takes a `PixelWand` as input, a color string such as
+`'red'` or `'#ff000080'` may be passed instead. Each distinct string is parsed
+once into a pixel wand kept by the binding, so repeated calls with the same
+color neither parse nor allocate; an unrecognized color raises an error.
+Getters that fill in a pixel wand, such as `wand:get_image_background_color`,
+still need a real one.
+
+## Errors
+
+Failing calls return `nil` and the wand's exception message. After
+`require('luamagick').set_structured_errors(true)` they instead return `nil`,
+the numeric `ExceptionType` severity and a message object, which copies the
+wand's exception text when the error is made and gives it as a Lua string when
+passed to `tostring`. Failures of luamagick's own extensions, such as a corrupt
+BLP file or a file that cannot be opened, report a fitting severity, e.g.
+`CorruptImageError` or `FileOpenError`, with the message as a plain string.
+`error_counts()` returns failures so far keyed by severity, and
+`reset_error_counts()` clears them.
+
+## Call Stats
+
+`require('luamagick').set_stats(true)` starts counting calls, failures and
+wall time for every wand method; `set_stats(false)` stops again and costs
+nothing while disabled. `stats()` returns the totals keyed by `wand:method`,
+e.g. `magick:resize_image`, and `reset_stats()` clears them.
+
+## Tracing
+
+`require('luamagick').set_trace(true[, capacity])` records the beginning and
+end of every wand method call, with the wand, its image dimensions and the
+thread, in a ring buffer of `capacity` events (65536 by default). ImageMagick
+progress phases such as `Resize/Image` are recorded as nested spans.
+`set_trace(false)` stops recording, and `trace_dump(path)` writes the buffer as
+Chrome trace event JSON for viewing in Perfetto or `chrome://tracing`.
+
+## Memory Accounting
+
+Setting `LUAMAGICK_MEMORY=count` before luamagick is loaded routes ImageMagick's
+heap allocations through counting handlers; `LUAMAGICK_MEMORY=pool` additionally
+recycles blocks of up to 64KiB through power-of-two size-class free lists.
+`memory_stats()` returns current and peak bytes, allocation and free counts,
+pooled bytes and a histogram of allocations by size class.
+`reset_memory_stats()` resets the peak to the current usage and clears the
+counts, and `trim_memory()` releases pooled blocks, e.g. between batch jobs.
+Pixel caches are allocated separately and are not included.
+
+## Texture Atlases
+
+`require('luamagick').pack_atlas(wands, opts)` packs the current image of each
+magick wand into a new atlas wand using the MaxRects algorithm, copying all
+sprites in a single pass split across ImageMagick's thread limit. It returns
+the atlas and a table of `{ x, y, w, h }` rectangles in input order. `opts`
+may set `max_size` (default 4096), `padding` between sprites (default 0) and
+`power_of_two` atlas dimensions.
+
+## Mipmaps
+
+`wand:generate_mipmaps(opts)` halves the current image repeatedly, deriving
+each level from the previous one, and inserts the levels after it as further
+frames. `opts` may set the resize `filter` by value or by name (default
+`'Box'`), stop once both sides reach `min_size` (default 1), and turn off
+resampling sRGB images in linear light with `gamma_correct = false`. Write the
+result with the `dds:mipmaps=fromlist` option to keep the levels in a DDS file.
+
+## BLP Textures
+
+Blizzard BLP textures are read and written natively. `wand:read_blp(source,
+opts)` decodes a BLP1 or BLP2 file or blob, adding each mipmap as an image
+unless `opts.mipmaps` is false. Palettized images with 0, 1, 4 or 8 bit alpha,
+DXT1/3/5 and uncompressed BGRA are supported; JPEG-compressed BLP1 is not.
+
+`wand:get_blp_blob(opts)` encodes the current image and returns the BLP as a
+string, and `wand:write_blp(path, opts)` writes it to a file. `opts` may set
+the `version` (default 2), the `encoding` (`'palette'`, `'dxt1'`, `'dxt3'`,
+`'dxt5'` or `'bgra'`; by default `'dxt5'` for images with alpha and `'dxt1'`
+otherwise, and always `'palette'` for BLP1), `alpha_bits`, `dither` for palette
+quantization, and `mipmaps = false` to write only the full size image.
+Mipmaps are taken from the following images where their sizes match, as after
+`generate_mipmaps`, and box filtered otherwise.
+
+## Block Compression
+
+`wand:get_bc_blob(opts)` encodes the current image as raw BC1, BC2 or BC3
+(DXT1/3/5) blocks, and `wand:read_bc(blocks, width, height, opts)` decodes them
+into a new image. `opts.format` is one of `'bc1'` (the default), `'bc2'`,
+`'bc3'` or their `'dxt'` names, and `opts.quality` trades encoding speed for
+accuracy: 0 takes endpoints from each block's bounding box, 1 (the default)
+from its principal axis, and 2 also refines them by least squares. BLP
+encoding accepts the same `quality` option.
+
+Rows of blocks are coded in parallel within ImageMagick's thread limit. Pixel
+fitting uses AVX2 or SSE2 where available; set `LUAMAGICK_SIMD` to `sse2` or
+`scalar` before loading luamagick to limit it, e.g. for benchmarks. All
+kernels produce identical blocks.
+
+## Pixel Hashes
+
+`wand:pixel_hash(opts)` returns a hex digest of the current image's pixels,
+independent of its file format and metadata. `opts.algo` may only be `'xxh3'`
+(the default), which hashes rows of 16-bit RGBA samples in parallel with
+XXH3-64 and then hashes their digests and the image's size. Hashing uses AVX2
+or SSE2 where available, limited by `LUAMAGICK_SIMD` as for block compression.
+
+Digests are memoized in a `luamagick:pixel-hash` image artifact, which methods
+that may change a wand's pixels delete from its images, and methods returning a
+new wand from the new wand's images, so hashing an unchanged image again is
+free whatever other wands do meanwhile. Unlike `wand:get_image_signature()`
+this never writes the image's `signature` property.
+
+## Pipelines
+
+A pipeline is a list of operations, each a wand method name followed by its
+arguments, e.g. `{ { 'thumbnail_image', 64, 64 }, { 'flop_image' } }`.
+`wand:apply(ops)` calls them in order on the wand, stopping at the first that
+returns `nil` and returning its results. `luamagick.run(src, ops, opts)` reads
+`src`, which is a path, a blob or a wand whose current image is copied, applies
+`ops` and returns the encoded result. `opts.format` sets the output format,
+which otherwise stays the input's, and `opts.quality` the compression quality.
+Strings starting with control characters are taken as blobs unless
+`opts.blob` says otherwise.
+
+`luamagick.cache_open(dir, max_bytes)` opens a result cache in `dir`, creating
+it if needed. `cache:run(src, ops, opts)` is `luamagick.run` keyed by a 64-bit
+XXH3 hash of the source, `ops`, `opts.format` and `opts.quality`, and returns
+the blob and whether it came from the cache. Hits read the stored blob without
+decoding anything. Paths and blobs are keyed by content, paths also by
+extension, wands by pixel hash and format, and wand arguments to operations
+by content. Entries are files, written atomically, and the least recently used
+are removed once the directory exceeds `max_bytes`, so several processes can
+share a cache. `cache:stats()` returns its `bytes`, `entries`, `evictions`,
+`hits`, `max_bytes` and `misses`.
+
+## Tiled Processing
+
+`luamagick.process_tiled(src, dst, ops, opts)` applies a pipeline to a large
+image a tile at a time and writes the result to the path `dst`. `src` is a
+path or a wand. Each tile of `opts.tile` pixels square (default 1024) is cut
+from the source with `opts.overlap` pixels (default 16) of its neighbours
+around it, processed by `ops`, which must not change its size, and the inner
+part stored in the output. Point operations and local ones that reach no
+further than the overlap, such as blurs of a small radius, give the same
+result as processing the whole image.
+
+While it runs, ImageMagick's area, memory and map limits are lowered to
+`opts.memory` bytes (by default 64 bytes per pixel of a tile with its
+overlap), so the decoded source and the output are cached on disk and peak
+memory depends on the tile size rather than the image's.
+
+## Pixel Caches and Checkpoints
+
+`wand:set_cache_type(type)` chooses where the pixel caches of images the wand
+creates are kept: `'memory'`, `'map'` (a memory-mapped file), `'disk'` or
+`'default'`, which leaves the choice to ImageMagick's resource limits.
+`wand:set_temporary_path(path)` chooses the directory for its map and disk
+caches; `nil` restores the default. ImageMagick 6 has no per-wand or
+per-image setting for either, so while the wand's methods run the global area,
+memory and map limits and the temporary path are adjusted, and restored
+afterwards. These settings are process-wide and not thread-safe: anything else
+running meanwhile, in another thread or Lua state, is subject to the policy
+too. Policies belong to the wand they are set on, not to wands copied from it,
+and while any wand has one, every wand method goes through a hook that looks
+it up; the hooks are removed once no wand has a policy left.
+`wand:get_cache_type()` reports the type of the current image's cache.
+
+`wand:checkpoint(path)` saves the wand's images as an MPC file, ImageMagick's
+serialized pixel cache, which writes `path` and a `.cache` file beside it.
+`luamagick.open_checkpoint(path)` returns a new wand of those images whose
+pixels are mapped from the `.cache` file rather than decoded, so reopening a
+large intermediate result costs little more than opening the file. The cache
+file is only valid for the ImageMagick build and quantum depth that wrote it.
+
+## Font Metrics
+
+`wand:query_font_metrics` and `wand:query_multiline_font_metrics` keep the
+most recently measured texts in a cache, keyed on the drawing wand's font,
+family, density, size, weight, stretch, style and spacing, the image
+resolution and the text, so repeated layout of the same labels does not
+render them again. `wand:query_font_metrics_list(draw, texts, multiline)`
+measures a list of strings in one call and returns a list of metrics, or
+`nil` and an error if one cannot be measured.
+
+`luamagick.set_font_metrics_cache(capacity)` empties the cache and sets the
+number of texts it keeps (default 4096); 0 disables it.
+`luamagick.font_metrics_stats()` returns its `capacity`, `entries`, `hits`,
+`misses` and `evictions`.
+
+## MVG Scripts
+
+`draw:append_mvg(mvg)` appends a script in ImageMagick's vector graphics
+language to a drawing wand in one call, after any primitives already drawn
+with it, and `wand:draw_mvg(mvg)` draws a script on the current image
+directly. `draw:get_mvg()` returns the script a drawing wand has built up,
+so a drawing made once can be replayed on other images or wands. Scripts are
+passed to the wand verbatim in chunks split at line breaks, so only a single
+line longer than 16 KiB is split at whitespace.
+
+## Primitive Batches
+
+`draw:rectangles(array)`, `draw:circles(array)` and `draw:lines(array)` add
+many primitives to a drawing wand in one call. The array is flat, in any of
+the forms described under [Array Arguments](#array-arguments), with four
+numbers per primitive: the corners of a rectangle, the centre and a point on
+the perimeter of a circle, or the ends of a line. `draw:polygons(list)` adds
+a polygon for each array of points in a list.
+
+## Shared Palettes
+
+`luamagick.build_palette(wands, colors, opts)` builds one palette of up to
+`colors` colors (default 256) for the current images of a list of wands,
+without appending them. Up to a million pixels sampled evenly from the
+images are clustered by median cut, then refined by k-means passes run in
+parallel. Colors are compared with alpha premultiplied, so transparent pixels
+share one entry. The palette is returned as a wand holding a one-row image of
+its colors, which `wand:remap_image` also accepts. With `opts.dither` set,
+it is applied with dithering by default.
+
+`wand:apply_palette(palette, opts)` replaces each pixel of the current image
+with the nearest palette color, found through a k-d tree over the palette
+and, without dithering, in parallel over rows. `opts.dither` overrides the
+palette's default and selects Floyd-Steinberg error diffusion.
+
+## Metadata
+
+`wand:get_image_properties(pattern)`, `wand:get_image_artifacts(pattern)` and
+`wand:get_image_profiles(pattern)` return the names matching a glob pattern as
+multiple values. `wand:get_image_profile(name)` returns a profile as a
+binary string, and `wand:set_image_profile(name, data)` sets one. `wand:get_metadata()` returns everything for the current image
+in one call, as a table with `properties`, `artifacts` and `profiles`
+subtables mapping names to values. Properties include the EXIF, IPTC, ICC and
+XMP ones ImageMagick derives from the profiles.
+
+## Image Descriptors
+
+`wand:describe_fast(fields, into)` returns the current image's basic
+attributes in one table, filling `into` if given so that a scan can reuse one
+table. Without `fields` it fills `width`, `height`, `format`, `depth`,
+`colorspace`, `matte`, `images` (the number in the wand), `index`, `scene`,
+`delay`, `iterations`, `dispose`, `compression`, `quality`, `interlace`,
+`orientation`, `units`, `x_resolution`, `y_resolution`, `page_width`,
+`page_height`, `page_x`, `page_y` and `filename`; `fields` is a list of the
+names to fill instead, which may also include `type`, left out by default
+because deciding it may scan every pixel. Enumerations are numbers, as from
+the corresponding getters.
+
+## Renditions
+
+`wand:renditions(specs, opts)` makes several encoded versions of the current
+image in one call. Each spec is a table with optional fields `w` and `h`
+(missing ones keep the aspect ratio, and the image size is used if both are),
+`fmt` (the format, by default the image's), `q` (the compression quality) and
+`path`. Sizes are derived as a pyramid, largest first, each resized from the
+previous one with `opts.filter` (default Lanczos) when that is at least as
+large in both dimensions. The results are then encoded in parallel. It
+returns a list in the order of the specs, holding the encoded blob, or `true`
+for specs with a `path`, which are written to that file.
+
+## Lazy Wands
+
+`wand:lazy()` returns a lazy wand, on which calls to wand methods that change
+the image and return a boolean are recorded as pipeline operations instead of
+being run, and return the lazy wand so they can be chained. Other wand methods,
+such as getters, raise an error on a lazy wand. `lazy:execute()` optimizes the
+recorded operations for the wand's current image, runs them with `wand:apply`
+and returns `true` and a list of the rewrites made, described as strings.
+`lazy:optimize()` returns the optimized operations and the rewrites without
+running them, and `luamagick.optimize(ops, wand)` does the same for any
+pipeline, `wand` being optional.
+
+The optimizer folds runs of `flip_image`, `flop_image`, `transpose_image`,
+`transverse_image` and `rotate_image` by multiples of 90 degrees into at most
+one operation. A resize (`resize_image`, `scale_image`, `sample_image` or
+`adaptive_resize_image`) directly followed by another to no larger a width and
+height is dropped, so the later one resamples the larger image; a resize
+followed by a larger one, as when pixelating, and `thumbnail_image`, which also
+strips profiles, are always kept. A `transform_image_colorspace` to the
+colorspace the image is already in is dropped; other conversions are all run, since one to a narrower
+colorspace such as gray is not undone by converting back. A `crop_image` right
+after a resize is moved ahead of it when the crop maps onto whole source
+pixels, so only the cropped part is resampled; pixels along the crop's edges
+can then differ slightly.
+
+## Region Reads
+
+`wand:read_region(src, x, y, w, h, opts)` reads the `w` by `h` pixel region
+at `x`, `y` of the first image in `src`, a path or a blob (see `opts.blob`
+under Pipelines), and adds it to the wand. The region is clipped to the image.
+JPEG and PNG images, whose coders decode rows in order from the top, are
+streamed: rows are decoded one at a time, those outside the region are
+discarded and decoding stops after its last row, so memory use depends on the
+region and the image width rather than the whole image. The streamed image
+keeps only the pixels and the format. Other formats, such as BMP and TGA, which
+can store rows bottom up, interlaced GIF and TIFF, which can be tiled, and CMYK
+images are decoded and then cropped. It returns `true` and the path taken,
+`'stream'` or `'crop'`.
+
 ## Wand Creation
 
 | C API | Lua API |
@@ -419,7 +4781,7 @@ luarocks install luamagick
 | C API | Lua API |
 | --- | --- |
 > for k, v in sorted(wand.funcs) do
-| `$(v.name or wand.prefix..k)(wand, ...)` | $(v.unsupported and 'unsupported' or '`wand:' .. snake(k) .. '(...)`') |
+| $(v.extension and 'luamagick extension' or '`' .. (v.name or wand.prefix .. k) .. '(wand, ...)`') | $(v.unsupported and 'unsupported' or '`wand:' .. snake(k) .. '(...)`') |
 > end
 
 > end
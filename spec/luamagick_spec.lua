@@ -32,6 +32,454 @@ describe('luamagick', function()
       wand:distort_image(1, 3)
     end))
   end)
+  it('handles numeric array arguments', function()
+    local wand = t:new_magick_wand()
+    assert.True(wand:read_image('magick:logo'))
+    assert.True(wand:convolve_image({ 0, 0, 0, 0, 1, 0, 0, 0, 0 }))
+    assert.True(wand:convolve_image(string.rep('\0', 8 * 9)))
+    local kernel = {}
+    for i = 1, 81 do
+      kernel[i] = 1 / 81
+    end
+    assert.True(wand:convolve_image(kernel))
+    assert.False(pcall(function()
+      wand:convolve_image({ 1, 2 })
+    end))
+    assert.True(wand:function_image(t.MagickFunction.PolynomialFunction, { 1, 0 }))
+    local draw = t:new_drawing_wand()
+    assert.True(draw:set_stroke_dash_array({ 5, 3 }))
+    draw:polygon({ 0, 0, 10, 0, 10, 10 })
+    draw:polyline({ 0, 0, 10, 0, 10, 10 })
+    draw:bezier({ 0, 0, 10, 0, 10, 10, 0, 10 })
+    assert.False(pcall(function()
+      draw:polygon({ 0, 0, 10 })
+    end))
+    assert.True(wand:draw_image(draw))
+  end)
+  it('reads thumbnails', function()
+    local tmp = os.tmpname()
+    local path = tmp .. '.jpg'
+    local src = t:new_magick_wand()
+    assert.True(src:read_image('magick:logo'))
+    assert.True(src:write_image(path))
+    local f = assert(io.open(path, 'rb'))
+    local blob = f:read('*a')
+    f:close()
+    os.remove(path)
+    os.remove(tmp)
+    local wand = t:new_magick_wand()
+    assert.True(wand:read_thumbnail(blob, 64, 64))
+    assert.same(64, wand:get_image_width())
+    assert.same(48, wand:get_image_height())
+    local lanczos = t:new_magick_wand()
+    assert.True(lanczos:read_thumbnail(blob, 100, 100, { filter = t.FilterTypes.LanczosFilter }))
+    assert.same(100, lanczos:get_image_width())
+    assert.True(lanczos:read_thumbnail(blob, 50, 50, { filter = 'Lanczos' }))
+    assert.same(50, lanczos:get_image_width())
+    assert.Nil(t:new_magick_wand():read_thumbnail('/nonexistent.jpg', 64, 64))
+    local frames = t:new_magick_wand()
+    assert.True(frames:set_size(200, 100))
+    assert.True(frames:read_image('xc:red'))
+    assert.True(frames:read_image('xc:blue'))
+    local gif = os.tmpname()
+    assert.True(frames:write_images(gif .. '.gif', true))
+    local multi = t:new_magick_wand()
+    assert.True(multi:set_size(10, 10))
+    assert.True(multi:read_image('xc:white'))
+    assert.True(multi:read_thumbnail(gif .. '.gif', 50, 50))
+    os.remove(gif .. '.gif')
+    os.remove(gif)
+    assert.same(3, multi:get_number_images())
+    local sizes = {}
+    for i = 0, 2 do
+      assert.True(multi:set_iterator_index(i))
+      sizes[i + 1] = { multi:get_image_width(), multi:get_image_height() }
+    end
+    assert.same({ { 10, 10 }, { 50, 25 }, { 50, 25 } }, sizes)
+  end)
+  it('generates mipmaps', function()
+    local wand = t:new_magick_wand()
+    assert.True(wand:set_size(64, 16))
+    assert.True(wand:read_image('gradient:red-blue'))
+    assert.True(wand:generate_mipmaps())
+    assert.same(7, wand:get_number_images())
+    assert.same(64, wand:get_image_width())
+    assert.True(wand:set_last_iterator())
+    assert.same({ 1, 1 }, { wand:get_image_width(), wand:get_image_height() })
+    local linear = t:new_magick_wand()
+    assert.True(linear:set_size(64, 16))
+    assert.True(linear:read_image('gradient:red-blue'))
+    assert.True(linear:generate_mipmaps({ filter = 'Triangle', min_size = 8, gamma_correct = false }))
+    assert.same(4, linear:get_number_images())
+    assert.has_error(function()
+      linear:generate_mipmaps({ filter = 'Bogus' })
+    end)
+    local first = t:new_magick_wand()
+    assert.True(first:set_size(16, 16))
+    assert.True(first:read_image('xc:red'))
+    assert.True(first:read_image('xc:blue'))
+    assert.True(first:set_first_iterator())
+    assert.True(first:generate_mipmaps())
+    local widths = {}
+    for i = 0, first:get_number_images() - 1 do
+      assert.True(first:set_iterator_index(i))
+      widths[#widths + 1] = first:get_image_width()
+    end
+    assert.same({ 16, 16, 8, 4, 2, 1 }, widths)
+  end)
+  it('round trips block compression', function()
+    local src = t:new_magick_wand()
+    assert.True(src:read_image('magick:logo'))
+    assert.True(src:thumbnail_image(65, 49))
+    for _, format in ipairs({ 'bc1', 'bc2', 'bc3' }) do
+      local size = 17 * 13 * (format == 'bc1' and 8 or 16)
+      for quality = 0, 2 do
+        local blocks = assert(src:get_bc_blob({ format = format, quality = quality }))
+        assert.same(size, #blocks)
+        local wand = t:new_magick_wand()
+        assert.True(wand:read_bc(blocks, 65, 49, { format = format }))
+        assert.same({ 65, 49 }, { wand:get_image_width(), wand:get_image_height() })
+      end
+    end
+    assert.same({ nil, 'truncated block data' }, { t:new_magick_wand():read_bc('', 4, 4) })
+    assert.Nil(t:new_magick_wand():get_bc_blob())
+  end)
+  it('round trips BLP textures', function()
+    local src = t:new_magick_wand()
+    assert.True(src:read_image('magick:logo'))
+    assert.True(src:thumbnail_image(64, 48))
+    for _, encoding in ipairs({ 'palette', 'dxt1', 'dxt3', 'dxt5', 'bgra' }) do
+      local blob = assert(src:get_blp_blob({ encoding = encoding }))
+      assert.same('BLP2', blob:sub(1, 4))
+      local wand = t:new_magick_wand()
+      assert.True(wand:read_blp(blob))
+      assert.same(7, wand:get_number_images())
+      assert.True(wand:set_first_iterator())
+      assert.same({ 64, 48 }, { wand:get_image_width(), wand:get_image_height() })
+    end
+    local tmp = os.tmpname()
+    assert.True(src:write_blp(tmp, { version = 1, mipmaps = false }))
+    local blp1 = t:new_magick_wand()
+    assert.True(blp1:read_blp(tmp))
+    os.remove(tmp)
+    assert.same(1, blp1:get_number_images())
+    assert.has_error(function()
+      src:get_blp_blob({ version = 1, encoding = 'dxt1' })
+    end)
+    assert.same({ nil, 'truncated BLP header' }, { t:new_magick_wand():read_blp('BLP2\1', { blob = true }) })
+  end)
+  it('hashes pixels', function()
+    local wand = t:new_magick_wand()
+    assert.True(wand:read_image('magick:logo'))
+    local hash = assert(wand:pixel_hash())
+    assert.Truthy(hash:match('^%x+$'))
+    assert.same(16, #hash)
+    assert.same(hash, wand:pixel_hash({ algo = 'xxh3' }))
+    assert.True(wand:set_image_format('png'))
+    local copy = t:new_magick_wand()
+    assert.True(copy:read_image_blob(wand:get_image_blob()))
+    assert.same(hash, copy:pixel_hash())
+    assert.True(wand:flop_image())
+    assert.Nil(wand:get_image_artifact('luamagick:pixel-hash'))
+    assert.same(hash, copy:get_image_artifact('luamagick:pixel-hash'))
+    assert.are_not.same(hash, wand:pixel_hash())
+    assert.True(wand:flop_image())
+    assert.same(hash, wand:pixel_hash())
+    local region = wand:get_image_region(64, 64, 0, 0)
+    assert.are_not.same(hash, region:pixel_hash())
+    assert.same(hash, wand:pixel_hash())
+    assert.Nil(t:new_magick_wand():pixel_hash())
+  end)
+  it('runs and caches pipelines', function()
+    local ops = { { 'thumbnail_image', 64, 48 }, { 'flop_image' } }
+    local src = t:new_magick_wand()
+    assert.True(src:read_image('magick:logo'))
+    local wand = t:new_magick_wand()
+    assert.True(wand:read_image_blob(assert(t.run(src, ops, { format = 'png' }))))
+    assert.same({ 'PNG', 64, 48 }, { wand:get_image_format(), wand:get_image_width(), wand:get_image_height() })
+    assert.same(640, src:get_image_width())
+    assert.has_error(function()
+      src:apply({ { 'no_such_method' } })
+    end)
+    assert.Nil(t:new_magick_wand():apply(ops))
+    local dir = os.tmpname()
+    os.remove(dir)
+    local cache = assert(t.cache_open(dir, 1e6))
+    local blob, hit = cache:run(src, ops, { format = 'png' })
+    assert.False(hit)
+    assert.same({ blob, true }, { cache:run(src, ops, { format = 'png' }) })
+    assert.same(false, select(2, cache:run(src, ops, { format = 'jpeg' })))
+    assert.True(src:flop_image())
+    assert.same(false, select(2, cache:run(src, ops, { format = 'png' })))
+    assert.Nil(cache:run(t:new_magick_wand(), ops))
+    local stats = cache:stats()
+    assert.same({ 3, 1, 4 }, { stats.entries, stats.hits, stats.misses })
+    local box = { { 'generate_mipmaps', { filter = 'Box', min_size = 64 } } }
+    assert.False(select(2, cache:run(src, box)))
+    assert.False(select(2, cache:run(src, { { 'generate_mipmaps', { filter = 'Lanczos', min_size = 64 } } })))
+    assert.True(select(2, cache:run(src, { { 'generate_mipmaps', { min_size = 64, filter = 'Box' } } })))
+    os.execute(('rm -r %q'):format(dir))
+  end)
+  it('processes tiles', function()
+    local src = t:new_magick_wand()
+    assert.True(src:read_image('magick:logo'))
+    local negated, restored = os.tmpname(), os.tmpname()
+    local ops = { { 'negate_image', false } }
+    assert.True(t.process_tiled(src, negated .. '.png', ops, { tile = 64, overlap = 4 }))
+    assert.True(t.process_tiled(negated .. '.png', restored .. '.png', ops, { tile = 50 }))
+    local wand = t:new_magick_wand()
+    assert.True(wand:read_image(restored .. '.png'))
+    assert.same({ 640, 480 }, { wand:get_image_width(), wand:get_image_height() })
+    assert.same(src:pixel_hash(), wand:pixel_hash())
+    local resize = { { 'resize_image', 8, 8, 0, 1 } }
+    assert.same({ nil, 'operations must keep the tile size' }, { t.process_tiled(src, negated .. '.png', resize) })
+    for _, path in ipairs({ negated, restored }) do
+      os.remove(path)
+      os.remove(path .. '.png')
+    end
+  end)
+  it('controls pixel caches and checkpoints', function()
+    local dir = os.tmpname()
+    os.remove(dir)
+    os.execute(('mkdir %q'):format(dir))
+    local wand = t:new_magick_wand()
+    assert.True(wand:set_cache_type('disk'))
+    assert.True(wand:set_temporary_path(dir))
+    assert.True(wand:read_image('magick:logo'))
+    assert.same('disk', wand:get_cache_type())
+    assert.Truthy(debug.getupvalue(wand.read_image, 1))
+    assert.True(wand:set_cache_type('default'))
+    assert.True(wand:set_temporary_path(nil))
+    assert.Nil((debug.getupvalue(wand.read_image, 1)))
+    local path = dir .. '/logo.mpc'
+    assert.True(wand:checkpoint(path))
+    local reopened = t.open_checkpoint(path)
+    assert.same('map', reopened:get_cache_type())
+    assert.same(wand:pixel_hash(), reopened:pixel_hash())
+    assert.Nil(t.open_checkpoint(dir .. '/missing.mpc'))
+    os.execute(('rm -r %q'):format(dir))
+  end)
+  it('draws MVG scripts', function()
+    local draw = t:new_drawing_wand()
+    draw:set_stroke_width(2)
+    assert.True(draw:append_mvg('fill red rectangle 2,2 7,7'))
+    local mvg = draw:get_mvg()
+    assert.truthy(mvg:find('stroke-width 2', 1, true))
+    assert.truthy(mvg:find('rectangle 2,2 7,7', 1, true))
+    local drawn, replayed = t:new_magick_wand(), t:new_magick_wand()
+    for _, wand in ipairs({ drawn, replayed }) do
+      assert.True(wand:set_size(10, 10))
+      assert.True(wand:read_image('xc:white'))
+    end
+    assert.True(drawn:draw_image(draw))
+    assert.True(replayed:draw_mvg(mvg))
+    assert.same(drawn:pixel_hash(), replayed:pixel_hash())
+    local lines = {}
+    for i = 1, 2000 do
+      lines[i] = ('line %d,0 %d,9'):format(i % 10, i % 10)
+    end
+    local long = t:new_drawing_wand()
+    assert.True(long:append_mvg(table.concat(lines, '\n')))
+    assert.truthy(long:get_mvg():find(lines[2000], 1, true))
+    assert.Nil(replayed:draw_mvg('bogus 1,2'))
+  end)
+  it('draws primitive batches', function()
+    local batched, single = t:new_drawing_wand(), t:new_drawing_wand()
+    batched:rectangles({ 0, 0, 2, 2, 5, 5, 7, 7 })
+    batched:circles({ 5, 5, 5, 8 })
+    batched:lines({ 0, 9, 9, 0 })
+    batched:polygons({ { 0, 0, 4, 0, 4, 4 }, { 6, 6, 9, 6, 9, 9 } })
+    single:rectangle(0, 0, 2, 2)
+    single:rectangle(5, 5, 7, 7)
+    single:circle(5, 5, 5, 8)
+    single:line(0, 9, 9, 0)
+    single:polygon({ 0, 0, 4, 0, 4, 4 })
+    single:polygon({ 6, 6, 9, 6, 9, 9 })
+    assert.same(single:get_mvg(), batched:get_mvg())
+    assert.False(pcall(function()
+      batched:lines({ 0, 0, 1 })
+    end))
+  end)
+  it('takes color strings for pixel wands', function()
+    local wand = t:new_magick_wand()
+    assert.True(wand:set_size(4, 4))
+    assert.True(wand:read_image('xc:white'))
+    assert.True(wand:border_image('red', 1, 1))
+    local pixel = t:new_pixel_wand()
+    assert.True(wand:get_image_pixel_color(0, 0, pixel))
+    assert.same({ 1, 0 }, { pixel:get_red(), pixel:get_green() })
+    assert.True(wand:set_image_background_color('#00ff00'))
+    assert.True(wand:get_image_background_color(pixel))
+    assert.same(1, pixel:get_green())
+    local draw = t:new_drawing_wand()
+    draw:set_fill_color('blue')
+    assert.False(pcall(wand.border_image, wand, 'no such color', 1, 1))
+    for i = 1, 1023 do
+      assert.True(wand:set_image_background_color(string.format('#%06x', i)))
+    end
+    assert.True(wand:opaque_paint_image('white', 'blue', 0, false))
+    assert.True(wand:get_image_pixel_color(2, 2, pixel))
+    assert.same({ 0, 1 }, { pixel:get_red(), pixel:get_blue() })
+  end)
+  it('builds and applies shared palettes', function()
+    local sprites = {}
+    for i, spec in ipairs({ 'gradient:red-blue', 'radial-gradient:white-green', 'xc:none' }) do
+      sprites[i] = t:new_magick_wand()
+      assert.True(sprites[i]:set_size(32, 32))
+      assert.True(sprites[i]:read_image(spec))
+    end
+    local palette = t.build_palette(sprites, 16, { dither = true })
+    assert.same({ 1, true }, { palette:get_image_height(), palette:get_image_width() <= 16 })
+    for _, sprite in ipairs(sprites) do
+      assert.True(sprite:apply_palette(palette, { dither = false }))
+      assert.True(sprite:get_image_colors() <= palette:get_image_width())
+    end
+    assert.True(sprites[1]:apply_palette(palette))
+    local pixel = t:new_pixel_wand()
+    assert.True(sprites[3]:get_image_pixel_color(0, 0, pixel))
+    assert.same(0, pixel:get_alpha())
+    assert.False(pcall(t.build_palette, sprites, 300))
+  end)
+  it('reads metadata in bulk', function()
+    local wand = t:new_magick_wand()
+    assert.True(wand:read_image('magick:logo'))
+    assert.True(wand:set_image_property('comment', 'hello'))
+    assert.True(wand:set_image_artifact('luamagick:test', 'yes'))
+    assert.True(wand:set_image_profile('luamagick', 'a\0b'))
+    assert.same({ 'comment' }, { wand:get_image_properties('comm*') })
+    assert.same('a\0b', wand:get_image_profile('luamagick'))
+    assert.Nil(wand:get_image_profile('missing'))
+    local metadata = wand:get_metadata()
+    assert.same('hello', metadata.properties.comment)
+    assert.same('yes', metadata.artifacts['luamagick:test'])
+    assert.same('a\0b', metadata.profiles.luamagick)
+  end)
+  it('describes images in one call', function()
+    local wand = t:new_magick_wand()
+    assert.True(wand:read_image('magick:logo'))
+    local d = wand:describe_fast()
+    assert.same({ 640, 480, wand:get_image_format(), 1 }, { d.width, d.height, d.format, d.images })
+    assert.same(wand:get_image_colorspace(), d.colorspace)
+    assert.Nil(d.type)
+    local into = { stale = true }
+    assert.same(into, wand:describe_fast({ 'type', 'depth' }, into))
+    assert.same({ wand:get_image_type(), wand:get_image_depth(), true }, { into.type, into.depth, into.stale })
+    assert.False(pcall(wand.describe_fast, wand, { 'bogus' }))
+    assert.same(640, wand:describe_fast(nil, {}).width)
+  end)
+  it('makes renditions', function()
+    local wand = t:new_magick_wand()
+    assert.True(wand:read_image('magick:logo'))
+    local path = os.tmpname()
+    local out = wand:renditions({
+      { w = 64, fmt = 'PNG' },
+      { w = 320, fmt = 'JPEG', q = 80 },
+      { h = 120, fmt = 'GIF', path = path },
+    })
+    assert.same(3, #out)
+    assert.True(out[3])
+    local check = t:new_magick_wand()
+    assert.True(check:read_image_blob(out[1]))
+    assert.same({ 'PNG', 64, 48 }, { check:get_image_format(), check:get_image_width(), check:get_image_height() })
+    assert.True(check:read_image_blob(out[2]))
+    assert.same({ 'JPEG', 320, 240 }, { check:get_image_format(), check:get_image_width(), check:get_image_height() })
+    assert.True(check:read_image(path))
+    assert.same(160, check:get_image_width())
+    os.remove(path)
+    assert.Nil(wand:renditions({ { fmt = 'NOSUCHFORMAT' } }))
+  end)
+  it('optimizes lazy wands', function()
+    local wand = t:new_magick_wand()
+    assert.True(wand:read_image('magick:logo'))
+    local filter = t.FilterTypes.LanczosFilter
+    local lazy = wand:lazy()
+    lazy:resize_image(320, 240, filter, 1):resize_image(160, 120, filter, 1):crop_image(80, 60, 40, 30)
+    lazy:rotate_image('none', 90):flop_image():flip_image()
+    local colorspace, gray = wand:get_image_colorspace(), t.ColorspaceType.GRAYColorspace
+    lazy:transform_image_colorspace(colorspace)
+    lazy:transform_image_colorspace(gray):transform_image_colorspace(colorspace)
+    assert.False(pcall(function()
+      return lazy:get_image_width()
+    end))
+    local ops, rewrites = lazy:optimize()
+    assert.same({
+      { 'crop_image', 320, 240, 160, 120 },
+      { 'resize_image', 80, 60, filter, 1 },
+      { 'rotate_image', 'none', 270 },
+      { 'transform_image_colorspace', gray },
+      { 'transform_image_colorspace', colorspace },
+    }, ops)
+    assert.same({
+      'folded 3 orientation operations into rotate_image by 270',
+      "dropped transform_image_colorspace to the image's own colorspace",
+      'fused 2 resizes into resize_image',
+      'moved crop_image ahead of resize_image',
+    }, rewrites)
+    local plain, none = t.optimize({ { 'resize_image', 160, 120, filter, 1 }, { 'crop_image', 80, 60, 40, 30 } })
+    assert.same({ 2, 0 }, { #plain, #none })
+    local pixelate = { { 'sample_image', 16, 16 }, { 'resize_image', 256, 256, filter, 1 } }
+    assert.same({ pixelate, {} }, { t.optimize(pixelate) })
+    local thumb = { { 'thumbnail_image', 64, 64 }, { 'resize_image', 32, 32, filter, 1 } }
+    assert.same({ thumb, {} }, { t.optimize(thumb) })
+    local ok, applied = lazy:execute()
+    assert.True(ok)
+    assert.same(rewrites, applied)
+    assert.same({ 60, 80 }, { wand:get_image_width(), wand:get_image_height() })
+    assert.same(colorspace, wand:get_image_colorspace())
+    local pixel = t:new_pixel_wand()
+    for y = 0, 79, 4 do
+      for x = 0, 59, 4 do
+        assert.True(wand:get_image_pixel_color(x, y, pixel))
+        assert.same(pixel:get_red(), pixel:get_green())
+        assert.same(pixel:get_red(), pixel:get_blue())
+      end
+    end
+    assert.same({ {}, {} }, { lazy:optimize() })
+  end)
+  it('reads regions', function()
+    local wand = t:new_magick_wand()
+    assert.True(wand:read_image('magick:logo'))
+    assert.True(wand:set_image_format('PNG'))
+    local blob = wand:get_image_blob()
+    local region = t:new_magick_wand()
+    local ok, path = region:read_region(blob, 100, 50, 200, 100)
+    assert.True(ok)
+    assert.True(path == 'stream' or path == 'crop')
+    assert.same({ 200, 100 }, { region:get_image_width(), region:get_image_height() })
+    assert.True(wand:crop_image(200, 100, 100, 50))
+    assert.same(wand:pixel_hash(), region:pixel_hash())
+    assert.True(region:read_region(blob, 600, 400, 100, 100))
+    assert.same({ 40, 80 }, { region:get_image_width(), region:get_image_height() })
+    assert.False(pcall(region.read_region, region, blob, 640, 0, 10, 10))
+    -- BMP stores rows bottom up, so it must not be streamed.
+    local bmp = t:new_magick_wand()
+    assert.True(bmp:read_image('magick:logo'))
+    assert.True(bmp:set_image_format('BMP'))
+    blob = bmp:get_image_blob()
+    assert.True(bmp:read_image_blob(blob))
+    assert.True(bmp:crop_image(200, 100, 100, 50))
+    region = t:new_magick_wand()
+    assert.same({ true, 'crop' }, { region:read_region(blob, 100, 50, 200, 100) })
+    assert.same(bmp:pixel_hash(), region:pixel_hash())
+  end)
+  it('packs atlases', function()
+    local sprites = {}
+    for i = 1, 20 do
+      local sprite = t:new_magick_wand()
+      assert.True(sprite:set_size(8 + i, 40 - i))
+      assert.True(sprite:read_image('xc:red'))
+      sprites[i] = sprite
+    end
+    local atlas, rects = t.pack_atlas(sprites, { padding = 1, power_of_two = true })
+    assert.same(20, #rects)
+    assert.same({ 11, 37 }, { rects[3].w, rects[3].h })
+    local width = atlas:get_image_width()
+    while width % 2 == 0 do
+      width = width / 2
+    end
+    assert.same(1, width)
+    assert.same({ nil, 'sprites do not fit within max_size' }, { t.pack_atlas(sprites, { max_size = 16 }) })
+  end)
   it('handles MagickQueryFontMetrics', function()
     local mwand = t:new_magick_wand()
     assert.True(mwand:read_image('magick:logo'))
@@ -42,6 +490,100 @@ describe('luamagick', function()
     assert.same('table', type(result))
     assert.same(13, #result)
   end)
+  it('caches font metrics', function()
+    local mwand = t:new_magick_wand()
+    assert.True(mwand:read_image('magick:logo'))
+    local dwand = t:new_drawing_wand()
+    dwand:set_font('FreeSans')
+    dwand:set_font_size(42)
+    t.set_font_metrics_cache(2)
+    local first = mwand:query_font_metrics(dwand, 'hello world')
+    assert.same(first, mwand:query_font_metrics(dwand, 'hello world'))
+    dwand:set_font_size(21)
+    assert.True(mwand:query_font_metrics(dwand, 'hello world')[5] < first[5])
+    local list = mwand:query_font_metrics_list(dwand, { 'hello world', 'a\nb' }, true)
+    assert.same(2, #list)
+    assert.same(mwand:query_multiline_font_metrics(dwand, 'a\nb'), list[2])
+    local stats = t.font_metrics_stats()
+    assert.same({ 2, 2, 4, 2 }, { stats.entries, stats.hits, stats.misses, stats.evictions })
+    t.set_font_metrics_cache(4096)
+  end)
+  it('reports structured errors', function()
+    local wand = t:new_magick_wand()
+    local ok, msg = wand:read_image('/nonexistent.png')
+    assert.Nil(ok)
+    assert.same('string', type(msg))
+    t.reset_error_counts()
+    t.set_structured_errors(true)
+    local sok, severity, smsg = wand:read_image('/nonexistent.png')
+    t.set_structured_errors(false)
+    assert.Nil(sok)
+    assert.True(severity >= t.ExceptionType.ErrorException)
+    assert.True(wand:clear_exception())
+    assert.True(wand:read_image('magick:logo'))
+    assert.truthy(tostring(smsg):find('nonexistent', 1, true))
+    assert.same({ [severity] = 1 }, t.error_counts())
+    t.reset_error_counts()
+    t.set_structured_errors(true)
+    local bc = { wand:read_bc('', 4, 4) }
+    local blp = { wand:read_blp('/nonexistent.blp') }
+    t.set_structured_errors(false)
+    local corrupt, open = t.ExceptionType.CorruptImageError, t.ExceptionType.FileOpenError
+    assert.same({ nil, corrupt, 'truncated block data' }, bc)
+    assert.same({ nil, open }, { blp[1], blp[2] })
+    assert.same({ [corrupt] = 1, [open] = 1 }, t.error_counts())
+  end)
+  it('collects call stats', function()
+    local wand = t:new_magick_wand()
+    t.reset_stats()
+    t.set_stats(true)
+    assert.True(wand:read_image('magick:logo'))
+    assert.same(640, wand:get_image_width())
+    assert.Nil(wand:read_image('/nonexistent.png'))
+    t.set_stats(false)
+    wand:get_image_width()
+    local stats = t.stats()
+    assert.same(2, stats['magick:read_image'].calls)
+    assert.same(1, stats['magick:read_image'].errors)
+    assert.same(1, stats['magick:get_image_width'].calls)
+    assert.True(stats['magick:read_image'].seconds > 0)
+  end)
+  it('dumps traces', function()
+    local path = os.tmpname()
+    local wand = t:new_magick_wand()
+    t.set_trace(true)
+    assert.True(wand:read_image('magick:logo'))
+    assert.True(wand:resize_image(320, 240, t.FilterTypes.TriangleFilter, 1))
+    assert.False(pcall(wand.resize_image, wand, 'wide'))
+    t.set_trace(false)
+    assert.True(t.trace_dump(path))
+    local f = assert(io.open(path))
+    local trace = f:read('*a')
+    f:close()
+    os.remove(path)
+    assert.truthy(trace:find('"name":"resize_image","cat":"magick","ph":"B"', 1, true))
+    assert.truthy(trace:find('"columns":320,"rows":240', 1, true))
+    assert.truthy(trace:find('"name":"Resize/Image","cat":"progress"', 1, true))
+    local _, begins = trace:gsub('"ph":"B"', '')
+    local _, ends = trace:gsub('"ph":"E"', '')
+    assert.same(begins, ends)
+  end)
+  it('reports memory accounting', function()
+    local stats, err = t.memory_stats()
+    if not os.getenv('LUAMAGICK_MEMORY') then
+      assert.Nil(stats)
+      assert.same('string', type(err))
+      return
+    end
+    t.reset_memory_stats()
+    local wand = t:new_magick_wand()
+    assert.True(wand:read_image('magick:logo'))
+    stats = t.memory_stats()
+    assert.True(stats.allocations > 0)
+    assert.True(stats.peak >= stats.current)
+    t.trim_memory()
+    assert.same(0, t.memory_stats().pooled)
+  end)
   it('adds enum tables', function()
     assert.same(47, t.ChannelType.CompositeChannels)
   end)
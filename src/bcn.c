@@ -0,0 +1,514 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bcn.h"
+#include "cpu.h"
+
+static size_t bc_block_bytes(int format) {
+  return format == BC1 ? 8 : 16;
+}
+
+size_t bc_size(int format, size_t width, size_t height) {
+  return (width + 3) / 4 * ((height + 3) / 4) * bc_block_bytes(format);
+}
+
+static void bc_unpack_565(unsigned c, unsigned char *rgb) {
+  rgb[0] = (c >> 11 & 31) << 3 | (c >> 13 & 7);
+  rgb[1] = (c >> 5 & 63) << 2 | (c >> 9 & 3);
+  rgb[2] = (c & 31) << 3 | (c >> 2 & 7);
+}
+
+static unsigned bc_pack_565(const float *rgb) {
+  int c[3], i;
+  for (i = 0; i < 3; ++i) {
+    float v = rgb[i] < 0 ? 0 : rgb[i] > 255 ? 255 : rgb[i];
+    c[i] = v * (i == 1 ? 63 : 31) / 255 + 0.5f;
+  }
+  return c[0] << 11 | c[1] << 5 | c[2];
+}
+
+/* Fills the four palette entries of a color block; BC1 blocks with c0 <= c1
+ * have three colors and transparent black. */
+static void bc_color_palette(unsigned c0, unsigned c1, int three, unsigned char palette[4][4]) {
+  int i;
+  bc_unpack_565(c0, palette[0]);
+  bc_unpack_565(c1, palette[1]);
+  for (i = 0; i < 3; ++i) {
+    if (three) {
+      palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+      palette[3][i] = 0;
+    } else {
+      palette[2][i] = (2 * palette[0][i] + palette[1][i]) / 3;
+      palette[3][i] = (palette[0][i] + 2 * palette[1][i]) / 3;
+    }
+  }
+  palette[0][3] = palette[1][3] = palette[2][3] = 255;
+  palette[3][3] = three ? 0 : 255;
+}
+
+static void bc_alpha_palette(unsigned a0, unsigned a1, unsigned char palette[8]) {
+  int i;
+  palette[0] = a0;
+  palette[1] = a1;
+  if (a0 > a1) {
+    for (i = 1; i < 7; ++i) {
+      palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+    }
+  } else {
+    for (i = 1; i < 5; ++i) {
+      palette[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+    }
+    palette[6] = 0;
+    palette[7] = 255;
+  }
+}
+
+static void bc_decode_block(int format, const unsigned char *src, unsigned char rgba[64]) {
+  const unsigned char *color = format == BC1 ? src : src + 8;
+  unsigned c0 = color[0] | color[1] << 8, c1 = color[2] | color[3] << 8;
+  unsigned long indices = color[4] | color[5] << 8 | color[6] << 16 | (unsigned long)color[7] << 24;
+  unsigned char palette[4][4];
+  int i;
+  bc_color_palette(c0, c1, format == BC1 && c0 <= c1, palette);
+  for (i = 0; i < 16; ++i) {
+    memcpy(rgba + i * 4, palette[indices >> 2 * i & 3], 4);
+  }
+  if (format == BC2) {
+    for (i = 0; i < 16; ++i) {
+      rgba[i * 4 + 3] = (src[i / 2] >> 4 * (i & 1) & 15) * 17;
+    }
+  } else if (format == BC3) {
+    unsigned char alphas[8];
+    uint64_t bits = 0;
+    for (i = 7; i >= 2; --i) {
+      bits = bits << 8 | src[i];
+    }
+    bc_alpha_palette(src[0], src[1], alphas);
+    for (i = 0; i < 16; ++i) {
+      rgba[i * 4 + 3] = alphas[bits >> 3 * i & 7];
+    }
+  }
+}
+
+static int bc_distance(const unsigned char *a, const unsigned char *b) {
+  int dr = a[0] - b[0], dg = a[1] - b[1], db = a[2] - b[2];
+  return dr * dr + dg * dg + db * db;
+}
+
+/* Index fitting picks the nearest of the first colors palette entries for
+ * each pixel of a block, returning the total squared error. It dominates
+ * encoding, so there are SSE2 and AVX2 versions; all pick the lowest index on
+ * ties and so produce identical blocks. */
+typedef int (*bc_fit_kernel)(const unsigned char *rgba, unsigned char palette[4][4], int colors,
+                             unsigned char *indices);
+
+static int bc_fit_scalar(const unsigned char *rgba, unsigned char palette[4][4], int colors, unsigned char *indices) {
+  int i, k, total = 0;
+  for (i = 0; i < 16; ++i) {
+    int best = 0, d = bc_distance(rgba + i * 4, palette[0]);
+    for (k = 1; k < colors; ++k) {
+      int e = bc_distance(rgba + i * 4, palette[k]);
+      if (e < d) {
+        d = e;
+        best = k;
+      }
+    }
+    indices[i] = best;
+    total += d;
+  }
+  return total;
+}
+
+#ifdef SIMD_X86
+/* Channel differences are within 16 bits, so a 16-bit multiply of each 32-bit
+ * lane leaves the exact square in the low half. */
+__attribute__((target("sse2"))) static int bc_fit_sse2(const unsigned char *rgba, unsigned char palette[4][4],
+                                                       int colors, unsigned char *indices) {
+  const __m128i byte = _mm_set1_epi32(0xff), low = _mm_set1_epi32(0xffff);
+  __m128i r[4], g[4], b[4], best[4], index[4];
+  int32_t d[4], n[4];
+  int i, j, k, total = 0;
+  for (i = 0; i < 4; ++i) {
+    __m128i p = _mm_loadu_si128((const __m128i *)(rgba + i * 16));
+    r[i] = _mm_and_si128(p, byte);
+    g[i] = _mm_and_si128(_mm_srli_epi32(p, 8), byte);
+    b[i] = _mm_and_si128(_mm_srli_epi32(p, 16), byte);
+    best[i] = _mm_set1_epi32(0x7fffffff);
+    index[i] = _mm_setzero_si128();
+  }
+  for (k = 0; k < colors; ++k) {
+    __m128i pr = _mm_set1_epi32(palette[k][0]), pg = _mm_set1_epi32(palette[k][1]);
+    __m128i pb = _mm_set1_epi32(palette[k][2]), kk = _mm_set1_epi32(k);
+    for (i = 0; i < 4; ++i) {
+      __m128i dr = _mm_sub_epi32(r[i], pr), dg = _mm_sub_epi32(g[i], pg), db = _mm_sub_epi32(b[i], pb);
+      __m128i e = _mm_add_epi32(_mm_and_si128(_mm_mullo_epi16(dr, dr), low),
+                                _mm_add_epi32(_mm_and_si128(_mm_mullo_epi16(dg, dg), low),
+                                              _mm_and_si128(_mm_mullo_epi16(db, db), low)));
+      __m128i less = _mm_cmplt_epi32(e, best[i]);
+      best[i] = _mm_or_si128(_mm_and_si128(less, e), _mm_andnot_si128(less, best[i]));
+      index[i] = _mm_or_si128(_mm_and_si128(less, kk), _mm_andnot_si128(less, index[i]));
+    }
+  }
+  for (i = 0; i < 4; ++i) {
+    _mm_storeu_si128((__m128i *)d, best[i]);
+    _mm_storeu_si128((__m128i *)n, index[i]);
+    for (j = 0; j < 4; ++j) {
+      indices[i * 4 + j] = n[j];
+      total += d[j];
+    }
+  }
+  return total;
+}
+
+__attribute__((target("avx2"))) static int bc_fit_avx2(const unsigned char *rgba, unsigned char palette[4][4],
+                                                       int colors, unsigned char *indices) {
+  const __m256i byte = _mm256_set1_epi32(0xff), low = _mm256_set1_epi32(0xffff);
+  __m256i r[2], g[2], b[2], best[2], index[2];
+  int32_t d[8], n[8];
+  int i, j, k, total = 0;
+  for (i = 0; i < 2; ++i) {
+    __m256i p = _mm256_loadu_si256((const __m256i *)(rgba + i * 32));
+    r[i] = _mm256_and_si256(p, byte);
+    g[i] = _mm256_and_si256(_mm256_srli_epi32(p, 8), byte);
+    b[i] = _mm256_and_si256(_mm256_srli_epi32(p, 16), byte);
+    best[i] = _mm256_set1_epi32(0x7fffffff);
+    index[i] = _mm256_setzero_si256();
+  }
+  for (k = 0; k < colors; ++k) {
+    __m256i pr = _mm256_set1_epi32(palette[k][0]), pg = _mm256_set1_epi32(palette[k][1]);
+    __m256i pb = _mm256_set1_epi32(palette[k][2]), kk = _mm256_set1_epi32(k);
+    for (i = 0; i < 2; ++i) {
+      __m256i dr = _mm256_sub_epi32(r[i], pr), dg = _mm256_sub_epi32(g[i], pg), db = _mm256_sub_epi32(b[i], pb);
+      __m256i e = _mm256_add_epi32(_mm256_and_si256(_mm256_mullo_epi16(dr, dr), low),
+                                   _mm256_add_epi32(_mm256_and_si256(_mm256_mullo_epi16(dg, dg), low),
+                                                    _mm256_and_si256(_mm256_mullo_epi16(db, db), low)));
+      __m256i less = _mm256_cmpgt_epi32(best[i], e);
+      best[i] = _mm256_min_epi32(e, best[i]);
+      index[i] = _mm256_blendv_epi8(index[i], kk, less);
+    }
+  }
+  for (i = 0; i < 2; ++i) {
+    _mm256_storeu_si256((__m256i *)d, best[i]);
+    _mm256_storeu_si256((__m256i *)n, index[i]);
+    for (j = 0; j < 8; ++j) {
+      indices[i * 8 + j] = n[j];
+      total += d[j];
+    }
+  }
+  return total;
+}
+#endif
+
+static bc_fit_kernel bc_fit = bc_fit_scalar;
+
+void bc_setup_kernels(void) {
+#ifdef SIMD_X86
+  int level = simd_level();
+  bc_fit = level == SIMD_AVX2 ? bc_fit_avx2 : level == SIMD_SSE2 ? bc_fit_sse2 : bc_fit;
+#endif
+}
+
+/* Writes a color block for the endpoints, ordered for the block's mode, and
+ * returns its error. BC1 blocks with transparent pixels use the three-color
+ * mode, whose fourth index is transparent. */
+static int bc_write_color(int format, const unsigned char rgba[64], const float *a, const float *b, int transparent,
+                          unsigned char *dst) {
+  unsigned c0 = bc_pack_565(a), c1 = bc_pack_565(b);
+  unsigned char palette[4][4], indices[16];
+  unsigned long bits = 0;
+  int i, error;
+  if (transparent ? c0 > c1 : c0 < c1) {
+    unsigned t = c0;
+    c0 = c1;
+    c1 = t;
+  }
+  bc_color_palette(c0, c1, format == BC1 && (transparent || c0 == c1), palette);
+  error = bc_fit(rgba, palette, transparent || c0 == c1 ? 3 : 4, indices);
+  for (i = 15; i >= 0; --i) {
+    bits = bits << 2 | (transparent && rgba[i * 4 + 3] < 128 ? 3 : indices[i]);
+  }
+  dst[0] = c0;
+  dst[1] = c0 >> 8;
+  dst[2] = c1;
+  dst[3] = c1 >> 8;
+  for (i = 0; i < 4; ++i) {
+    dst[4 + i] = bits >> 8 * i;
+  }
+  return error;
+}
+
+/* Solves for the endpoints that best reproduce the pixels with the block's
+ * current indices, by least squares. Returns 0 if the indices are degenerate. */
+static int bc_refine(const unsigned char rgba[64], const unsigned char *block, int three, float *a, float *b) {
+  static const float four[4] = {1, 0, 2.0f / 3, 1.0f / 3}, half[4] = {1, 0, 0.5f, 0};
+  const float *weights = three ? half : four;
+  unsigned long bits = block[4] | block[5] << 8 | block[6] << 16 | (unsigned long)block[7] << 24;
+  float aa = 0, ab = 0, bb = 0, ax[3] = {0, 0, 0}, bx[3] = {0, 0, 0}, det;
+  int i, c;
+  for (i = 0; i < 16; ++i) {
+    int k = bits >> 2 * i & 3;
+    float w = weights[k], v = 1 - w;
+    if (three && k == 3) {
+      continue;
+    }
+    aa += w * w;
+    ab += w * v;
+    bb += v * v;
+    for (c = 0; c < 3; ++c) {
+      ax[c] += w * rgba[i * 4 + c];
+      bx[c] += v * rgba[i * 4 + c];
+    }
+  }
+  det = aa * bb - ab * ab;
+  if (det < 1e-6f) {
+    return 0;
+  }
+  for (c = 0; c < 3; ++c) {
+    a[c] = (ax[c] * bb - bx[c] * ab) / det;
+    b[c] = (bx[c] * aa - ax[c] * ab) / det;
+  }
+  return 1;
+}
+
+/* Fast quality takes endpoints from the colors' bounding box, flipped along
+ * axes that correlate negatively with green; higher qualities use the
+ * principal axis, and high quality then refines the endpoints by least
+ * squares while that lowers the error. */
+static void bc_encode_color(int format, int quality, const unsigned char rgba[64], unsigned char *dst) {
+  unsigned char block[64], candidate[8];
+  float mean[3] = {0, 0, 0}, lo[3], hi[3], cov[6] = {0, 0, 0, 0, 0, 0}, axis[3], tmin = 1e9f, tmax = -1e9f, inset, norm;
+  int transparent = 0, opaque = 0, i, c, error;
+  memcpy(block, rgba, 64);
+  for (i = 0; i < 16; ++i) {
+    if (format == BC1 && rgba[i * 4 + 3] < 128) {
+      transparent = 1;
+      continue;
+    }
+    for (c = 0; c < 3; ++c) {
+      mean[c] += rgba[i * 4 + c];
+    }
+    ++opaque;
+  }
+  if (opaque == 0) {
+    memset(dst, 0, 4);
+    memset(dst + 4, 0xff, 4);
+    return;
+  }
+  for (c = 0; c < 3; ++c) {
+    mean[c] /= opaque;
+    lo[c] = 255;
+    hi[c] = 0;
+  }
+  /* Transparent pixels take the mean color so that they do not sway the fit. */
+  for (i = 0; i < 16; ++i) {
+    float d[3];
+    if (format == BC1 && rgba[i * 4 + 3] < 128) {
+      for (c = 0; c < 3; ++c) {
+        block[i * 4 + c] = mean[c] + 0.5f;
+      }
+      continue;
+    }
+    for (c = 0; c < 3; ++c) {
+      d[c] = rgba[i * 4 + c] - mean[c];
+      lo[c] = rgba[i * 4 + c] < lo[c] ? rgba[i * 4 + c] : lo[c];
+      hi[c] = rgba[i * 4 + c] > hi[c] ? rgba[i * 4 + c] : hi[c];
+    }
+    cov[0] += d[0] * d[0];
+    cov[1] += d[0] * d[1];
+    cov[2] += d[0] * d[2];
+    cov[3] += d[1] * d[1];
+    cov[4] += d[1] * d[2];
+    cov[5] += d[2] * d[2];
+  }
+  if (quality == BC_QUALITY_FAST) {
+    for (c = 0; c < 3; ++c) {
+      inset = (hi[c] - lo[c]) / 16;
+      lo[c] += inset;
+      hi[c] -= inset;
+      if (cov[c == 0 ? 1 : c == 1 ? 3 : 4] < 0) {
+        float t = lo[c];
+        lo[c] = hi[c];
+        hi[c] = t;
+      }
+    }
+  } else {
+    /* Power iteration from the bounding box diagonal. */
+    for (c = 0; c < 3; ++c) {
+      axis[c] = hi[c] - lo[c] + 1e-3f;
+    }
+    for (i = 0; i < 8; ++i) {
+      float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+      float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+      float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+      float m = fabsf(x) > fabsf(y) ? fabsf(x) : fabsf(y);
+      m = fabsf(z) > m ? fabsf(z) : m;
+      if (m < 1e-6f) {
+        break;
+      }
+      axis[0] = x / m;
+      axis[1] = y / m;
+      axis[2] = z / m;
+    }
+    for (i = 0; i < 16; ++i) {
+      float t = 0;
+      if (format == BC1 && rgba[i * 4 + 3] < 128) {
+        continue;
+      }
+      for (c = 0; c < 3; ++c) {
+        t += (rgba[i * 4 + c] - mean[c]) * axis[c];
+      }
+      tmin = t < tmin ? t : tmin;
+      tmax = t > tmax ? t : tmax;
+    }
+    inset = (tmax - tmin) / 16;
+    norm = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+    tmin = (tmin + inset) / norm;
+    tmax = (tmax - inset) / norm;
+    for (c = 0; c < 3; ++c) {
+      hi[c] = mean[c] + tmax * axis[c];
+      lo[c] = mean[c] + tmin * axis[c];
+    }
+  }
+  error = bc_write_color(format, block, hi, lo, transparent, dst);
+  for (i = 0; quality == BC_QUALITY_HIGH && error > 0 && i < 4; ++i) {
+    int e;
+    if (!bc_refine(block, dst, format == BC1 && (dst[0] | dst[1] << 8) <= (dst[2] | dst[3] << 8), hi, lo)) {
+      break;
+    }
+    e = bc_write_color(format, block, hi, lo, transparent, candidate);
+    if (e >= error) {
+      break;
+    }
+    error = e;
+    memcpy(dst, candidate, 8);
+  }
+}
+
+static int bc_write_alpha(const unsigned char rgba[64], unsigned a0, unsigned a1, unsigned char *dst) {
+  unsigned char palette[8];
+  uint64_t bits = 0;
+  int i, k, error = 0;
+  bc_alpha_palette(a0, a1, palette);
+  for (i = 15; i >= 0; --i) {
+    int a = rgba[i * 4 + 3], best = 0, d = 256;
+    for (k = 0; k < 8; ++k) {
+      int e = a > palette[k] ? a - palette[k] : palette[k] - a;
+      if (e < d) {
+        d = e;
+        best = k;
+      }
+    }
+    bits = bits << 3 | best;
+    error += d * d;
+  }
+  dst[0] = a0;
+  dst[1] = a1;
+  for (i = 0; i < 6; ++i) {
+    dst[2 + i] = bits >> 8 * i;
+  }
+  return error;
+}
+
+/* Beyond fast quality, blocks with fully transparent or opaque pixels also
+ * try the six-value mode, which represents those exactly. */
+static void bc_encode_alpha(int quality, const unsigned char rgba[64], unsigned char *dst) {
+  unsigned char lo = 255, hi = 0, inner_lo = 255, inner_hi = 0, candidate[8];
+  int i, error;
+  for (i = 0; i < 16; ++i) {
+    unsigned char a = rgba[i * 4 + 3];
+    lo = a < lo ? a : lo;
+    hi = a > hi ? a : hi;
+    if (a != 0 && a != 255) {
+      inner_lo = a < inner_lo ? a : inner_lo;
+      inner_hi = a > inner_hi ? a : inner_hi;
+    }
+  }
+  error = bc_write_alpha(rgba, hi, lo, dst);
+  if (quality != BC_QUALITY_FAST && error > 0 && (lo == 0 || hi == 255) && inner_lo <= inner_hi &&
+      bc_write_alpha(rgba, inner_lo, inner_hi, candidate) < error) {
+    memcpy(dst, candidate, 8);
+  }
+}
+
+static void bc_encode_block(int format, int quality, const unsigned char rgba[64], unsigned char *dst) {
+  int i;
+  if (format == BC2) {
+    for (i = 0; i < 8; ++i) {
+      dst[i] = (rgba[i * 8 + 3] * 15 + 127) / 255 | (rgba[i * 8 + 7] * 15 + 127) / 255 << 4;
+    }
+  } else if (format == BC3) {
+    bc_encode_alpha(quality, rgba, dst);
+  }
+  bc_encode_color(format, quality, rgba, format == BC1 ? dst : dst + 8);
+}
+
+struct bc_job {
+  int format;
+  int quality;
+  unsigned char *rgba;
+  unsigned char *blocks;
+  size_t width;
+  size_t height;
+};
+
+/* Edge blocks are padded by repeating the last row and column. */
+static void bc_encode_rows(void *ctx, size_t begin, size_t end) {
+  const struct bc_job *job = ctx;
+  size_t blocks = (job->width + 3) / 4, bx, by, x, y;
+  unsigned char block[64];
+  for (by = begin; by < end; ++by) {
+    unsigned char *dst = job->blocks + by * blocks * bc_block_bytes(job->format);
+    for (bx = 0; bx < blocks; ++bx) {
+      for (y = 0; y < 4; ++y) {
+        size_t sy = by * 4 + y < job->height ? by * 4 + y : job->height - 1;
+        for (x = 0; x < 4; ++x) {
+          size_t sx = bx * 4 + x < job->width ? bx * 4 + x : job->width - 1;
+          memcpy(block + (y * 4 + x) * 4, job->rgba + (sy * job->width + sx) * 4, 4);
+        }
+      }
+      bc_encode_block(job->format, job->quality, block, dst);
+      dst += bc_block_bytes(job->format);
+    }
+  }
+}
+
+static void bc_decode_rows(void *ctx, size_t begin, size_t end) {
+  const struct bc_job *job = ctx;
+  size_t blocks = (job->width + 3) / 4, bx, by, y;
+  unsigned char block[64];
+  for (by = begin; by < end; ++by) {
+    const unsigned char *src = job->blocks + by * blocks * bc_block_bytes(job->format);
+    for (bx = 0; bx < blocks; ++bx) {
+      size_t w = job->width - bx * 4 < 4 ? job->width - bx * 4 : 4;
+      bc_decode_block(job->format, src, block);
+      src += bc_block_bytes(job->format);
+      for (y = 0; y < 4 && by * 4 + y < job->height; ++y) {
+        memcpy(job->rgba + ((by * 4 + y) * job->width + bx * 4) * 4, block + y * 16, w * 4);
+      }
+    }
+  }
+}
+
+/* Both directions split the image into rows of blocks across threads. */
+void bc_encode(int format, int quality, const unsigned char *rgba, size_t width, size_t height, unsigned char *blocks) {
+  struct bc_job job;
+  job.format = format;
+  job.quality = quality;
+  job.rgba = (unsigned char *)rgba;
+  job.blocks = blocks;
+  job.width = width;
+  job.height = height;
+  parallel_rows((height + 3) / 4, bc_encode_rows, &job);
+}
+
+void bc_decode(int format, const unsigned char *blocks, size_t width, size_t height, unsigned char *rgba) {
+  struct bc_job job;
+  job.format = format;
+  job.quality = BC_QUALITY_FAST;
+  job.rgba = rgba;
+  job.blocks = (unsigned char *)blocks;
+  job.width = width;
+  job.height = height;
+  parallel_rows((height + 3) / 4, bc_decode_rows, &job);
+}
@@ -0,0 +1,18 @@
+#ifndef LUAMAGICK_BCN_H
+#define LUAMAGICK_BCN_H
+
+#include <stddef.h>
+
+/* BC1-3 (DXT1/3/5) blocks hold 4x4 pixels; images are RGBA bytes. */
+enum bc_format { BC1, BC2, BC3 };
+
+#define BC_QUALITY_FAST 0
+#define BC_QUALITY_NORMAL 1
+#define BC_QUALITY_HIGH 2
+
+size_t bc_size(int format, size_t width, size_t height);
+void bc_encode(int format, int quality, const unsigned char *rgba, size_t width, size_t height, unsigned char *blocks);
+void bc_decode(int format, const unsigned char *blocks, size_t width, size_t height, unsigned char *rgba);
+void bc_setup_kernels(void);
+
+#endif
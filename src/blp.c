@@ -0,0 +1,406 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wand/MagickWand.h>
+
+#include "bcn.h"
+#include "blp.h"
+
+static uint32_t blp_u32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void blp_put_u32(unsigned char *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static size_t blp_level_size(const struct blp_header *h, size_t level, size_t *width, size_t *height) {
+  size_t w = h->width >> level ? h->width >> level : 1, hh = h->height >> level ? h->height >> level : 1;
+  *width = w;
+  *height = hh;
+  switch (h->encoding) {
+  case BLP_PALETTE:
+    return w * hh + (w * hh * h->alpha_bits + 7) / 8;
+  case BLP_DXT:
+    return bc_size(h->format, w, hh);
+  default:
+    return w * hh * 4;
+  }
+}
+
+/* Parses BLP1 and BLP2 headers, returning an error message on failure. */
+static const char *blp_parse(const unsigned char *data, size_t length, struct blp_header *h) {
+  const unsigned char *mips;
+  size_t i, w, hh;
+  int has_mips;
+  if (length < 4 || (memcmp(data, "BLP1", 4) != 0 && memcmp(data, "BLP2", 4) != 0)) {
+    return "not a BLP image";
+  }
+  h->version = data[3] - '0';
+  if (h->version == 1) {
+    if (length < 156) {
+      return "truncated BLP header";
+    }
+    h->encoding = blp_u32(data + 4) == 1 ? BLP_PALETTE : BLP_JPEG;
+    h->alpha_bits = blp_u32(data + 8);
+    h->alpha_type = 0;
+    h->width = blp_u32(data + 12);
+    h->height = blp_u32(data + 16);
+    has_mips = blp_u32(data + 24) != 0;
+    mips = data + 28;
+  } else {
+    if (length < 148) {
+      return "truncated BLP header";
+    }
+    h->encoding = data[8] == 4 ? BLP_BGRA : data[8];
+    h->alpha_bits = data[9];
+    h->alpha_type = data[10];
+    has_mips = data[11] != 0;
+    h->width = blp_u32(data + 12);
+    h->height = blp_u32(data + 16);
+    mips = data + 20;
+  }
+  h->palette = NULL;
+  if (h->encoding == BLP_PALETTE) {
+    size_t at = h->version == 1 ? 156 : 148;
+    if (length < at + 1024) {
+      return "truncated BLP palette";
+    }
+    h->palette = data + at;
+  } else if (h->encoding == BLP_JPEG) {
+    return "JPEG-compressed BLP images are not supported";
+  } else if (h->encoding != BLP_DXT && h->encoding != BLP_BGRA) {
+    return "unknown BLP encoding";
+  }
+  if (h->alpha_bits != 0 && h->alpha_bits != 1 && h->alpha_bits != 4 && h->alpha_bits != 8) {
+    return "unsupported BLP alpha depth";
+  }
+  if (h->width == 0 || h->height == 0 || h->width > 65535 || h->height > 65535) {
+    return "invalid BLP dimensions";
+  }
+  h->format = h->alpha_type == 7 ? BC3 : h->alpha_type == 1 || h->alpha_bits > 1 ? BC2 : BC1;
+  h->levels = 0;
+  for (i = 0; i < BLP_MAX_LEVELS; ++i) {
+    h->offsets[i] = blp_u32(mips + i * 4);
+    h->sizes[i] = blp_u32(mips + 64 + i * 4);
+    if (h->levels == i && h->offsets[i] != 0 && (i == 0 || has_mips) && (h->width | h->height) >> i) {
+      if (h->offsets[i] > length || length - h->offsets[i] < blp_level_size(h, i, &w, &hh)) {
+        return "truncated BLP mipmap";
+      }
+      h->levels = i + 1;
+    }
+  }
+  if (h->levels == 0) {
+    return "BLP image has no mipmaps";
+  }
+  return NULL;
+}
+
+static void blp_decode_level(const struct blp_header *h, const unsigned char *data, size_t level, unsigned char *rgba) {
+  size_t w, hh, i, n;
+  const unsigned char *src = data + h->offsets[level];
+  blp_level_size(h, level, &w, &hh);
+  n = w * hh;
+  if (h->encoding == BLP_DXT) {
+    bc_decode(h->format, src, w, hh, rgba);
+    for (i = 0; h->alpha_bits == 0 && i < n; ++i) {
+      rgba[i * 4 + 3] = 255;
+    }
+  } else if (h->encoding == BLP_BGRA) {
+    for (i = 0; i < n; ++i) {
+      rgba[i * 4] = src[i * 4 + 2];
+      rgba[i * 4 + 1] = src[i * 4 + 1];
+      rgba[i * 4 + 2] = src[i * 4];
+      rgba[i * 4 + 3] = h->alpha_bits ? src[i * 4 + 3] : 255;
+    }
+  } else {
+    const unsigned char *alpha = src + n;
+    for (i = 0; i < n; ++i) {
+      const unsigned char *c = h->palette + src[i] * 4;
+      rgba[i * 4] = c[2];
+      rgba[i * 4 + 1] = c[1];
+      rgba[i * 4 + 2] = c[0];
+      switch (h->alpha_bits) {
+      case 1:
+        rgba[i * 4 + 3] = alpha[i / 8] >> (i & 7) & 1 ? 255 : 0;
+        break;
+      case 4:
+        rgba[i * 4 + 3] = (alpha[i / 2] >> 4 * (i & 1) & 15) * 17;
+        break;
+      case 8:
+        rgba[i * 4 + 3] = alpha[i];
+        break;
+      default:
+        rgba[i * 4 + 3] = 255;
+      }
+    }
+  }
+}
+
+/* Palette lookups go through an open-addressed table of 24-bit colors, falling
+ * back to the nearest entry for colors the quantizer did not produce. */
+struct blp_palette {
+  unsigned char colors[256][3];
+  size_t count;
+  size_t used;
+  uint32_t keys[1024];
+  unsigned char values[1024];
+};
+
+static int blp_distance(const unsigned char *a, const unsigned char *b) {
+  int dr = a[0] - b[0], dg = a[1] - b[1], db = a[2] - b[2];
+  return dr * dr + dg * dg + db * db;
+}
+
+static int blp_palette_index(struct blp_palette *p, const unsigned char *rgb, int add) {
+  uint32_t key = (rgb[0] << 16 | rgb[1] << 8 | rgb[2]) + 1, slot = key * 2654435761u >> 22;
+  size_t i;
+  int best = 0, d = 1 << 30;
+  while (p->keys[slot] != 0) {
+    if (p->keys[slot] == key) {
+      return p->values[slot];
+    }
+    slot = (slot + 1) & 1023;
+  }
+  if (add && p->count < 256) {
+    memcpy(p->colors[p->count], rgb, 3);
+    best = p->count++;
+  } else {
+    for (i = 0; i < p->count; ++i) {
+      int e = blp_distance(rgb, p->colors[i]);
+      if (e < d) {
+        d = e;
+        best = i;
+      }
+    }
+  }
+  if (p->used < 768) {
+    p->keys[slot] = key;
+    p->values[slot] = best;
+    ++p->used;
+  }
+  return best;
+}
+
+/* Encodes a level from RGBA, and from palette RGB for palettized images. */
+static void blp_encode_level(const struct blp_header *h, int quality, struct blp_palette *palette,
+                             const unsigned char *rgba, const unsigned char *rgb, size_t level, unsigned char *dst) {
+  size_t w, hh, i, n;
+  blp_level_size(h, level, &w, &hh);
+  n = w * hh;
+  if (h->encoding == BLP_DXT) {
+    bc_encode(h->format, quality, rgba, w, hh, dst);
+  } else if (h->encoding == BLP_BGRA) {
+    for (i = 0; i < n; ++i) {
+      dst[i * 4] = rgba[i * 4 + 2];
+      dst[i * 4 + 1] = rgba[i * 4 + 1];
+      dst[i * 4 + 2] = rgba[i * 4];
+      dst[i * 4 + 3] = h->alpha_bits ? rgba[i * 4 + 3] : 255;
+    }
+  } else {
+    unsigned char *alpha = dst + n;
+    memset(alpha, 0, (n * h->alpha_bits + 7) / 8);
+    for (i = 0; i < n; ++i) {
+      unsigned a = rgba[i * 4 + 3];
+      dst[i] = blp_palette_index(palette, rgb + i * 3, level == 0);
+      switch (h->alpha_bits) {
+      case 1:
+        alpha[i / 8] |= (a >= 128) << (i & 7);
+        break;
+      case 4:
+        alpha[i / 2] |= (a * 15 + 127) / 255 << 4 * (i & 1);
+        break;
+      case 8:
+        alpha[i] = a;
+        break;
+      }
+    }
+  }
+}
+
+/* Lays out the mipmaps after the header and palette, returning the total size
+ * of the image. */
+static size_t blp_layout(struct blp_header *h) {
+  size_t i, w, hh, at = (h->version == 1 ? 156 : 148) + 1024;
+  for (i = 0; i < h->levels; ++i) {
+    h->offsets[i] = at;
+    h->sizes[i] = blp_level_size(h, i, &w, &hh);
+    at += h->sizes[i];
+  }
+  return at;
+}
+
+static void blp_write_header(const struct blp_header *h, const struct blp_palette *palette, unsigned char *dst) {
+  size_t i, at = h->version == 1 ? 156 : 148;
+  unsigned char *mips;
+  memset(dst, 0, at + 1024);
+  if (h->version == 1) {
+    memcpy(dst, "BLP1", 4);
+    blp_put_u32(dst + 4, 1);
+    blp_put_u32(dst + 8, h->alpha_bits);
+    blp_put_u32(dst + 12, h->width);
+    blp_put_u32(dst + 16, h->height);
+    blp_put_u32(dst + 20, h->alpha_bits ? 4 : 5);
+    blp_put_u32(dst + 24, h->levels > 1);
+    mips = dst + 28;
+  } else {
+    memcpy(dst, "BLP2", 4);
+    blp_put_u32(dst + 4, 1);
+    dst[8] = h->encoding;
+    dst[9] = h->alpha_bits;
+    dst[10] = h->alpha_type;
+    dst[11] = h->levels > 1;
+    blp_put_u32(dst + 12, h->width);
+    blp_put_u32(dst + 16, h->height);
+    mips = dst + 20;
+  }
+  for (i = 0; i < h->levels; ++i) {
+    blp_put_u32(mips + i * 4, h->offsets[i]);
+    blp_put_u32(mips + 64 + i * 4, h->sizes[i]);
+  }
+  for (i = 0; i < palette->count; ++i) {
+    dst[at + i * 4] = palette->colors[i][2];
+    dst[at + i * 4 + 1] = palette->colors[i][1];
+    dst[at + i * 4 + 2] = palette->colors[i][0];
+  }
+}
+
+const char blp_magick_failed[] = "";
+
+/* Decodes a BLP image into the wand, adding its mipmaps as further images if
+ * requested. Returns blp_magick_failed if the wand holds the error. */
+const char *blp_read(MagickWand *wand, const unsigned char *data, size_t length, int mipmaps) {
+  struct blp_header h;
+  const char *err = blp_parse(data, length, &h);
+  unsigned char *rgba;
+  size_t i, w, hh;
+  if (err != NULL) {
+    return err;
+  }
+  rgba = malloc(h.width * h.height * 4);
+  if (rgba == NULL) {
+    return "out of memory decoding BLP image";
+  }
+  for (i = 0; i < (mipmaps ? h.levels : 1); ++i) {
+    blp_level_size(&h, i, &w, &hh);
+    blp_decode_level(&h, data, i, rgba);
+    if (MagickConstituteImage(wand, w, hh, "RGBA", CharPixel, rgba) != MagickTrue ||
+        (h.alpha_bits == 0 && MagickSetImageAlphaChannel(wand, DeactivateAlphaChannel) != MagickTrue)) {
+      free(rgba);
+      return blp_magick_failed;
+    }
+  }
+  free(rgba);
+  return NULL;
+}
+
+/* Quantizes the alpha-less copy of a level in place, against the first level's
+ * palette once there is one. */
+static MagickBooleanType blp_quantize(MagickWand **palette, size_t w, size_t h, int dither, unsigned char *rgb,
+                                      MagickWand **failed) {
+  MagickWand *level = NewMagickWand();
+  MagickBooleanType ok = MagickConstituteImage(level, w, h, "RGB", CharPixel, rgb);
+  if (ok == MagickTrue && *palette == NULL) {
+    ok = MagickQuantizeImage(level, 256, UndefinedColorspace, 0, dither ? MagickTrue : MagickFalse, MagickFalse);
+    *palette = level;
+  } else if (ok == MagickTrue) {
+    ok = MagickRemapImage(level, *palette, dither ? FloydSteinbergDitherMethod : NoDitherMethod);
+  }
+  if (ok == MagickTrue) {
+    ok = MagickExportImagePixels(level, 0, 0, w, h, "RGB", CharPixel, rgb);
+  }
+  if (ok != MagickTrue) {
+    *failed = level;
+  } else if (level != *palette) {
+    DestroyMagickWand(level);
+  }
+  return ok;
+}
+
+/* Encodes the current image and its mipmaps. Mipmaps come from the following
+ * images where their sizes match, as left by generate_mipmaps, and are
+ * otherwise box filtered from the level above. On failure *failed is the wand
+ * holding the error if blp_magick_failed is returned. */
+const char *blp_write(MagickWand *wand, struct blp_header *h, const struct blp_options *o, unsigned char **blob,
+                      size_t *length, MagickWand **failed) {
+  MagickWand *work = MagickGetImage(wand), *palette = NULL;
+  ssize_t index = MagickGetIteratorIndex(wand);
+  size_t frames = MagickGetNumberImages(wand), i, j, w, hh;
+  struct blp_palette *colors = NULL;
+  unsigned char *rgba = NULL, *rgb = NULL;
+  const char *err = NULL;
+  *failed = wand;
+  *blob = NULL;
+  if (work == NULL) {
+    return blp_magick_failed;
+  }
+  h->width = MagickGetImageWidth(work);
+  h->height = MagickGetImageHeight(work);
+  if (h->width > 65535 || h->height > 65535) {
+    DestroyMagickWand(work);
+    return "image is too large for BLP";
+  }
+  for (h->levels = 1; o->mipmaps && h->levels < BLP_MAX_LEVELS && (h->width | h->height) >> h->levels; ++h->levels) {
+  }
+  *length = blp_layout(h);
+  *blob = malloc(*length);
+  rgba = malloc(h->width * h->height * 4);
+  rgb = h->encoding == BLP_PALETTE ? malloc(h->width * h->height * 3) : NULL;
+  colors = calloc(1, sizeof(*colors));
+  if (*blob == NULL || rgba == NULL || colors == NULL || (h->encoding == BLP_PALETTE && rgb == NULL)) {
+    err = "out of memory encoding BLP image";
+  }
+  for (i = 0; err == NULL && i < h->levels; ++i) {
+    blp_level_size(h, i, &w, &hh);
+    if (i > 0) {
+      if (index + i < frames && MagickSetIteratorIndex(wand, index + i) == MagickTrue &&
+          MagickGetImageWidth(wand) == w && MagickGetImageHeight(wand) == hh) {
+        DestroyMagickWand(work);
+        work = MagickGetImage(wand);
+      } else if (MagickResizeImage(work, w, hh, BoxFilter, 1.0) != MagickTrue) {
+        *failed = work;
+        err = blp_magick_failed;
+        break;
+      }
+    }
+    if (work == NULL || MagickExportImagePixels(work, 0, 0, w, hh, "RGBA", CharPixel, rgba) != MagickTrue) {
+      *failed = work == NULL ? wand : work;
+      err = blp_magick_failed;
+      break;
+    }
+    for (j = 0; h->alpha_bits == 0 && j < w * hh; ++j) {
+      rgba[j * 4 + 3] = 255;
+    }
+    if (h->encoding == BLP_PALETTE) {
+      for (j = 0; j < w * hh; ++j) {
+        memcpy(rgb + j * 3, rgba + j * 4, 3);
+      }
+      if (blp_quantize(&palette, w, hh, o->dither, rgb, failed) != MagickTrue) {
+        err = blp_magick_failed;
+        break;
+      }
+    }
+    blp_encode_level(h, o->quality, colors, rgba, rgb, i, *blob + h->offsets[i]);
+  }
+  MagickSetIteratorIndex(wand, index);
+  if (err == NULL) {
+    blp_write_header(h, colors, *blob);
+  } else {
+    free(*blob);
+    *blob = NULL;
+  }
+  /* The wand holding the error is left for magick_error to report. */
+  if (work != NULL && work != *failed) {
+    DestroyMagickWand(work);
+  }
+  if (palette != NULL && palette != *failed) {
+    DestroyMagickWand(palette);
+  }
+  free(colors);
+  free(rgb);
+  free(rgba);
+  return err;
+}
@@ -0,0 +1,41 @@
+#ifndef LUAMAGICK_BLP_H
+#define LUAMAGICK_BLP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wand/MagickWand.h>
+
+/* BLP1 and BLP2 textures, palettized, DXT-compressed or raw BGRA. */
+
+#define BLP_MAX_LEVELS 16
+
+enum blp_encoding { BLP_JPEG, BLP_PALETTE, BLP_DXT, BLP_BGRA };
+
+struct blp_header {
+  int version;
+  int encoding;
+  int alpha_bits;
+  int alpha_type;
+  int format;
+  size_t width;
+  size_t height;
+  size_t levels;
+  uint32_t offsets[BLP_MAX_LEVELS];
+  uint32_t sizes[BLP_MAX_LEVELS];
+  const unsigned char *palette;
+};
+
+struct blp_options {
+  int dither;
+  int mipmaps;
+  int quality;
+};
+
+/* Returned in place of a message when the error is on a wand. */
+extern const char blp_magick_failed[];
+
+const char *blp_read(MagickWand *wand, const unsigned char *data, size_t length, int mipmaps);
+const char *blp_write(MagickWand *wand, struct blp_header *h, const struct blp_options *o, unsigned char **blob,
+                      size_t *length, MagickWand **failed);
+
+#endif
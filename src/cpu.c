@@ -0,0 +1,82 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wand/MagickWand.h>
+
+#include "cpu.h"
+
+#define MAX_ROW_THREADS 64
+#define MIN_ROWS_PER_THREAD 16
+
+struct row_job {
+  row_task task;
+  void *ctx;
+  size_t begin;
+  size_t end;
+};
+
+static void *run_row_job(void *p) {
+  struct row_job *job = p;
+  job->task(job->ctx, job->begin, job->end);
+  return NULL;
+}
+
+/* Runs task over contiguous bands of rows on up to ImageMagick's thread limit,
+ * so MAGICK_THREAD_LIMIT applies to luamagick's own loops too, giving each
+ * thread at least min_rows rows. */
+void parallel_for(size_t rows, size_t min_rows, row_task task, void *ctx) {
+  struct row_job jobs[MAX_ROW_THREADS];
+  pthread_t threads[MAX_ROW_THREADS];
+  int started[MAX_ROW_THREADS];
+  size_t n = MagickGetResourceLimit(ThreadResource);
+  size_t i;
+  if (n > MAX_ROW_THREADS) {
+    n = MAX_ROW_THREADS;
+  }
+  if (n > rows / min_rows) {
+    n = rows / min_rows;
+  }
+  if (n <= 1) {
+    task(ctx, 0, rows);
+    return;
+  }
+  for (i = 0; i < n; ++i) {
+    jobs[i].task = task;
+    jobs[i].ctx = ctx;
+    jobs[i].begin = rows * i / n;
+    jobs[i].end = rows * (i + 1) / n;
+  }
+  for (i = 1; i < n; ++i) {
+    started[i] = pthread_create(&threads[i], NULL, run_row_job, &jobs[i]) == 0;
+    if (!started[i]) {
+      run_row_job(&jobs[i]);
+    }
+  }
+  run_row_job(&jobs[0]);
+  for (i = 1; i < n; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+}
+
+void parallel_rows(size_t rows, row_task task, void *ctx) {
+  parallel_for(rows, MIN_ROWS_PER_THREAD, task, ctx);
+}
+
+/* LUAMAGICK_SIMD=scalar, sse2 or avx2 caps the kernels, e.g. to compare them. */
+int simd_level(void) {
+#ifdef SIMD_X86
+  const char *limit = getenv("LUAMAGICK_SIMD");
+  __builtin_cpu_init();
+  if (limit != NULL && strcmp(limit, "scalar") == 0) {
+    return SIMD_SCALAR;
+  }
+  if ((limit == NULL || strcmp(limit, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+    return SIMD_AVX2;
+  }
+  return SIMD_SSE2;
+#else
+  return SIMD_SCALAR;
+#endif
+}
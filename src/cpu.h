@@ -0,0 +1,21 @@
+#ifndef LUAMAGICK_CPU_H
+#define LUAMAGICK_CPU_H
+
+#include <stddef.h>
+
+/* Threads and instruction sets shared by the native codecs. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+enum simd_level { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2 };
+
+typedef void (*row_task)(void *ctx, size_t begin, size_t end);
+
+void parallel_for(size_t rows, size_t min_rows, row_task task, void *ctx);
+void parallel_rows(size_t rows, row_task task, void *ctx);
+int simd_level(void);
+
+#endif
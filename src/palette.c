@@ -0,0 +1,357 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "palette.h"
+
+static void premultiply(const unsigned char *rgba, float *p) {
+  float a = rgba[3] / 255.0f;
+  p[0] = rgba[0] * a;
+  p[1] = rgba[1] * a;
+  p[2] = rgba[2] * a;
+  p[3] = rgba[3];
+}
+
+static void palette_tree_build(struct palette_tree *t, size_t lo, size_t hi) {
+  size_t mid = (lo + hi) / 2, i, j;
+  float min[4], max[4], color[4];
+  unsigned char rgba[4];
+  int axis = 0, c;
+  if (hi - lo <= 1) {
+    return;
+  }
+  for (c = 0; c < 4; ++c) {
+    min[c] = max[c] = t->colors[lo][c];
+    for (i = lo + 1; i < hi; ++i) {
+      min[c] = t->colors[i][c] < min[c] ? t->colors[i][c] : min[c];
+      max[c] = t->colors[i][c] > max[c] ? t->colors[i][c] : max[c];
+    }
+    axis = max[c] - min[c] > max[axis] - min[axis] ? c : axis;
+  }
+  for (i = lo + 1; i < hi; ++i) {
+    memcpy(color, t->colors[i], sizeof(color));
+    memcpy(rgba, t->rgba[i], sizeof(rgba));
+    for (j = i; j > lo && t->colors[j - 1][axis] > color[axis]; --j) {
+      memcpy(t->colors[j], t->colors[j - 1], sizeof(color));
+      memcpy(t->rgba[j], t->rgba[j - 1], sizeof(rgba));
+    }
+    memcpy(t->colors[j], color, sizeof(color));
+    memcpy(t->rgba[j], rgba, sizeof(rgba));
+  }
+  t->axis[mid] = axis;
+  palette_tree_build(t, lo, mid);
+  palette_tree_build(t, mid + 1, hi);
+}
+
+void palette_tree_init(struct palette_tree *t, const unsigned char *rgba, size_t n) {
+  size_t i;
+  t->n = n;
+  t->has_alpha = 0;
+  memset(t->axis, 0, sizeof(t->axis));
+  for (i = 0; i < n; ++i) {
+    memcpy(t->rgba[i], rgba + 4 * i, 4);
+    premultiply(t->rgba[i], t->colors[i]);
+    t->has_alpha |= t->rgba[i][3] < 255;
+  }
+  palette_tree_build(t, 0, n);
+}
+
+static void palette_tree_search(const struct palette_tree *t, size_t lo, size_t hi, const float *p, size_t *best,
+                                float *dist) {
+  size_t mid = (lo + hi) / 2;
+  float d = 0, diff;
+  int c, axis;
+  if (lo >= hi) {
+    return;
+  }
+  for (c = 0; c < 4; ++c) {
+    diff = p[c] - t->colors[mid][c];
+    d += diff * diff;
+  }
+  if (d < *dist) {
+    *dist = d;
+    *best = mid;
+  }
+  axis = t->axis[mid];
+  diff = p[axis] - t->colors[mid][axis];
+  palette_tree_search(t, diff < 0 ? lo : mid + 1, diff < 0 ? mid : hi, p, best, dist);
+  if (diff * diff < *dist) {
+    palette_tree_search(t, diff < 0 ? mid + 1 : lo, diff < 0 ? hi : mid, p, best, dist);
+  }
+}
+
+static size_t palette_nearest(const struct palette_tree *t, const float *p) {
+  size_t best = 0;
+  float dist = 1e30f;
+  palette_tree_search(t, 0, t->n, p, &best, &dist);
+  return best;
+}
+
+struct palette_job {
+  const struct palette_tree *tree;
+  unsigned char *pixels;
+  size_t width;
+};
+
+/* Rows map independently, each with a small cache of recent colors, since
+ * sprites and artwork tend to repeat them. */
+static void palette_map_rows(void *ctx, size_t begin, size_t end) {
+  struct palette_job *job = ctx;
+  uint32_t keys[64];
+  unsigned char found[64];
+  unsigned char *px;
+  uint32_t key, h;
+  size_t x, y, i;
+  float p[4];
+  for (y = begin; y < end; ++y) {
+    memset(found, 0, sizeof(found));
+    for (x = 0; x < job->width; ++x) {
+      px = job->pixels + 4 * (y * job->width + x);
+      key = px[0] | (uint32_t)px[1] << 8 | (uint32_t)px[2] << 16 | (uint32_t)px[3] << 24;
+      h = (key * 2654435761u) >> 26;
+      if (found[h] && keys[h] == key) {
+        i = found[h] - 1;
+      } else {
+        premultiply(px, p);
+        i = palette_nearest(job->tree, p);
+        keys[h] = key;
+        found[h] = i + 1;
+      }
+      memcpy(px, job->tree->rgba[i], 4);
+    }
+  }
+}
+
+void palette_map(const struct palette_tree *t, unsigned char *pixels, size_t width, size_t height) {
+  struct palette_job job;
+  job.tree = t;
+  job.pixels = pixels;
+  job.width = width;
+  parallel_rows(height, palette_map_rows, &job);
+}
+
+/* Floyd-Steinberg error diffusion in serpentine order; errors carry over
+ * between rows, so this runs on one thread. */
+int palette_dither(const struct palette_tree *t, unsigned char *pixels, size_t width, size_t height) {
+  float *errors = calloc(2 * (width + 2) * 4, sizeof(*errors)), *cur, *next, p[4], e;
+  unsigned char *px;
+  size_t x, y, i, best;
+  int c, dir;
+  if (errors == NULL) {
+    return 0;
+  }
+  for (y = 0; y < height; ++y) {
+    cur = errors + (y % 2) * (width + 2) * 4;
+    next = errors + (1 - y % 2) * (width + 2) * 4;
+    memset(next, 0, (width + 2) * 4 * sizeof(*next));
+    dir = y % 2 ? -1 : 1;
+    for (i = 0; i < width; ++i) {
+      x = dir > 0 ? i : width - 1 - i;
+      px = pixels + 4 * (y * width + x);
+      premultiply(px, p);
+      for (c = 0; c < 4; ++c) {
+        p[c] += cur[4 * (x + 1) + c];
+        p[c] = p[c] < 0 ? 0 : p[c] > 255 ? 255 : p[c];
+      }
+      best = palette_nearest(t, p);
+      memcpy(px, t->rgba[best], 4);
+      for (c = 0; c < 4; ++c) {
+        e = p[c] - t->colors[best][c];
+        cur[4 * (x + 1 + dir) + c] += e * 7 / 16;
+        next[4 * (x + 1 - dir) + c] += e * 3 / 16;
+        next[4 * (x + 1) + c] += e * 5 / 16;
+        next[4 * (x + 1 + dir) + c] += e * 1 / 16;
+      }
+    }
+  }
+  free(errors);
+  return 1;
+}
+
+#define PALETTE_PASSES 4
+
+struct palette_box {
+  int lo[4], hi[4];
+  size_t count;
+};
+
+struct kmeans_job {
+  const struct palette_tree *tree;
+  const unsigned char *samples;
+  double sums[PALETTE_MAX][5];
+  pthread_mutex_t lock;
+};
+
+static void kmeans_rows(void *ctx, size_t begin, size_t end) {
+  struct kmeans_job *job = ctx;
+  double sums[PALETTE_MAX][5];
+  size_t i, best;
+  float p[4];
+  int c;
+  memset(sums, 0, sizeof(sums));
+  for (i = begin; i < end; ++i) {
+    premultiply(job->samples + 4 * i, p);
+    best = palette_nearest(job->tree, p);
+    for (c = 0; c < 4; ++c) {
+      sums[best][c] += p[c];
+    }
+    sums[best][4] += 1;
+  }
+  pthread_mutex_lock(&job->lock);
+  for (i = 0; i < job->tree->n; ++i) {
+    for (c = 0; c < 5; ++c) {
+      job->sums[i][c] += sums[i][c];
+    }
+  }
+  pthread_mutex_unlock(&job->lock);
+}
+
+static size_t histogram_bin(const int *v) {
+  return v[0] | v[1] << 4 | v[2] << 8 | v[3] << 12;
+}
+
+/* Shrinks a box to the bins it holds samples in, and counts them. */
+static void palette_box_shrink(struct palette_box *box, const uint32_t *histogram) {
+  int v[4], lo[4] = {15, 15, 15, 15}, hi[4] = {0, 0, 0, 0}, c;
+  box->count = 0;
+  for (v[3] = box->lo[3]; v[3] <= box->hi[3]; ++v[3]) {
+    for (v[2] = box->lo[2]; v[2] <= box->hi[2]; ++v[2]) {
+      for (v[1] = box->lo[1]; v[1] <= box->hi[1]; ++v[1]) {
+        for (v[0] = box->lo[0]; v[0] <= box->hi[0]; ++v[0]) {
+          uint32_t n = histogram[histogram_bin(v)];
+          if (n == 0) {
+            continue;
+          }
+          box->count += n;
+          for (c = 0; c < 4; ++c) {
+            lo[c] = v[c] < lo[c] ? v[c] : lo[c];
+            hi[c] = v[c] > hi[c] ? v[c] : hi[c];
+          }
+        }
+      }
+    }
+  }
+  memcpy(box->lo, lo, sizeof(lo));
+  memcpy(box->hi, hi, sizeof(hi));
+}
+
+/* Splits the box at the median of its widest channel. */
+static void palette_box_split(struct palette_box *box, struct palette_box *other, const uint32_t *histogram) {
+  size_t marginal[16] = {0}, seen = 0;
+  int v[4], axis = 0, c, cut;
+  for (c = 1; c < 4; ++c) {
+    axis = box->hi[c] - box->lo[c] > box->hi[axis] - box->lo[axis] ? c : axis;
+  }
+  for (v[3] = box->lo[3]; v[3] <= box->hi[3]; ++v[3]) {
+    for (v[2] = box->lo[2]; v[2] <= box->hi[2]; ++v[2]) {
+      for (v[1] = box->lo[1]; v[1] <= box->hi[1]; ++v[1]) {
+        for (v[0] = box->lo[0]; v[0] <= box->hi[0]; ++v[0]) {
+          cut = v[axis];
+          marginal[cut] += histogram[histogram_bin(v)];
+        }
+      }
+    }
+  }
+  for (cut = box->lo[axis]; cut < box->hi[axis] - 1 && seen + marginal[cut] < box->count / 2; ++cut) {
+    seen += marginal[cut];
+  }
+  *other = *box;
+  box->hi[axis] = cut;
+  other->lo[axis] = cut + 1;
+  palette_box_shrink(box, histogram);
+  palette_box_shrink(other, histogram);
+}
+
+/* Median cut over a histogram of 4 bits per premultiplied channel gives the
+ * initial colors. */
+static size_t palette_median_cut(const unsigned char *samples, size_t count, size_t colors, uint32_t *histogram,
+                                 unsigned char *rgba) {
+  struct palette_box boxes[PALETTE_MAX];
+  size_t size, i, j;
+  int v[4], c;
+  float p[4];
+  memset(histogram, 0, 65536 * sizeof(*histogram));
+  for (i = 0; i < count; ++i) {
+    premultiply(samples + 4 * i, p);
+    for (c = 0; c < 4; ++c) {
+      v[c] = (int)(p[c] + 0.5f) >> 4;
+    }
+    ++histogram[histogram_bin(v)];
+  }
+  for (c = 0; c < 4; ++c) {
+    boxes[0].lo[c] = 0;
+    boxes[0].hi[c] = 15;
+  }
+  palette_box_shrink(&boxes[0], histogram);
+  for (size = 1; size < colors; ++size) {
+    /* Split the most populous box that has more than one bin. */
+    for (i = 0, j = size; i < size; ++i) {
+      int wide = 0;
+      for (c = 0; c < 4; ++c) {
+        wide |= boxes[i].hi[c] > boxes[i].lo[c];
+      }
+      if (wide && (j == size || boxes[i].count > boxes[j].count)) {
+        j = i;
+      }
+    }
+    if (j == size) {
+      break;
+    }
+    palette_box_split(&boxes[j], &boxes[size], histogram);
+  }
+  for (i = 0; i < size; ++i) {
+    int a = (boxes[i].lo[3] + boxes[i].hi[3] + 1) * 8;
+    for (c = 0; c < 3; ++c) {
+      int value = a > 0 ? (boxes[i].lo[c] + boxes[i].hi[c] + 1) * 8 * 255 / a : 0;
+      rgba[4 * i + c] = value < 255 ? value : 255;
+    }
+    rgba[4 * i + 3] = a;
+  }
+  return size;
+}
+
+/* K-means passes over the samples, run in parallel, then refine the colors. */
+static void palette_kmeans(struct kmeans_job *job, struct palette_tree *tree, size_t count, size_t size,
+                           unsigned char *rgba) {
+  size_t pass, i;
+  int c;
+  pthread_mutex_init(&job->lock, NULL);
+  job->tree = tree;
+  for (pass = 0; pass < PALETTE_PASSES; ++pass) {
+    palette_tree_init(tree, rgba, size);
+    memset(job->sums, 0, sizeof(job->sums));
+    parallel_rows(count, kmeans_rows, job);
+    for (i = 0; i < size; ++i) {
+      double a = job->sums[i][4] > 0 ? job->sums[i][3] / job->sums[i][4] : 0;
+      if (job->sums[i][4] == 0) {
+        memcpy(rgba + 4 * i, tree->rgba[i], 4);
+        continue;
+      }
+      for (c = 0; c < 3; ++c) {
+        rgba[4 * i + c] = a > 0 ? job->sums[i][c] / job->sums[i][4] * 255 / a + 0.5 : 0;
+      }
+      rgba[4 * i + 3] = a + 0.5;
+    }
+  }
+  pthread_mutex_destroy(&job->lock);
+}
+
+/* Fills rgba with up to colors colors for the samples, returning how many, or 0
+ * if out of memory. */
+size_t palette_build(const unsigned char *samples, size_t count, size_t colors, unsigned char *rgba) {
+  struct kmeans_job *job = malloc(sizeof(*job));
+  struct palette_tree *tree = malloc(sizeof(*tree));
+  uint32_t *histogram = malloc(65536 * sizeof(*histogram));
+  size_t size = 0;
+  if (job != NULL && tree != NULL && histogram != NULL) {
+    size = palette_median_cut(samples, count, colors, histogram, rgba);
+    job->samples = samples;
+    palette_kmeans(job, tree, count, size, rgba);
+  }
+  free(histogram);
+  free(tree);
+  free(job);
+  return size;
+}
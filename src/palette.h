@@ -0,0 +1,26 @@
+#ifndef LUAMAGICK_PALETTE_H
+#define LUAMAGICK_PALETTE_H
+
+#include <stddef.h>
+
+/* Palettes are one-row images of up to 256 colors. Colors are compared in
+ * premultiplied RGBA, so that all fully transparent pixels are alike, and
+ * matched through a k-d tree over the palette stored in place: each range's
+ * middle entry splits the rest on its axis. */
+#define PALETTE_MAX 256
+#define PALETTE_SAMPLES (1 << 20)
+
+struct palette_tree {
+  size_t n;
+  int has_alpha;
+  float colors[PALETTE_MAX][4];
+  unsigned char rgba[PALETTE_MAX][4];
+  unsigned char axis[PALETTE_MAX];
+};
+
+void palette_tree_init(struct palette_tree *t, const unsigned char *rgba, size_t n);
+void palette_map(const struct palette_tree *t, unsigned char *pixels, size_t width, size_t height);
+int palette_dither(const struct palette_tree *t, unsigned char *pixels, size_t width, size_t height);
+size_t palette_build(const unsigned char *samples, size_t count, size_t colors, unsigned char *rgba);
+
+#endif
@@ -0,0 +1,226 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "xxh3.h"
+
+/* XXH3 64-bit with the default secret and seed 0, following the reference at
+ * https://github.com/Cyan4973/xxHash. */
+static const unsigned char xxh3_secret[192] = {
+  0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+  0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+  0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+  0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+  0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+  0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+  0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+  0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+  0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+  0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+  0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+  0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_STRIPES_PER_BLOCK ((sizeof(xxh3_secret) - 64) / 8)
+
+static uint32_t xxh_read32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t xxh_read64(const unsigned char *p) {
+  return (uint64_t)xxh_read32(p) | (uint64_t)xxh_read32(p + 4) << 32;
+}
+
+static uint64_t xxh_rotl64(uint64_t x, int r) {
+  return x << r | x >> (64 - r);
+}
+
+static uint64_t xxh_swap64(uint64_t x) {
+  x = (x & 0x00FF00FF00FF00FFULL) << 8 | (x >> 8 & 0x00FF00FF00FF00FFULL);
+  x = (x & 0x0000FFFF0000FFFFULL) << 16 | (x >> 16 & 0x0000FFFF0000FFFFULL);
+  return x << 32 | x >> 32;
+}
+
+static uint64_t xxh_mul128_fold64(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 p = (unsigned __int128)a * b;
+  return (uint64_t)p ^ (uint64_t)(p >> 64);
+#else
+  uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF), hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+  uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32), hi_hi = (a >> 32) * (b >> 32);
+  uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+  return ((cross << 32) | (lo_lo & 0xFFFFFFFF)) ^ ((hi_lo >> 32) + (cross >> 32) + hi_hi);
+#endif
+}
+
+static uint64_t xxh64_avalanche(uint64_t h) {
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  return h ^ h >> 32;
+}
+
+static uint64_t xxh3_avalanche(uint64_t h) {
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ULL;
+  return h ^ h >> 32;
+}
+
+static uint64_t xxh3_rrmxmx(uint64_t h, uint64_t length) {
+  h ^= xxh_rotl64(h, 49) ^ xxh_rotl64(h, 24);
+  h *= 0x9FB21C651E98DF25ULL;
+  h ^= (h >> 35) + length;
+  h *= 0x9FB21C651E98DF25ULL;
+  return h ^ h >> 28;
+}
+
+static uint64_t xxh3_mix16(const unsigned char *input, const unsigned char *secret) {
+  return xxh_mul128_fold64(xxh_read64(input) ^ xxh_read64(secret), xxh_read64(input + 8) ^ xxh_read64(secret + 8));
+}
+
+/* Long inputs are consumed in 64-byte stripes by eight accumulators; this is
+ * the hot loop, and has SSE2 and AVX2 versions. */
+typedef void (*xxh3_accumulate_kernel)(uint64_t acc[8], const unsigned char *input, const unsigned char *secret,
+                                       size_t stripes);
+
+static void xxh3_accumulate_scalar(uint64_t acc[8], const unsigned char *input, const unsigned char *secret,
+                                   size_t stripes) {
+  size_t n;
+  int i;
+  for (n = 0; n < stripes; ++n) {
+    for (i = 0; i < 8; ++i) {
+      uint64_t value = xxh_read64(input + n * 64 + i * 8), key = value ^ xxh_read64(secret + n * 8 + i * 8);
+      acc[i ^ 1] += value;
+      acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+  }
+}
+
+#ifdef SIMD_X86
+__attribute__((target("sse2"))) static void xxh3_accumulate_sse2(uint64_t acc[8], const unsigned char *input,
+                                                                 const unsigned char *secret, size_t stripes) {
+  __m128i a[4];
+  size_t n;
+  int i;
+  for (i = 0; i < 4; ++i) {
+    a[i] = _mm_loadu_si128((const __m128i *)acc + i);
+  }
+  for (n = 0; n < stripes; ++n) {
+    for (i = 0; i < 4; ++i) {
+      __m128i value = _mm_loadu_si128((const __m128i *)(input + n * 64) + i);
+      __m128i key = _mm_xor_si128(value, _mm_loadu_si128((const __m128i *)(secret + n * 8) + i));
+      __m128i product = _mm_mul_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)));
+      a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2))));
+    }
+  }
+  for (i = 0; i < 4; ++i) {
+    _mm_storeu_si128((__m128i *)acc + i, a[i]);
+  }
+}
+
+__attribute__((target("avx2"))) static void xxh3_accumulate_avx2(uint64_t acc[8], const unsigned char *input,
+                                                                 const unsigned char *secret, size_t stripes) {
+  __m256i a[2];
+  size_t n;
+  int i;
+  for (i = 0; i < 2; ++i) {
+    a[i] = _mm256_loadu_si256((const __m256i *)acc + i);
+  }
+  for (n = 0; n < stripes; ++n) {
+    for (i = 0; i < 2; ++i) {
+      __m256i value = _mm256_loadu_si256((const __m256i *)(input + n * 64) + i);
+      __m256i key = _mm256_xor_si256(value, _mm256_loadu_si256((const __m256i *)(secret + n * 8) + i));
+      __m256i product = _mm256_mul_epu32(key, _mm256_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)));
+      a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(product, _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2))));
+    }
+  }
+  for (i = 0; i < 2; ++i) {
+    _mm256_storeu_si256((__m256i *)acc + i, a[i]);
+  }
+}
+#endif
+
+static xxh3_accumulate_kernel xxh3_accumulate = xxh3_accumulate_scalar;
+
+void xxh3_setup_kernels(void) {
+#ifdef SIMD_X86
+  int level = simd_level();
+  if (level == SIMD_AVX2) {
+    xxh3_accumulate = xxh3_accumulate_avx2;
+  } else if (level == SIMD_SSE2) {
+    xxh3_accumulate = xxh3_accumulate_sse2;
+  }
+#endif
+}
+
+static void xxh3_scramble(uint64_t acc[8], const unsigned char *secret) {
+  int i;
+  for (i = 0; i < 8; ++i) {
+    acc[i] = (acc[i] ^ acc[i] >> 47 ^ xxh_read64(secret + i * 8)) * XXH_PRIME32_1;
+  }
+}
+
+static uint64_t xxh3_long(const unsigned char *input, size_t length) {
+  uint64_t acc[8] = {XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+                     XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1};
+  size_t block = XXH_STRIPES_PER_BLOCK * 64, blocks = (length - 1) / block, n;
+  uint64_t h = length * XXH_PRIME64_1;
+  int i;
+  for (n = 0; n < blocks; ++n) {
+    xxh3_accumulate(acc, input + n * block, xxh3_secret, XXH_STRIPES_PER_BLOCK);
+    xxh3_scramble(acc, xxh3_secret + sizeof(xxh3_secret) - 64);
+  }
+  xxh3_accumulate(acc, input + blocks * block, xxh3_secret, (length - 1 - blocks * block) / 64);
+  xxh3_accumulate(acc, input + length - 64, xxh3_secret + sizeof(xxh3_secret) - 64 - 7, 1);
+  for (i = 0; i < 4; ++i) {
+    h += xxh_mul128_fold64(acc[2 * i] ^ xxh_read64(xxh3_secret + 11 + 16 * i),
+                           acc[2 * i + 1] ^ xxh_read64(xxh3_secret + 11 + 16 * i + 8));
+  }
+  return xxh3_avalanche(h);
+}
+
+uint64_t xxh3_64(const void *data, size_t length) {
+  const unsigned char *input = data, *secret = xxh3_secret;
+  uint64_t h;
+  size_t i;
+  if (length > 240) {
+    return xxh3_long(input, length);
+  } else if (length > 128) {
+    h = length * XXH_PRIME64_1;
+    for (i = 0; i < 8; ++i) {
+      h += xxh3_mix16(input + 16 * i, secret + 16 * i);
+    }
+    h = xxh3_avalanche(h);
+    for (i = 8; i < length / 16; ++i) {
+      h += xxh3_mix16(input + 16 * i, secret + 16 * (i - 8) + 3);
+    }
+    return xxh3_avalanche(h + xxh3_mix16(input + length - 16, secret + 136 - 17));
+  } else if (length > 16) {
+    h = length * XXH_PRIME64_1;
+    for (i = (length - 1) / 32 + 1; i-- > 0;) {
+      h += xxh3_mix16(input + 16 * i, secret + 32 * i);
+      h += xxh3_mix16(input + length - 16 * (i + 1), secret + 32 * i + 16);
+    }
+    return xxh3_avalanche(h);
+  } else if (length > 8) {
+    uint64_t lo = xxh_read64(input) ^ (xxh_read64(secret + 24) ^ xxh_read64(secret + 32));
+    uint64_t hi = xxh_read64(input + length - 8) ^ (xxh_read64(secret + 40) ^ xxh_read64(secret + 48));
+    return xxh3_avalanche(length + xxh_swap64(lo) + hi + xxh_mul128_fold64(lo, hi));
+  } else if (length >= 4) {
+    uint64_t value = xxh_read32(input + length - 4) + ((uint64_t)xxh_read32(input) << 32);
+    return xxh3_rrmxmx(value ^ (xxh_read64(secret + 8) ^ xxh_read64(secret + 16)), length);
+  } else if (length > 0) {
+    uint32_t combined = (uint32_t)input[0] << 16 | (uint32_t)input[length >> 1] << 24 | input[length - 1] | length << 8;
+    return xxh64_avalanche(combined ^ (uint64_t)(xxh_read32(secret) ^ xxh_read32(secret + 4)));
+  }
+  return xxh64_avalanche(xxh_read64(secret + 56) ^ xxh_read64(secret + 64));
+}
@@ -0,0 +1,12 @@
+#ifndef LUAMAGICK_XXH3_H
+#define LUAMAGICK_XXH3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* XXH3 64-bit hashes with the default secret and seed 0. */
+
+uint64_t xxh3_64(const void *data, size_t length);
+void xxh3_setup_kernels(void);
+
+#endif